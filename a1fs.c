@@ -7,15 +7,28 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <linux/fs.h>
 
-// Using 2.9.x FUSE API
-#define FUSE_USE_VERSION 29
+// Using 3.x FUSE API
+#define FUSE_USE_VERSION 31
 #include <fuse.h>
 
 #include "a1fs.h"
+#include "alloc.h"
+#include "compress.h"
+#include "defrag.h"
+#include "discard.h"
+#include "extent.h"
 #include "fs_ctx.h"
+#include "heapstat.h"
 #include "options.h"
+#include "lazytime.h"
 #include "map.h"
+#include "memops.h"
+#include "reclaim.h"
+#include "reflink.h"
+#include "snapshot.h"
 
 //NOTE: All path arguments are absolute paths within the a1fs file system and
 // start with a '/' that corresponds to the a1fs root directory.
@@ -30,6 +43,228 @@
 
 
 static fs_ctx *get_fs(void);
+static a1fs_dentry *dir_grow(fs_ctx *fs, a1fs_inode *dir);
+
+/* Returns the entry named name in directory dir, or NULL if there is none. */
+static a1fs_dentry *dir_lookup(fs_ctx *fs, a1fs_inode *dir, const char *name)
+{
+    a1fs_blk_t n = ext_nblocks(fs, dir);
+    for (a1fs_blk_t l = 0; l < n; l++) {
+        a1fs_blk_t b;
+        if (!ext_map(fs, dir, l, &b, NULL)) break;
+        a1fs_dentry *entry = fs->ops->dentry_find(fs_data_block(fs, b), name);
+        if (entry != NULL) return entry;
+    }
+    return NULL;
+}
+
+/* Returns the entry that refers to inode ino in directory dir, or NULL. */
+static a1fs_dentry *dir_find_ino(fs_ctx *fs, a1fs_inode *dir, a1fs_ino_t ino)
+{
+    a1fs_blk_t n = ext_nblocks(fs, dir);
+    for (a1fs_blk_t l = 0; l < n; l++) {
+        a1fs_blk_t b;
+        if (!ext_map(fs, dir, l, &b, NULL)) break;
+        a1fs_dentry *entry = fs->ops->dentry_find_ino(fs_data_block(fs, b), ino);
+        if (entry != NULL) return entry;
+    }
+    return NULL;
+}
+
+/* Returns whether the free entry summary bit of group g of directory dir is set. */
+static bool slot_test(a1fs_inode *dir, unsigned int g)
+{
+    return (dir->slot_map[g / 64] >> (g % 64)) & 1;
+}
+
+/* Doubles the number of blocks that each free entry summary bit of directory
+ * dir covers, so that it covers twice as many blocks.
+ */
+static void slot_widen(a1fs_inode *dir)
+{
+    uint64_t map[A1FS_SLOT_WORDS] = {0};
+    for (unsigned int g = 0; g < A1FS_SLOT_BITS; g++) {
+        if (slot_test(dir, g)) map[g / 128] |= 1ull << (g / 2 % 64);
+    }
+    memcpy(dir->slot_map, map, sizeof(map));
+    dir->slot_shift++;
+}
+
+/* Records that logical block l of directory dir can have a free entry. */
+static void slot_mark(a1fs_inode *dir, a1fs_blk_t l)
+{
+    if (!(dir->flags & A1FS_INODE_SLOTS)) return;   //rebuilt before it is used
+    while ((l >> dir->slot_shift) >= A1FS_SLOT_BITS) slot_widen(dir);
+    unsigned int g = l >> dir->slot_shift;
+    dir->slot_map[g / 64] |= 1ull << (g % 64);
+    if (l < dir->slot_hint) dir->slot_hint = l;
+}
+
+/* Rebuilds the free entry summary of directory dir from its entries. */
+static void slot_rebuild(fs_ctx *fs, a1fs_inode *dir)
+{
+    a1fs_blk_t n = ext_nblocks(fs, dir);
+    memset(dir->slot_map, 0, sizeof(dir->slot_map));
+    dir->slot_shift = 0;
+    while (n > 0 && ((n - 1) >> dir->slot_shift) >= A1FS_SLOT_BITS) dir->slot_shift++;
+    dir->slot_hint = n;
+    dir->flags |= A1FS_INODE_SLOTS;
+    for (a1fs_blk_t l = 0; l < n; l++) {
+        a1fs_blk_t b;
+        if (!ext_map(fs, dir, l, &b, NULL)) break;
+        if (fs->ops->dentry_free(fs_data_block(fs, b)) != NULL) slot_mark(dir, l);
+    }
+}
+
+/* Returns a free entry in directory dir. Only the blocks that the free entry
+ * summary says can have one are looked at; the ones found full are taken out
+ * of it. Adds a block to the directory if all of its entries are in use.
+ * Returns NULL if there is no space left.
+ */
+static a1fs_dentry *dir_alloc_entry(fs_ctx *fs, a1fs_inode *dir)
+{
+    if (!(dir->flags & A1FS_INODE_SLOTS)) slot_rebuild(fs, dir);
+
+    a1fs_blk_t n = ext_nblocks(fs, dir);
+    a1fs_blk_t l = dir->slot_hint;
+    while (l < n) {
+        unsigned int g = l >> dir->slot_shift;
+        a1fs_blk_t end = (a1fs_blk_t)(g + 1) << dir->slot_shift;
+        if (end > n) end = n;
+        if (!slot_test(dir, g)) {
+            l = end;
+            continue;
+        }
+        //the blocks of the group before the hint are full
+        for (; l < end; l++) {
+            a1fs_blk_t b;
+            if (!ext_map(fs, dir, l, &b, NULL)) break;
+            a1fs_dentry *entry = fs->ops->dentry_free(fs_data_block(fs, b));
+            if (entry != NULL) {
+                dir->slot_hint = l;
+                return entry;
+            }
+        }
+        if (l < end) break;
+        dir->slot_map[g / 64] &= ~(1ull << (g % 64));
+    }
+    dir->slot_hint = n;
+    return dir_grow(fs, dir);
+}
+
+/* Adds an empty block to directory dir. Returns its first entry, or NULL if
+ * there is no space left.
+ */
+static a1fs_dentry *dir_grow(fs_ctx *fs, a1fs_inode *dir)
+{
+    //allocate the new block next to the last one
+    a1fs_ext_leaf last;
+    a1fs_blk_t goal = ext_last(fs, dir, &last) ? last.ext.start + last.ext.count : 0;
+    a1fs_blk_t got;
+    long b = alloc_blocks(fs, goal, 1, &got);
+    if (b < 0) return NULL;
+    if (ext_append(fs, dir, b, 1) < 0) {
+        free_blocks(fs, b, 1);
+        return NULL;
+    }
+    memset(fs_data_block(fs, b), 0, fs->block_size);
+    slot_mark(dir, dir->size >> fs->block_shift);
+    dir->size += fs->block_size;
+    return fs_data_block(fs, b);
+}
+
+/* Records that the directory block that holds entry is being modified. */
+static void entry_changed(fs_ctx *fs, a1fs_dentry *entry)
+{
+    if (fs->cbt != NULL) fs_data_changed(fs, fs_data_block_num(fs, entry), 1);
+}
+
+/* Returns the last in-use entry of directory block blk, or NULL if there is none. */
+static a1fs_dentry *block_last_entry(fs_ctx *fs, a1fs_dentry *blk)
+{
+    for (unsigned int i = fs->block_size / sizeof(a1fs_dentry); i > 0; i--) {
+        if (blk[i - 1].name[0] != '\0') return &blk[i - 1];
+    }
+    return NULL;
+}
+
+/* Removes entry from directory dir. The last entry of the directory is moved
+ * into the hole, and trailing blocks left without entries are freed, so that
+ * the directory only has as many blocks as its entries need and lookups do
+ * not scan blocks that used to hold entries. The first block is always kept.
+ */
+static void dir_remove_entry(fs_ctx *fs, a1fs_inode *dir, a1fs_dentry *entry)
+{
+    memset(entry, 0, sizeof(a1fs_dentry));
+    entry_changed(fs, entry);
+
+    a1fs_blk_t n = ext_nblocks(fs, dir);
+    a1fs_blk_t b;
+    if (n == 0 || !ext_map(fs, dir, n - 1, &b, NULL)) {
+        dir->flags &= ~A1FS_INODE_SLOTS;
+        return;
+    }
+    a1fs_dentry *last_blk = fs_data_block(fs, b);
+    a1fs_dentry *tail = block_last_entry(fs, last_blk);
+    bool in_last = entry >= last_blk && (void*)entry < (void*)last_blk + fs->block_size;
+    if (tail != NULL && (!in_last || tail > entry)) {
+        *entry = *tail;
+        memset(tail, 0, sizeof(a1fs_dentry));
+        fs_data_changed(fs, b, 1);
+    }
+    //the free entry is now in the last block, unless that block was already
+    //empty, in which case the block of entry is not known here
+    if (tail != NULL || in_last) {
+        slot_mark(dir, n - 1);
+    } else {
+        dir->flags &= ~A1FS_INODE_SLOTS;
+    }
+
+    //directories made before compaction can have several empty blocks at the end
+    while (n > 1 && ext_map(fs, dir, n - 1, &b, NULL) &&
+           block_last_entry(fs, fs_data_block(fs, b)) == NULL)
+    {
+        n--;
+        ext_truncate(fs, dir, n);
+        dir->size = (uint64_t)n << fs->block_shift;
+    }
+}
+
+/* Finds the next component of the path at *p, which ends at end. Sets *p to
+ * the start of the component and returns its length, or 0 at the end of the
+ * path. The path is not modified.
+ */
+static size_t path_next(const char **p, const char *end)
+{
+    const char *s = *p;
+    while (s < end && *s == '/') s++;
+    const char *e = s;
+    while (e < end && *e != '/') e++;
+    *p = s;
+    return e - s;
+}
+
+/* Returns the inode number of the file at path [path, end). The components are
+ * looked up where they are in the path, so no copy of it is made. Returns a
+ * path_lookup() error if the file does not exist.
+ */
+static int path_walk(fs_ctx *fs, const char *path, const char *end)
+{
+    a1fs_inode *in = fs->itable;    //root inode
+    char name[A1FS_NAME_MAX];
+    size_t len;
+    for (const char *p = path; (len = path_next(&p, end)) != 0; p += len) {
+        if (len >= A1FS_NAME_MAX) return -3;
+        if (!S_ISDIR(in->mode)) return -2;
+        //dentry names are NUL-terminated, so the component is compared from a copy on the stack
+        memcpy(name, p, len);
+        name[len] = '\0';
+        a1fs_dentry *entry = dir_lookup(fs, in, name);
+        if (entry == NULL) return -1;
+        in = &fs->itable[entry->ino];
+    }
+    return in->num;
+}
 
 /* Returns the inode number for the element at the end of the path
  * if it exists.
@@ -37,116 +272,160 @@ static fs_ctx *get_fs(void);
  *   - The path is not an absolute path: -1
  *   - An element on the path cannot be found: -1
  *   - component is not directory: -2
+ *   - component name is too long: -3
  */
 int path_lookup(const char *path) {
-    fs_ctx *fs = get_fs();
     if(path[0] != '/') {
         fprintf(stderr, "Not an absolute path\n");
         return -1;
     }
-    else if (!strcmp(path, "/")){
-        return 0;  //root inode
+    return path_walk(get_fs(), path, path + strlen(path));
+}
+
+/* Convert a path_lookup() error into -errno. */
+static int lookup_error(int num)
+{
+    if (num == -2) return -ENOTDIR;
+    if (num == -3) return -ENAMETOOLONG;
+    return -ENOENT;
+}
+
+/* Looks up the parent directory of path. *name receives a pointer to the last
+ * component of path. Returns the parent's inode number or a path_lookup() error.
+ */
+static int parent_lookup(const char *path, const char **name)
+{
+    const char *slash = strrchr(path, '/');
+    *name = slash + 1;
+    return path_walk(get_fs(), path, slash);
+}
+
+/* Sets the size of a file, allocating zeroed blocks or freeing blocks as
+ * needed. Returns 0 on success or -ENOSPC.
+ */
+static int inode_resize(fs_ctx *fs, a1fs_inode *in, uint64_t size)
+{
+    if (in->flags & A1FS_INODE_COMPRESS) {
+        return compress_resize(fs, in, size);
     }
+    a1fs_blk_t have = ext_nblocks(fs, in);
+    a1fs_blk_t need = fs_blocks(fs, size);
 
-    char *path2 = strdup(path);
-    char *p = strtok(path2, "/");
-    int match = 0;
+    if (size < in->size) {
+        reclaim_truncate(fs, in, need);
+        in->size = size;
+        return 0;
+    }
 
-    struct a1fs_inode *block_inode = fs->itable;    //root inode
-    struct a1fs_dentry *entry = fs->btable;     //root block
-    while (p != NULL){
-       // if (strlen(p) >= A1FS_NAME_MAX) return -3;
-        //if (S_ISREG(block_inode->mode)) return -2;
-        for (int e=0; e < 12; e++){ //check all 12 direct extent pointers
-            int start = block_inode->extent[e].start, count = block_inode->extent[e].count;
-            if (count == 0){
-                continue;
-            }
-            for (int f = 0; f < count; f++){
-                for (int i =0; i< 16; i++){ //check all 16 entries
-                    entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(fs->sb->block_table + start + f) + sizeof(a1fs_dentry) *i);
-                    if (!strcmp(p, entry->name)){
-                        block_inode = (struct a1fs_inode *) (fs->image + A1FS_BLOCK_SIZE*4 + sizeof(struct a1fs_inode) * entry->ino);   //entry->ino = inode number
-                        match = 1;
-                        break;
-                    }else{
-                        match = 0;  //need match because we need to match several times (more than one iteration in the while loop)
-                    }
-                }
-                if (match ==1)
-                    break;
-            }
-            if (match == 1)
-                break;
+    //zero the rest of the current last block past the old end of file
+    if (fs_block_offset(fs, in->size) != 0) {
+        a1fs_blk_t b, run;
+        if (reflink_map_write(fs, in, in->size >> fs->block_shift, 1, &b, &run) < 0) {
+            return -ENOSPC;
         }
-        if (!match){    //if no match with direct pointers, check indirect
-            if (block_inode->indirect != 0){   //check if there's an indirect block
-                struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext *) (fs->image + A1FS_BLOCK_SIZE * (fs->sb->block_table + block_inode->indirect));
-                for (int e=0; e < 500; e++){    //check up to max 512 extents
-                    int start = indirect->extent[e].start, count = indirect->extent[e].count;
-                    if (count ==0)
-                        continue;
-                    for (int f = 0; f < count; f++){
-                        for (int i =0; i< 16; i++){
-                            entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(fs->sb->block_table + start + f) + sizeof(a1fs_dentry) *i);
-                            if (!strcmp(p, entry->name)){
-                                block_inode = (struct a1fs_inode *) (fs->image + A1FS_BLOCK_SIZE*4 + sizeof(struct a1fs_inode) * entry->ino);   //entry->ino = inode number
-                                match = 1;
-                                break;
-                            }else{
-                                match = 0;  //because we need to match several times (more than one while iteration)
-                            }
-                        }
-                        if (match ==1)
-                            break;
-                    }
-                    if (match == 1)
-                        break;
-                }
-            }else{
-                return -1;
+        size_t from = fs_block_offset(fs, in->size);
+        memset(fs_data_block(fs, b) + from, 0, fs->block_size - from);
+        fs_data_changed(fs, b, 1);
+    }
+    if (need > have) {
+        if (need - have > alloc_block_limit(fs) - fs->sb->used_block_count) { //not enough free blocks
+            return -ENOSPC;
+        }
+        a1fs_ext_leaf last;
+        a1fs_blk_t goal = ext_last(fs, in, &last) ? last.ext.start + last.ext.count : 0;
+        for (a1fs_blk_t n = have; n < need; ) {
+            a1fs_blk_t got;
+            long b = alloc_blocks(fs, goal, need - n, &got);
+            if (b < 0 || ext_append(fs, in, b, got) < 0) {
+                if (b >= 0) free_blocks(fs, b, got);
+                ext_truncate(fs, in, have);
+                return -ENOSPC;
             }
+            fs_data_zero(fs, b, got);
+            n += got;
+            goal = b + got;
         }
-        p = strtok (NULL, "/"); //move onto next section of path
     }
+    in->size = size;
+    return 0;
+}
 
-    if (!match){
-        return -1;
-    }else{
-        return block_inode->num;
+/* Creates a file with the given name and mode in directory parent, using the
+ * free entry "entry" of the parent. Returns the new inode number or -ENOSPC.
+ */
+static long file_new(fs_ctx *fs, a1fs_inode *parent, a1fs_dentry *entry,
+                     const char *name, mode_t mode)
+{
+    long inode = alloc_inode(fs);
+    if (inode < 0) {
+        return -ENOSPC;
     }
+    parent->empty += 1; //Update parent entry count
+    lazytime_touch(fs, parent);
 
+    //Allocate first free inode
+    struct a1fs_inode *new = &fs->itable[inode];
+    memset(new, 0, sizeof(a1fs_inode));
+    new->mode = mode;
+    new->links = 1; //1 link for new file
+    new->size = 0;
+    clock_gettime(CLOCK_REALTIME, &new->mtime);
+    new->block_count = 0;
+    new->num = inode;
+    new->parent_num = parent->num; //assign parent inode's number
+    new->flags = parent->flags & A1FS_INODE_COMPRESS; //inherit compression
+    ext_init(new);
+    //Put in entry
+    entry->ino = inode;
+    strcpy(entry->name, name); //set entry values
+    entry_changed(fs, entry);
+    return inode;
 }
 
-/* Returns an index of a free inode.
- * First available inode if it exists.
- * If there is any error, return -1.
- * possible error: no free inode
+/* Writes size bytes at offset to a file, extending it as needed. Returns the
+ * number of bytes written or -ENOSPC.
  */
-int first_inode(const struct a1fs_ibitmap *ibitmap){
-    for (int i=1; i<A1FS_BLOCK_SIZE; i++){
-        if (ibitmap->map[i]== 0){
-            return i;
+static int file_write(fs_ctx *fs, a1fs_inode *file, const char *buf, size_t size, off_t offset)
+{
+    if (file->flags & A1FS_INODE_COMPRESS) {
+        int ret = compress_write(fs, file, buf, size, offset);
+        if (ret < 0) {
+            return ret;
         }
+        lazytime_touch(fs, file);
+        return size;
     }
-    return -1;
-}
-
-/* Returns an index of a free block. Either next to block
- * or the first available block if it exists.
- * If there is any error, return -1.
- * possible error: no free block
- */
-int first_block(const struct a1fs_bbitmap *bbitmap, int block_num){
-    if (bbitmap->map[block_num +1] == 0){    //return block next to it if possible, otherwise iterate to find nearest
-        return (block_num + 1);
+    if(file->size < offset+size) {
+        int ret = inode_resize(fs, file, offset + size); //extend file as necessary
+        if (ret < 0) {
+            return ret;
+        }
     }
-    for (int i=1; i<A1FS_BLOCK_SIZE; i++){
-        if (bbitmap->map[i]== 0){
-            return i;
+
+    //copy block by block; each extent is contiguous on disk (up to the end of
+    //a stripe chunk), and blocks shared with a clone are copied before they
+    //are written to
+    size_t bytes_written = 0;
+    while (bytes_written < size) {
+        uint64_t pos = offset + bytes_written;
+        a1fs_blk_t b, run;
+        a1fs_blk_t lblk = pos >> fs->block_shift;
+        int ret = reflink_map_write(fs, file, lblk, fs_blocks(fs, offset + size) - lblk, &b, &run);
+        if (ret < 0) {
+            return ret;
         }
+        run = fs_data_run(fs, b, run);
+        size_t within = fs_block_offset(fs, pos);
+        size_t n = ((size_t)run << fs->block_shift) - within;
+        if (n > size - bytes_written) {
+            n = size - bytes_written;
+        }
+        mem_copy(fs_data_block(fs, b) + within, buf + bytes_written, n);
+        fs_data_changed(fs, b, fs_blocks(fs, within + n));
+        bytes_written += n;
     }
-    return -1;
+    lazytime_touch(fs, file);
+    return bytes_written;
 }
 
 /**
@@ -169,7 +448,50 @@ static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
     void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
     if (!image) return false;
 
-    return fs_ctx_init(fs, image, size);
+    if (!fs_ctx_init(fs, image, size)) return false;
+
+    // the other images of a striped file system are given as path:path...
+    char *members[A1FS_STRIPE_MAX];
+    unsigned int n_members = 0;
+    for (char *p = opts->stripe ? strtok(opts->stripe, ":") : NULL; p != NULL; p = strtok(NULL, ":")) {
+        if (n_members == A1FS_STRIPE_MAX) {
+            fprintf(stderr, "Too many stripe images\n");
+            return false;
+        }
+        members[n_members++] = p;
+    }
+    if (!fs_ctx_map_members(fs, members, n_members, true, 0)) {
+        return false;
+    }
+    // also needed for A1FS_IOC_TRIM without the discard option
+    if (!discard_open(fs, opts->img_path, members, n_members)) return false;
+    fs->discard = opts->discard;
+
+    if (opts->populate) fs->map_flags |= A1FS_MAP_POPULATE;// see a1fs_start()
+    if (opts->hugepage) {
+        fs->map_flags |= A1FS_MAP_HUGEPAGE;
+        for (unsigned int m = 0; m < fs->n_members; m++) {
+            if (madvise(fs->members[m], fs->member_size[m], MADV_HUGEPAGE) < 0) {
+                perror("madvise");
+                fs->map_flags &= ~A1FS_MAP_HUGEPAGE;
+                break;
+            }
+        }
+    }
+    if (opts->mlock) fs->map_flags |= A1FS_MAP_MLOCK;// see a1fs_start()
+    fs->writeback_cache = opts->writeback_cache;
+    fs->readdirplus = opts->readdirplus;
+    fs->max_io = opts->max_io;
+    if (opts->snapshot && !snapshot_mount(fs, opts->snapshot)) {
+        fprintf(stderr, "No snapshot named %s\n", opts->snapshot);
+        return false;
+    }
+    if (!fs->read_only) fs_ctx_mount(fs);
+    if (opts->lazytime && !fs->read_only && !lazytime_init(fs)) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+    return true;
 }
 
 /**
@@ -182,8 +504,14 @@ static void a1fs_destroy(void *ctx)
 {
     fs_ctx *fs = (fs_ctx*)ctx;
     if (fs->image) {
-        munmap(fs->image, fs->size);
+        reclaim_stop(fs);
+        discard_flush(fs);
+        lazytime_destroy(fs);
+        if (fs->map_flags & A1FS_MAP_MLOCK) {
+            munlock(fs->image, (size_t)fs->sb->block_table << fs->block_shift);
+        }
         fs_ctx_destroy(fs);
+        munmap(fs->image, fs->size);
     }
 }
 
@@ -193,6 +521,62 @@ static fs_ctx *get_fs(void)
     return (fs_ctx*)fuse_get_context()->private_data;
 }
 
+/**
+ * Start the background work of the mounted file system.
+ *
+ * Called by FUSE once the file system is mounted (and after it has detached
+ * from the terminal, so threads started here keep running). Also sets up the
+ * connection options that were asked for on the command line and that the
+ * kernel supports: the writeback cache, readdirplus and the request size.
+ *
+ * @param conn  connection capabilities and settings.
+ * @param cfg   unused.
+ * @return      the file system context, passed to the other callbacks.
+ */
+static void *a1fs_start(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    (void)cfg;// unused
+    fs_ctx *fs = get_fs();
+
+    // with the writeback cache the kernel merges small writes in the page
+    // cache and keeps the modification time itself
+    if (fs->writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    } else {
+        conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+    }
+    if (fs->readdirplus && (conn->capable & FUSE_CAP_READDIRPLUS)) {
+        conn->want |= FUSE_CAP_READDIRPLUS;
+    } else {
+        conn->want &= ~(FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
+    }
+    // max_read is also passed as a mount option (see options.c)
+    conn->max_write = fs->max_io;
+    conn->max_read = fs->max_io;
+
+    // the inode table of a mounted snapshot is fully initialized
+    if (!fs->read_only && !fs_ctx_start_itable_init(fs)) {
+        fprintf(stderr, "Failed to start inode table initialization\n");
+    }
+    if (!fs->read_only && !reclaim_start(fs)) {
+        fprintf(stderr, "Failed to start block reclamation\n");
+    }
+
+    // page tables and memory locks are not inherited across the fork() that
+    // puts the file system in the background, so the image is populated and
+    // locked here
+    for (unsigned int m = 0; (fs->map_flags & A1FS_MAP_POPULATE) && m < fs->n_members; m++) {
+        map_populate(fs->members[m], fs->member_size[m]);
+    }
+    size_t meta = (size_t)fs->sb->block_table << fs->block_shift;
+    if ((fs->map_flags & A1FS_MAP_MLOCK) && mlock(fs->image, meta) < 0) {
+        perror("mlock");
+        fs->map_flags &= ~A1FS_MAP_MLOCK;
+    }
+    fs->tlb_fd = tlb_counter_open();
+    return fs;
+}
+
 
 /**
  * Get file system statistics.
@@ -215,20 +599,35 @@ static int a1fs_statfs(const char *path, struct statvfs *st)
     fs_ctx *fs = get_fs();
 
     memset(st, 0, sizeof(*st));
-    st->f_bsize   = A1FS_BLOCK_SIZE;
-    st->f_frsize  = A1FS_BLOCK_SIZE;
+    st->f_bsize   = fs->block_size;
+    st->f_frsize  = fs->block_size;
     st->f_namemax = A1FS_NAME_MAX;
 
-    a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image + A1FS_BLOCK_SIZE);
-    st->f_blocks = sb->block_count; /* size of fs in f_frsize units */
-    st->f_bfree = sb->block_count - sb->used_block_count;  /* # free blocks */
+    st->f_blocks = alloc_block_limit(fs); /* size of fs in f_frsize units */
+    st->f_bfree = st->f_blocks - fs->sb->used_block_count;  /* # free blocks */
     st->f_bavail = st->f_bfree;  /* # free blocks for unprivileged users */
-    st->f_files = sb->inode_count;    /* # inodes */
-    st->f_ffree = sb->inode_count - sb->used_inode_count;   /* # free inodes */
+    st->f_files = alloc_inode_limit(fs);    /* # inodes */
+    st->f_ffree = st->f_files - fs->sb->used_inode_count;   /* # free inodes */
     st->f_favail = st->f_ffree;  /* # free inodes for unprivileged users */
     return 0;
 }
 
+/* Fills in the attributes of inode in that getattr() and readdir() report. */
+static void inode_attr(fs_ctx *fs, a1fs_inode *in, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (S_ISREG(in->mode))
+        st->st_mode = S_IFREG | in->mode;
+    else
+        st->st_mode = S_IFDIR | in->mode;
+
+    st->st_nlink = in->links;
+    st->st_size = in->size;
+    st->st_blksize = fs->block_size;
+    st->st_blocks = (blkcnt_t)in->block_count * (fs->block_size / 512);  // (512 fragments) number of blocks used in extents. Includes extent tree blocks
+    st->st_mtim = lazytime_get(fs, in);
+}
+
 /**
  * Get file or directory attributes.
  *
@@ -246,43 +645,46 @@ static int a1fs_statfs(const char *path, struct statvfs *st)
  *
  * @param path  path to a file or directory.
  * @param st    pointer to the struct stat that receives the result.
+ * @param fi    unused.
  * @return      0 on success; -errno on error;
  */
-static int a1fs_getattr(const char *path, struct stat *st)
+static int a1fs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
 {
+    (void)fi;// unused
     if (strlen(path) >= A1FS_PATH_MAX) return -ENAMETOOLONG;
     fs_ctx *fs = get_fs();
 
-    memset(st, 0, sizeof(*st));
-
     int num = path_lookup(path);
     if (num == -1) {
         return -ENOENT;
     }else if(num == -2){
         return -ENOTDIR;
     } else if (num == -3){
-        return ENAMETOOLONG;
+        return -ENAMETOOLONG;
     }
-    struct a1fs_inode *in = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * num);    //pointer to inode
-
-    if (S_ISREG(in->mode))
-        st->st_mode = S_IFREG | in->mode;
-    else
-        st->st_mode = S_IFDIR | in->mode;
-
-    st->st_nlink = in->links;
-    st->st_size = in->size;
-    st->st_blksize = A1FS_BLOCK_SIZE;
-    st->st_blocks = in->block_count * 8;  // (512 fragments) number of blocks used in extents. MAY ALSO INCLUDE INDIRECT BLOCK
-    st->st_mtim =  in->mtime;
+    inode_attr(fs, &fs->itable[num], st);
     return 0;
 }
 
+/* Calls filler() for one entry, with its attributes if st is not NULL. The
+ * reply buffer that FUSE grows as it fills up is not counted as an allocation
+ * of the file system.
+ */
+static int readdir_fill(void *buf, fuse_fill_dir_t filler, const char *name, const struct stat *st)
+{
+    heap_scope_end();
+    int ret = filler(buf, name, st, 0, st != NULL ? FUSE_FILL_DIR_PLUS : 0);
+    heap_scope_begin();
+    return ret;
+}
+
 /**
  * Read a directory.
  *
- * Implements the readdir() system call. Should call filler(buf, name, NULL, 0)
+ * Implements the readdir() system call. Should call filler(buf, name, NULL, 0, 0)
  * for each directory entry. See fuse.h in libfuse source code for details.
+ * With readdirplus, the attributes of each entry are passed along, so that
+ * the kernel does not need a getattr() call for each of them (e.g. for "ls -l").
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a directory.
@@ -296,59 +698,43 @@ static int a1fs_getattr(const char *path, struct stat *st)
  *                Pass 0 as offset (4th argument). 3rd argument can be NULL.
  * @param offset  unused.
  * @param fi      unused.
+ * @param flags   FUSE_READDIR_PLUS if the attributes are wanted too.
  * @return        0 on success; -errno on error.
  */
 static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                        off_t offset, struct fuse_file_info *fi)
+                        off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
 {
     (void)offset;// unused
     (void)fi;// unused
     fs_ctx *fs = get_fs();
 
     int num = path_lookup(path);
-    struct a1fs_inode *in = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * num);    //pointer to inode
     if (num < 0){
         fprintf(stderr, "PATHLOOKUP FAILED\r\n");
-        return -errno;
+        return lookup_error(num);
     }
-    filler(buf, "." , NULL, 0);
-    filler(buf, "..", NULL, 0);
+    struct a1fs_inode *in = &fs->itable[num];    //pointer to inode
+    //the kernel does not use the attributes of "." and ".."
+    if (readdir_fill(buf, filler, ".", NULL) || readdir_fill(buf, filler, "..", NULL)) return -ENOMEM;
 
     if (in->empty == 0){    //check if directory is empty
         return 0;
     }
 
-    struct a1fs_dentry *entry;
-    for (int e=0; e < 12; e++){ //check all 12 direct extent pointers
-        int start = in->extent[e].start, count = in->extent[e].count;
-        if(count == 0)
-            continue;
-        for (int f = 0; f < count; f++){
-            for (int i =0; i< 16; i++){ //check all 16 entries
-                entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(fs->sb->block_table + start + f) + sizeof(a1fs_dentry) *i);
-                if (strcmp("\0", entry->name)){
-                   filler(buf, entry->name, NULL, 0);
-                }
+    a1fs_blk_t n = ext_nblocks(fs, in);
+    for (a1fs_blk_t l = 0; l < n; l++) {
+        a1fs_blk_t b;
+        if (!ext_map(fs, in, l, &b, NULL)) break;
+        struct a1fs_dentry *entry = fs_data_block(fs, b);
+        for (unsigned int i = 0; i < fs->block_size / sizeof(a1fs_dentry); i++) {
+            if (entry[i].name[0] == '\0') continue;
+            struct stat st;
+            if (flags & FUSE_READDIR_PLUS) inode_attr(fs, &fs->itable[entry[i].ino], &st);
+            if (readdir_fill(buf, filler, entry[i].name, (flags & FUSE_READDIR_PLUS) ? &st : NULL)) {
+                return -ENOMEM;
             }
         }
     }
-    if (in->indirect != 0){   //check if there's an indirect block
-        struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext *) (fs->image + A1FS_BLOCK_SIZE * (fs->sb->block_table + in->indirect));
-        for (int e=0; e < 500; e++){    //check up to max 512 extents
-            int start = indirect->extent[e].start, count = indirect->extent[e].count;
-            if (count == 0)
-                continue;
-            for (int f = 0; f < count; f++){
-                for (int i =0; i< 16; i++){
-                    entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(fs->sb->block_table + start + f) + sizeof(a1fs_dentry) *i);
-                    if (strcmp("\0", entry->name)){
-                       filler(buf, entry->name, NULL, 0);
-                    }
-                }
-            }
-        }
-    }
-
     return 0;
 }
 
@@ -376,178 +762,63 @@ static int a1fs_mkdir(const char *path, mode_t mode)
     mode = mode | S_IFDIR;
     fs_ctx *fs = get_fs();
 
-    struct a1fs_superblock *sb = fs->sb;
-    struct a1fs_ibitmap *ibitmap = fs->ibitmap;
-    struct a1fs_bbitmap *bbitmap = fs->bbitmap;
-
     //check if we have enough blocks/inodes for a new directory
-    if(sb->inode_count == sb->used_inode_count || sb->block_count == sb->used_block_count) {
+    if(alloc_inode_limit(fs) == fs->sb->used_inode_count || alloc_block_limit(fs) == fs->sb->used_block_count) {
         return -ENOSPC;
     }
     //PARSE PATH: entry_end will be dir name
-    char *parent_path = strdup(path);
-    char *parent_path_end = strrchr(parent_path, '/');
-    char *entry_end = strdup(parent_path_end);
-    *parent_path_end = '\0';
-
-    if(entry_end[0] == '/') {
-        entry_end++;
-    }
-    int num;
-    if (!strcmp(parent_path, "")){  //our string parser removes root so we need a case for that
-        num = path_lookup("/");
-    }else{
-        num = path_lookup(parent_path);
-    }
+    const char *entry_end;
+    int num = parent_lookup(path, &entry_end);
     if (num < 0){
         fprintf(stderr, "PATHLOOKUP FAILED\r\n");
-        return -errno;
+        return lookup_error(num);
     }
     //pointer to parent inode
-    struct a1fs_inode *parent_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * num);
-    if (parent_inode->extent_count >= 512){
-        fprintf(stderr, "MAX 512 EXTENTS\r\n");
+    struct a1fs_inode *parent_inode = &fs->itable[num];
+
+    //find a free entry in the parent, growing it if needed
+    struct a1fs_dentry *entry = dir_alloc_entry(fs, parent_inode);
+    if (entry == NULL) {
         return -ENOSPC;
     }
-    int inode = -1; //INODE INDEX OF NEW DIR
-    int block = -1; //BLOCK INDEX OF NEW DIR
-
-    //if empty directory, allocate to first entry, else allocate to first free entry
-    struct a1fs_dentry *entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + parent_inode->extent[0].start));
-    if (parent_inode->empty != 0){    //check if directory is empty
-        int match = 0;
-        //check all 12 direct extent pointers for empty entry to allocate
-        for (int e=0; e < 12; e++){
-            int start = parent_inode->extent[e].start, count = parent_inode->extent[e].count;
-            if (count == 0){    // NEW EXTENT
-                //we now need 2 data blocks. Check if enough space
-                if(sb->block_count <= (sb->used_block_count + 1)) {
-                    return -ENOSPC;
-                }
-                int b = first_block(bbitmap, start);
-                bbitmap->map[b] = 1;    //new extent for parent_directory
-                entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + b)); //first entry of new extent
-                parent_inode->extent_count += 1;    //for allocating new extent block
-                parent_inode->extent[e].start = b;
-                parent_inode->extent[e].count = 1;
-                parent_inode->block_count +=1;
-                parent_inode->extent_count +=1;
-                sb->used_block_count +=1;
-                match = 1;
-                break;
-            }
 
-            // EXISTING EXTENT. FIND FREE ENTRY
-            for (int f = 0; f < count; f++){
-                for (int i =0; i< 16; i++){
-                    entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + start + f) + sizeof(a1fs_dentry) *i);
-                    if (!strcmp("\0", entry->name)){
-                        match = 1;
-                        break;
-                    }
-                }
-                if (match ==1)
-                    break;
-            }
-            if (match == 1)
-                break;
-        }
-        if (match == 0){
-            //parent inode's direct extents are full. Time to check for indirect
-            if (parent_inode->indirect == 0){   //NEW INDIRECT BLOCK
-                //we need 3 data blocks: indirect, direct, new directory
-                if(sb->block_count <= (sb->used_block_count + 3)) {
-                    return -ENOSPC;
-                }
-                int b = first_block(bbitmap, 0); //new indirect block for parent_directory
-                bbitmap->map[b] = 1;
-                int c = first_block(bbitmap, b); //new block for an extent in the indirect block
-                bbitmap->map[c] = 1;
-                struct a1fs_indirect_ext *indirect= (struct a1fs_indirect_ext *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + b));
-                memset(indirect, 0, A1FS_BLOCK_SIZE);
-                indirect->extent[0].start = c;
-                indirect->extent[0].count = 1;
-                parent_inode->indirect = b;
-                entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + c)); //first entry of new extent
-                memset(entry, 0, sizeof(a1fs_dentry));
-                parent_inode->block_count +=2;
-                parent_inode->extent_count +=1;     //adds 1 extent block (doesnt count indirect block as one)
-                sb->used_block_count +=2;
-                match = 1;
-            }else{  //EXISTING INDIRECT BLOCK
-                struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext *) (fs->image + A1FS_BLOCK_SIZE * (fs->sb->block_table + parent_inode->indirect));
-                for (int e=0; e < 500; e++){
-                    int start = indirect->extent[e].start, count = indirect->extent[e].count;
-                    //NEW EXTENT
-                    if (count == 0){
-                        //need 2 data blocks. direct and new directory
-                         if(sb->block_count <= (sb->used_block_count + 2)) {
-                            return -ENOSPC;
-                        }
-                        int b = first_block(bbitmap, start);
-                        bbitmap->map[b] = 1;    //new extent block for parent_directory
-                        entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + b)); //first entry of new extent
-                        memset(entry, 0, sizeof(a1fs_dentry));
-                        indirect->extent[e].start = b;
-                        indirect->extent[e].count = 1;
-                        parent_inode->block_count +=1;
-                        parent_inode->extent_count +=1; //adds 1 extent block
-                        sb->used_block_count +=1;
-                        match = 1;
-                        break;
-                    }
-                    //EXISTING EXTENT
-                    for (int f = 0; f < count; f++){    //Check all blocks in extent
-                        for (int i =0; i< 16; i++){ //check all 16 entries
-                            entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + start + f) + sizeof(a1fs_dentry) *i);
-                            if (entry->ino == 0){
-                                match = 1;
-                                break;
-                            }
-                        }
-                        if (match ==1)
-                            break;
-                    }
-                    if (match == 1)
-                        break;
-                }
-            }
-            if (match == 0){
-                fprintf(stderr, "ERR: no entry match even though there should be\r\n");
-                return -errno;
-            }
-        }
+    //new dir's inode and first data block, next to the parent's last block
+    long inode = alloc_inode(fs);
+    if (inode < 0) {
+        return -ENOSPC;
     }
+    a1fs_ext_leaf last;
+    a1fs_blk_t goal = ext_last(fs, parent_inode, &last) ? last.ext.start + last.ext.count : 0;
+    a1fs_blk_t got;
+    long block = alloc_blocks(fs, goal, 1, &got);
+    if (block < 0) {
+        free_inode(fs, inode);
+        return -ENOSPC;
+    }
+    memset(fs_data_block(fs, block), 0, fs->block_size);
 
-    //update bitmaps
-    inode = first_inode(ibitmap);
-    ibitmap->map[inode] = 1; //allocate inode in bitmap
-    block = first_block(bbitmap, num);
-    bbitmap->map[block] = 1;    //allocate block in bitmap
     //update parent
     parent_inode->links += 1;
     parent_inode->empty += 1;    //parent directory no longer empty
-    clock_gettime(CLOCK_REALTIME, &parent_inode->mtime);
-    //update superblock
-    sb->used_inode_count += 1;  //from new directory
-    sb->used_block_count += 1;  //from new directory
+    lazytime_touch(fs, parent_inode);
+
     //new dir's data + inode
-    struct a1fs_inode *new = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * inode);
+    struct a1fs_inode *new = &fs->itable[inode];
     memset(new, 0, sizeof(a1fs_inode));
     new->mode = mode;
     new->links = 2;
-    new->size = 0;
+    new->size = fs->block_size;
     clock_gettime(CLOCK_REALTIME, &new->mtime);
-    new->block_count = 1;
     new->num = inode;
     new->parent_num = num;
-    new->extent[0].count=1; //since it's a new inode, first extent, first block will be allocated
-    new->extent[0].start = block;
-    new->extent_count += 1;
+    new->flags = parent_inode->flags & A1FS_INODE_COMPRESS; //inherit compression
+    ext_init(new);
+    ext_append(fs, new, block, 1);  //an empty tree always has room for the first extent
+
     //Put in entry
     entry->ino = inode;
     strcpy(entry->name, entry_end); //set entry values
-    entry->name[strlen(entry->name)] = '\0';
+    entry_changed(fs, entry);
     return(0);
 }
 
@@ -570,84 +841,27 @@ static int a1fs_rmdir(const char *path)
     fs_ctx *fs = get_fs();
 
     int num = path_lookup(path);
-    struct a1fs_inode *in = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * num);
     if (num < 0){
         fprintf(stderr, "PATHLOOKUP FAILED\r\n");   //just in case
-        return -errno;
+        return lookup_error(num);
     }
+    struct a1fs_inode *in = &fs->itable[num];
     if (in->empty > 0)
         return -ENOTEMPTY;  // Stop if directory is not empty
 
-    struct a1fs_inode *parent_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * in->parent_num);
+    struct a1fs_inode *parent_inode = &fs->itable[in->parent_num];
 
     //search and remove from parent directory's entries
-    struct a1fs_dentry *entry;
-    for (int e=0; e < 12; e++){ //check all 12 direct extent pointers
-        int start = parent_inode->extent[e].start, count = parent_inode->extent[e].count;
-        if(count == 0)
-            continue;
-        for (int f = 0; f< count; f++){
-            for (int i =0; i< 16; i++){
-                entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(fs->sb->block_table + start + f) + sizeof(a1fs_dentry) *i);
-                if (entry->ino == in->num){
-                    memset(entry, 0, sizeof(struct a1fs_dentry));   //will wipe out the entry
-                    break;
-                }
-            }
-        }
-    }
-    //check indirect block if parent has one
-    if (parent_inode->indirect != 0){
-        struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext *) (fs->image + A1FS_BLOCK_SIZE * (fs->sb->block_table + parent_inode->indirect));
-        for (int e=0; e < 500; e++){    //check up to max 512 extents
-            int start = indirect->extent[e].start, count = indirect->extent[e].count;
-            if (count == 0)
-                continue;
-            //Check all blocks in extent
-            for (int f = 0; f < count; f++){
-                for (int i =0; i< 16; i++){ //check all 16 entries
-                    entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(fs->sb->block_table + start + f) + sizeof(a1fs_dentry) *i);
-                    if (entry->ino == in->num){
-                        memset(entry, 0, sizeof(struct a1fs_dentry));   //will wipe out the entry
-                        break;
-                    }
-                }
-            }
-        }
+    struct a1fs_dentry *entry = dir_find_ino(fs, parent_inode, in->num);
+    if (entry != NULL) {
+        dir_remove_entry(fs, parent_inode, entry);
     }
+
     //update superblock, bitmap, and parent inode
     parent_inode->empty -= 1;
     parent_inode->links -= 1;
-    parent_inode->size -= in->size;
-    clock_gettime(CLOCK_REALTIME, &parent_inode->mtime);
-    fs->sb->used_inode_count -= 1;  //need to update superblock count for used inodes
-    fs->ibitmap->map[in->num] = 0;
-
-    //Update block bitmap to remove directory's data
-    for (int e=0; e < 12; e++){
-        int start = in->extent[e].start, count = in->extent[e].count;
-        if(count == 0)  //check if empty extent
-            continue;
-        for (int f = 0; f < count; f++){    //else unallocate all blocks in removed directory's extents
-            fs->bbitmap->map[start + f] = 0;
-            fs->sb->used_block_count -=1;
-        }
-    }
-    if (in->indirect != 0){   //check if there's an indirect block in the removed directory
-        struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext *) (fs->image + A1FS_BLOCK_SIZE * (fs->sb->block_table + in->indirect));
-        for (int e=0; e < 500; e++){
-            int start = indirect->extent[e].start, count = indirect->extent[e].count;
-            if (count == 0)
-                continue;
-            for (int f = 0; f < count; f++){
-                fs->bbitmap->map[start + f] = 0;
-                fs->sb->used_block_count -=1;
-            }
-        }
-        fs->bbitmap->map[in->indirect] = 0; //unallocate indirect block in bitmap
-        fs->sb->used_block_count -=1;
-    }
-    memset(in, 0, sizeof(struct a1fs_inode));
+    lazytime_touch(fs, parent_inode);
+    reclaim_inode(fs, in);
     return 0;
 }
 
@@ -676,169 +890,27 @@ static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     assert(S_ISREG(mode));
     fs_ctx *fs = get_fs();
 
-    struct a1fs_superblock *sb = fs->sb;
-    struct a1fs_ibitmap *ibitmap = fs->ibitmap;
-    struct a1fs_bbitmap *bbitmap = fs->bbitmap;
-
-    if(sb->inode_count == sb->used_inode_count) {   //We need to allocate one inode for new file
+    if(alloc_inode_limit(fs) == fs->sb->used_inode_count) {   //We need to allocate one inode for new file
         return -ENOSPC;
     }
     //path parsing. entry_end is file name
-    char *parent_path = strdup(path);
-    char *parent_path_end = strrchr(parent_path, '/');
-    char *entry_end = strdup(parent_path_end);
-    *parent_path_end = '\0';
-
-    if(entry_end[0] == '/') {
-        entry_end++;
-    }
-    int num;
-    if (!strcmp(parent_path, "")){  //our string parser removes root so we need a case for that
-        num = path_lookup("/");
-    }else{
-        num = path_lookup(parent_path);
-    }
+    const char *entry_end;
+    int num = parent_lookup(path, &entry_end);
     if (num < 0){
         fprintf(stderr, "PATHLOOKUP FAILED\r\n");   //just in case
-        return -errno;
+        return lookup_error(num);
     }
-    struct a1fs_inode *parent_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * num);
-    if (parent_inode->extent_count >= 512){
-        fprintf(stderr, "MAX 512 EXTENTS\r\n");
+    struct a1fs_inode *parent_inode = &fs->itable[num];
+
+    //find a free entry in the parent, growing it if needed
+    struct a1fs_dentry *entry = dir_alloc_entry(fs, parent_inode);
+    if (entry == NULL) {
         return -ENOSPC;
     }
-    struct a1fs_dentry *entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + parent_inode->extent[0].start));
-    //check if directory is empty; if it is allocate to first entry, first block
-    if (parent_inode->empty == 0){
-        entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + parent_inode->extent[0].start));
-    }else{
-        int match = 0;
-        //check all 12 direct extent pointers for empty empty to allocate
-        for (int e=0; e < 12; e++){
-            int start = parent_inode->extent[e].start, count = parent_inode->extent[e].count;
-            //If extent has 16 entries (max), allocate new extent
-            if (count == 0){
-                // We need to allocate 1 block for parent directory's new extent
-                if(sb->block_count == sb->used_block_count) {
-                    return -ENOSPC;
-                }
-                int b = first_block(bbitmap, start);
-                bbitmap->map[b] = 1;    //new extent for parent_directory
-                entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + b)); //first entry of new extent
-                memset(entry, 0, sizeof(a1fs_dentry));
-                parent_inode->extent[e].start = b;
-                parent_inode->extent[e].count = 1;
-                parent_inode->block_count +=1;
-                parent_inode->extent_count +=1;
-                sb->used_block_count +=1;
-                match = 1;
-                break;
-            }
-
-            // EXISTING EXTENT. FIND FREE ENTRY
-            for (int f = 0; f < count; f++){
-                for (int i =0; i< 16; i++){
-                    entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + start + f) + sizeof(a1fs_dentry) *i);
-                    if (!strcmp("\0", entry->name)){
-                        match = 1;
-                        break;
-                    }
-                }
-                if (match ==1)
-                    break;
-            }
-            if (match == 1)
-                break;
-        }
-        if (match == 0){
-            //parent inode's direct extents are full. Time to check for indirect
-            if (parent_inode->indirect == 0){
-                 //NEW INDIRECT BLOCK, NEW EXTENT BLOCK
-                if(sb->block_count <= (sb->used_block_count + 2)) {
-                    return -ENOSPC;
-                }
-                int b = first_block(bbitmap, 0);
-                bbitmap->map[b] = 1;    //new indirect block for parent_directory
-                int c = first_block(bbitmap, b);
-                bbitmap->map[c] = 1;    //new block for an extent in the indirect block
-                struct a1fs_indirect_ext *indirect= (struct a1fs_indirect_ext *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + b));
-                indirect->extent[0].start = c;
-                indirect->extent[0].count = 1;
-                parent_inode->indirect = b;
-                entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + c)); //first entry of new extent
-                memset(entry, 0, sizeof(a1fs_dentry));
-                parent_inode->block_count +=2;
-                parent_inode->extent_count +=1;
-                sb->used_block_count +=2;
-                match = 1;
-            }else{
-                //EXISTING INDIRECT BLOCK
-                struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext *) (fs->image + A1FS_BLOCK_SIZE * (fs->sb->block_table + parent_inode->indirect));
-                for (int e=0; e < 500; e++){
-                    int start = indirect->extent[e].start, count = indirect->extent[e].count;
-                    if (count == 0){    //NEW EXTENT
-                        if(sb->block_count == sb->used_block_count) {  //1 extent block
-                            return -ENOSPC;
-                        }
-                        int b = first_block(bbitmap, start);
-                        bbitmap->map[b] = 1;    //new extent block for parent_directory
-                        //First entry of new extent block
-                        entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + b));
-                        memset(entry, 0, sizeof(a1fs_dentry));
-                        indirect->extent[e].start = b;
-                        indirect->extent[e].count = 1;
-                        parent_inode->block_count +=1;
-                        parent_inode->extent_count +=1;
-                        sb->used_block_count +=1;
-                        match = 1;
-                        break;
-                    }
-                    //EXISTING EXTENT
-                    for (int f = 0; f < count; f++){    //Check all blocks in extent
-                        for (int i =0; i< 16; i++){ //check all 16 entries
-                            entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(sb->block_table + start + f) + sizeof(a1fs_dentry) *i);
-                            if (entry->ino == 0){
-                                match = 1;
-                                break;
-                            }
-                        }
-                        if (match ==1)
-                            break;
-                    }
-                    if (match == 1)
-                        break;
-                }
-            }
-            if (match == 0){
-                fprintf(stderr, "ERR: no entry match even though there should be\r\n");
-                return -errno;
-            }
-        }
+    long inode = file_new(fs, parent_inode, entry, entry_end, mode);
+    if (inode < 0) {
+        return inode;
     }
-
-    parent_inode->empty += 1; //Update parent entry count
-    clock_gettime(CLOCK_REALTIME, &parent_inode->mtime);
-    int inode = first_inode(ibitmap);
-    ibitmap->map[inode] = 1; //allocate inode in bitmap
-
-    //update superblock
-    sb->used_inode_count += 1;
-
-    //Allocate first free inode
-    struct a1fs_inode *new = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * inode);
-    memset(new, 0, sizeof(a1fs_inode));
-    new->mode = mode;
-    new->links = 1; //1 link for new file
-    new->size = 0;
-    clock_gettime(CLOCK_REALTIME, &new->mtime);
-    new->block_count = 0;
-    new->num = inode;
-    new->parent_num = num; //assign parent inode's number
-    //Put in entry
-    entry->ino = inode;
-    strcpy(entry->name, entry_end); //set entry values
-    entry->name[strlen(entry->name)] = '\0';
-
     return(0);
 }
 
@@ -862,81 +934,134 @@ static int a1fs_unlink(const char *path)
     int num = path_lookup(path);
     if (num < 0){
         fprintf(stderr, "PATHLOOKUP FAILED\r\n");   //just in case
-        return -errno;
+        return lookup_error(num);
     }
-    struct a1fs_inode *in = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * num);
-    struct a1fs_inode *parent_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * in->parent_num);
+    struct a1fs_inode *in = &fs->itable[num];
+    struct a1fs_inode *parent_inode = &fs->itable[in->parent_num];
 
     //search and remove from parent directory's entries
-    struct a1fs_dentry *entry;
-    //check all 12 direct extent pointers
-    for (int e=0; e < 12; e++){
-        int start = parent_inode->extent[e].start, count = parent_inode->extent[e].count;
-        if(count == 0)
-            continue;
-        for (int f = 0; f< count; f++){
-            for (int i =0; i< 16; i++){
-                entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(fs->sb->block_table + start + f) + sizeof(a1fs_dentry) *i);
-                if (entry->ino == in->num){
-                    memset(entry, 0, sizeof(struct a1fs_dentry));   //will wipe out the entry
-                    break;
-                }
-            }
-        }
+    struct a1fs_dentry *entry = dir_find_ino(fs, parent_inode, in->num);
+    if (entry != NULL) {
+        dir_remove_entry(fs, parent_inode, entry);
     }
-    //Check if parent has indirect block
-    if (parent_inode->indirect != 0){
-        struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext *) (fs->image + A1FS_BLOCK_SIZE * (fs->sb->block_table + parent_inode->indirect));
-        for (int e=0; e < 500; e++){    //check up to max 512 extents
-            int start = indirect->extent[e].start, count = indirect->extent[e].count;
-            if (count == 0)
-                continue;
-            //Check all blocks in extent
-            for (int f = 0; f < count; f++){
-                for (int i =0; i< 16; i++){ //check all 16 entries
-                    entry = (struct a1fs_dentry *) (fs->image + A1FS_BLOCK_SIZE*(fs->sb->block_table + start + f) + sizeof(a1fs_dentry) *i);
-                    if (entry->ino == in->num){
-                        memset(entry, 0, sizeof(struct a1fs_dentry));   //will wipe out the entry
-                        break;
-                    }
-                }
-            }
-        }
-    }
-    clock_gettime(CLOCK_REALTIME, &parent_inode->mtime);
+    lazytime_touch(fs, parent_inode);
     parent_inode->empty -= 1;   //decrease entry count by 1
-    parent_inode->size -= in->size;
-    fs->sb->used_inode_count -= 1;  //need to update superblock count for used inodes
-    fs->ibitmap->map[in->num] = 0;  //deallocate removed file
-
-    //Update block bitmap if file has data blocks
-    if (in->size > 0 || in->block_count > 0){
-        for (int e=0; e < 12; e++){
-            int start = in->extent[e].start, count = in->extent[e].count;
-            if(count == 0)  //check if empty extent
-                continue;
-            for (int f = 0; f < count; f++){    //else unallocate all blocks in removed directory's extents
-                fs->bbitmap->map[start + f] = 0;
-                fs->sb->used_block_count -=1;
-            }
+    reclaim_inode(fs, in);
+    return 0;
+}
+
+
+/**
+ * Rename a file or directory.
+ *
+ * Implements the rename() system call. See "man 2 rename" for details.
+ * Only the directory entries and the inode fields that depend on them change;
+ * the data is not touched. If "to" exists, it is replaced: its entry is
+ * pointed at the renamed inode in a single store, so "to" always refers to
+ * either the old or the new inode.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "from" exists.
+ *
+ * Errors:
+ *   EINVAL        "to" is inside the directory "from".
+ *   EISDIR        "to" is a directory and "from" is not.
+ *   ENOTDIR       "from" is a directory and "to" is not, or a component of
+ *                 the path prefix of "to" is not a directory.
+ *   ENOTEMPTY     "to" is a non-empty directory.
+ *   ENAMETOOLONG  the name of "to" is too long.
+ *   ENOSPC        not enough free space for a new entry in the target directory.
+ *   EEXIST        "to" exists and flags has RENAME_NOREPLACE.
+ *   EINVAL        flags has RENAME_EXCHANGE, which is not supported.
+ *
+ * @param from   path to the file or directory to rename.
+ * @param to     new path.
+ * @param flags  RENAME_* flags of renameat2(); see "man 2 rename".
+ * @return       0 on success; -errno on error.
+ */
+static int a1fs_rename(const char *from, const char *to, unsigned int flags)
+{
+    fs_ctx *fs = get_fs();
+    if (flags & ~RENAME_NOREPLACE) return -EINVAL;
+
+    int num = path_lookup(from);
+    if (num < 0) {
+        return lookup_error(num);
+    }
+    struct a1fs_inode *in = &fs->itable[num];
+    if (num == 0) {
+        return -EBUSY;  //the root can't be moved
+    }
+
+    const char *name;
+    int parent = parent_lookup(to, &name);
+    if (parent < 0) {
+        return lookup_error(parent);
+    }
+    if (strlen(name) >= A1FS_NAME_MAX) {
+        return -ENAMETOOLONG;
+    }
+    struct a1fs_inode *new_parent = &fs->itable[parent];
+    if (!S_ISDIR(new_parent->mode)) {
+        return -ENOTDIR;
+    }
+    bool dir = S_ISDIR(in->mode);
+
+    //a directory can't be moved into itself
+    for (unsigned int p = parent; dir && p != 0; p = fs->itable[p].parent_num) {
+        if (p == (unsigned int)num) return -EINVAL;
+    }
+
+    struct a1fs_inode *old_parent = &fs->itable[in->parent_num];
+    const char *old_name = strrchr(from, '/') + 1;
+    struct a1fs_dentry *old_entry = dir_lookup(fs, old_parent, old_name);
+    if (old_entry == NULL) {
+        return -ENOENT;
+    }
+
+    struct a1fs_dentry *entry = dir_lookup(fs, new_parent, name);
+    struct a1fs_inode *target = NULL;
+    if (entry != NULL) {
+        if (flags & RENAME_NOREPLACE) {
+            return -EEXIST;
         }
-        //check if there's an indirect block in the removed directory
-        if (in->indirect != 0){
-            struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext *) (fs->image + A1FS_BLOCK_SIZE * (fs->sb->block_table + in->indirect));
-            for (int e=0; e < 500; e++){
-                int start = indirect->extent[e].start, count = indirect->extent[e].count;
-                if (count == 0)
-                    continue;
-                for (int f = 0; f < count; f++){
-                    fs->bbitmap->map[start + f] = 0;
-                    fs->sb->used_block_count -=1;
-                }
-            }
-            fs->bbitmap->map[in->indirect] = 0; //unallocate indirect block
-            fs->sb->used_block_count -=1;
+        if (entry == old_entry) {
+            return 0;   //renamed to itself
+        }
+        target = &fs->itable[entry->ino];
+        if (S_ISDIR(target->mode) && !dir) {
+            return -EISDIR;
         }
+        if (!S_ISDIR(target->mode) && dir) {
+            return -ENOTDIR;
+        }
+        if (dir && target->empty > 0) {
+            return -ENOTEMPTY;
+        }
+    } else {
+        entry = dir_alloc_entry(fs, new_parent);
+        if (entry == NULL) {
+            return -ENOSPC;
+        }
+        strcpy(entry->name, name);
+        new_parent->empty += 1;
+        if (dir) new_parent->links += 1;
+    }
+
+    //switch the target entry over, then drop the old one (which can move the
+    //new entry if both are in the same directory)
+    entry->ino = num;
+    entry_changed(fs, entry);
+    dir_remove_entry(fs, old_parent, old_entry);
+    old_parent->empty -= 1;
+    if (dir) old_parent->links -= 1;
+    in->parent_num = parent;
+
+    if (target != NULL) {
+        reclaim_inode(fs, target);  //the parent's counts are unchanged
     }
-    memset(in, 0, sizeof(a1fs_inode));
+    lazytime_touch(fs, old_parent);
+    lazytime_touch(fs, new_parent);
     return 0;
 }
 
@@ -955,10 +1080,12 @@ static int a1fs_unlink(const char *path)
  *
  * @param path   path to the file or directory.
  * @param times  timestamps array. See "man 2 utimensat" for details.
+ * @param fi     unused.
  * @return       0 on success; -errno on failure.
  */
-static int a1fs_utimens(const char *path, const struct timespec times[2])
+static int a1fs_utimens(const char *path, const struct timespec times[2], struct fuse_file_info *fi)
 {
+    (void)fi;// unused
     fs_ctx *fs = get_fs();
 
     // update the modification timestamp (mtime) in the inode for given
@@ -966,17 +1093,17 @@ static int a1fs_utimens(const char *path, const struct timespec times[2])
     // according to the utimensat man page
 
     int num = path_lookup(path);
-    struct a1fs_inode *in = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * num);
     if (num < 0){
         fprintf(stderr, "PATHLOOKUP FAILED\r\n");   //just in case
-        return -errno;
+        return lookup_error(num);
     }
+    struct a1fs_inode *in = &fs->itable[num];
     if (times == NULL || (times[0].tv_nsec == UTIME_NOW && times[1].tv_nsec == UTIME_NOW)){ //update to current time
-        clock_gettime(CLOCK_REALTIME, &in->mtime);
+        lazytime_touch(fs, in);
     }else if (times[0].tv_nsec == UTIME_OMIT && times[1].tv_nsec == UTIME_OMIT){    //do nothing
         return 0;
     }else{
-        in->mtime = times[1];
+        lazytime_set(fs, in, &times[1]);
     }
     return 0;
 }
@@ -997,195 +1124,32 @@ static int a1fs_utimens(const char *path, const struct timespec times[2])
  *
  * @param path  path to the file to set the size.
  * @param size  new file size in bytes.
+ * @param fi    unused.
  * @return      0 on success; -errno on error.
  */
-static int a1fs_truncate(const char *path, off_t size)
+static int a1fs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
 {
+    (void)fi;// unused
     fs_ctx *fs = get_fs();
 
-    //TODO: set new file size, possibly "zeroing out" the uninitialized range
-    struct a1fs_superblock *sb = fs->sb;
-   // struct a1fs_ibitmap *ibitmap = fs->ibitmap;
-    struct a1fs_bbitmap *bbitmap = fs->bbitmap;
     int num = path_lookup(path);
     if (num < 0){
         fprintf(stderr, "PATHLOOKUP FAILED\r\n");
-        return -errno;
+        return lookup_error(num);
     }
     //find inode of file
-    struct a1fs_inode *file = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * num);
+    struct a1fs_inode *file = &fs->itable[num];
 
     //nothing to do if file is the size
     if(file->size == (uint64_t) size) {
         return 0;
-    } else if(size > (sb->block_count - sb->used_block_count)*A1FS_BLOCK_SIZE) { //not enough free blocks
-        return -ENOSPC;
-    } else if(file->size < (uint64_t) size) { //extend file
-        int bytes_to_add = size - file->size;
-        while(bytes_to_add > 0) {
-            for (int i = 0; i < 13 && bytes_to_add > 0; i++) { //go through extents
-                if (file->extent[i].start == 0) { //find empty extent
-                    //allocate block
-                    for(int j = 1; j < A1FS_BLOCK_SIZE; j++) { //find empty data block
-                        if(bbitmap->map[j] == 0) {
-                            bbitmap->map[j] = 1;
-                            int extent_size = 1;
-                            for(int k = j+1; k < A1FS_BLOCK_SIZE && bytes_to_add > (A1FS_BLOCK_SIZE*extent_size); k++) { //find size of extent
-                                if (bbitmap->map[k] == 0) {
-                                    extent_size++;
-                                    bbitmap->map[k] = 1;
-                                    //bytes_to_add = bytes_to_add - A1FS_BLOCK_SIZE;
-                                }
-                            }
-                            if(bytes_to_add < A1FS_BLOCK_SIZE) {
-                                memset(fs->image+(sb->block_table+j)*A1FS_BLOCK_SIZE, 0, bytes_to_add); //0 data
-                                bytes_to_add = 0;
-                            } else if(bytes_to_add < A1FS_BLOCK_SIZE*extent_size){
-                                memset(fs->image+(sb->block_table+j)*A1FS_BLOCK_SIZE, 0, A1FS_BLOCK_SIZE*(extent_size-1) +bytes_to_add); //0 data
-                                bytes_to_add = bytes_to_add - (A1FS_BLOCK_SIZE*(extent_size-1) + bytes_to_add);
-                            } else {
-                                memset(fs->image+(sb->block_table+j)*A1FS_BLOCK_SIZE, 0, A1FS_BLOCK_SIZE*(extent_size)); //0 data
-                                bytes_to_add -= (A1FS_BLOCK_SIZE*extent_size);
-                            }
-                            file->extent[i].start = j;
-                            file->extent[i].count = extent_size;
-                            sb->used_block_count += extent_size;
-                            file->extent_count += extent_size;
-                            file->block_count += extent_size;
-                            break; //break for loop after extent allocated
-                        }
-                    }
-                }
-            }
-            if(bytes_to_add > 0) {
-                if(file->indirect == 0 ) { //new indirect block
-                    int b = first_block(bbitmap, 0);
-                    bbitmap->map[b] = 1;
-                    file->indirect = b;
-                    file->block_count++;
-                }
-                struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext*) (fs->image +
-                                                                                 A1FS_BLOCK_SIZE * ((sb->block_table) +
-                                                                                 file->indirect));
-                for (int i = 0; i < 500 && bytes_to_add > 0; i++) {
-                    if (indirect->extent[i].start == 0) { //find empty extent
-                        //allocate block
-                        for (int j = 1; j < A1FS_BLOCK_SIZE; j++) { //find empty data block
-                            if (bbitmap->map[j] == 0) {
-                                bbitmap->map[j] = 1;
-                                int extent_size = 1;
-                                for (int k = j + 1; k < A1FS_BLOCK_SIZE && bytes_to_add > (A1FS_BLOCK_SIZE *
-                                                                                           extent_size); k++) { //find size of extent
-                                    if (bbitmap->map[k] == 0) {
-                                        extent_size++;
-                                        bbitmap->map[k] = 1;
-                                        //bytes_to_add = bytes_to_add - A1FS_BLOCK_SIZE;
-                                    }
-                                }
-                                if (bytes_to_add < A1FS_BLOCK_SIZE) {
-                                    memset(fs->image + (sb->block_table + j) * A1FS_BLOCK_SIZE, 0, bytes_to_add); //0 data
-                                    bytes_to_add = 0;
-                                } else if (bytes_to_add < A1FS_BLOCK_SIZE * extent_size) {
-                                    memset(fs->image + (sb->block_table + j) * A1FS_BLOCK_SIZE, 0,
-                                           A1FS_BLOCK_SIZE * (extent_size - 1) + bytes_to_add); //0 data
-                                    bytes_to_add = bytes_to_add - (A1FS_BLOCK_SIZE * (extent_size - 1) + bytes_to_add);
-                                } else {
-                                    memset(fs->image + (sb->block_table + j) * A1FS_BLOCK_SIZE, 0,
-                                           A1FS_BLOCK_SIZE * (extent_size)); //0 data
-                                    bytes_to_add -= (A1FS_BLOCK_SIZE * extent_size);
-                                }
-                                indirect->extent[i].start = j;
-                                indirect->extent[i].count = extent_size;
-                                sb->used_block_count += extent_size;
-                                file->block_count += extent_size;
-                                file->extent_count += extent_size;
-                                break; //break for loop after extent allocated
-                            }
-                        }
-                    }
-                }
-            }
-        }
-        clock_gettime(CLOCK_REALTIME, &(file->mtime)); //update modified time
-        file->size = size; //update file size
-        return 0;
-    } else if(file->size > (uint64_t) size) { //shrink file
-        int bytes_to_remove = file->size - size;
-        while(bytes_to_remove >= A1FS_BLOCK_SIZE) { //can remove whole block
-            int last_extent = 0;
-            if(file->indirect != 0) {
-                struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext*)(fs->image +A1FS_BLOCK_SIZE*(sb->block_table+file->indirect));
-                for(int i = 0; i < 500; i++) {
-                    if(indirect->extent[i].start != 0) {
-                        last_extent = i;
-                    }
-                }
-                for(int j = indirect->extent[last_extent].count; j >= 0 && bytes_to_remove >= A1FS_BLOCK_SIZE; j--) {
-                    //remove block
-                    sb->used_block_count--;
-                    bbitmap->map[indirect->extent[last_extent].start + j] = 0;
-                    indirect->extent[last_extent].count--;
-                    file->extent_count--;
-                    file->block_count--;
-                    if(j == 0) { //extent needs to be cleared if empty
-                        indirect->extent[last_extent].start = 0;
-                        if(last_extent == 0) { //indirect block needs to be removed
-                            bbitmap->map[file->indirect] = 0;
-                            file->indirect = 0;
-                            file->block_count--;
-                        }
-                    }
-                    bytes_to_remove = bytes_to_remove - A1FS_BLOCK_SIZE;
-                }
-            } else {
-                for (int i = 0; i < 13; i++) { //find last extent with data
-                    if (file->extent[i].start != 0) {
-                        last_extent = i;
-                    }
-                }
-                //go through from end removing blocks
-                for (int j = file->extent[last_extent].count; j >= 0 && bytes_to_remove >= A1FS_BLOCK_SIZE; j--) {
-                    //remove block
-                    sb->used_block_count--;
-                    file->block_count--;
-                    bbitmap->map[file->extent[last_extent].start + j] = 0;
-                    file->extent[last_extent].count--;
-                    if (j == 0) { //extent needs to be cleared if empty
-                        file->extent[last_extent].start = 0;
-                    }
-                    bytes_to_remove = bytes_to_remove - A1FS_BLOCK_SIZE;
-                }
-            }
-        }
-        if(bytes_to_remove > 0) { //if partial block data still has to be removed
-            if(file->indirect != 0) {
-                struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext*)(fs->image +A1FS_BLOCK_SIZE*(sb->block_table+file->indirect));
-                int last_extent = 0;
-                for (int i = 0; i < 13; i++) {
-                    if(indirect->extent[i].start != 0) {
-                        last_extent = i;
-                    }
-                }
-                memset(fs->image + (sb->block_table + indirect->extent[last_extent].start + indirect->extent[last_extent].count)*A1FS_BLOCK_SIZE-bytes_to_remove, 0,
-                       bytes_to_remove);
-            } else {
-                int last_extent = 0;
-                for (int i = 0; i < 13; i++) {
-                    if(file->extent[i].start != 0) {
-                        last_extent = i;
-                    }
-                }
-                memset(fs->image + (sb->block_table + file->extent[last_extent].start + file->extent[last_extent].count)*A1FS_BLOCK_SIZE-bytes_to_remove, 0,
-                       bytes_to_remove);
-            }
-
-        }
-        clock_gettime(CLOCK_REALTIME, &(file->mtime));
-        file->size = size;
-        return 0;
     }
-
-    return -ENOSYS;
+    int ret = inode_resize(fs, file, size);
+    if (ret < 0) {
+        return ret;
+    }
+    lazytime_touch(fs, file); //update modified time
+    return 0;
 }
 
 
@@ -1216,215 +1180,42 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
     (void)fi;// unused
     fs_ctx *fs = get_fs();
 
-    //TODO: read data from the file at given offset into the buffer
-    // (void)path;
-    // (void)buf;
-    // (void)size;
-    // (void)offset;
-    // (void)fs;
-    struct a1fs_superblock *sb = fs->sb;
     int num = path_lookup(path);
     if (num < 0){
         fprintf(stderr, "PATHLOOKUP FAILED\r\n");
-        return -errno;
+        return lookup_error(num);
     }
-    struct a1fs_inode *file = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * num);
-    unsigned int difference = file->size - offset;
-    if (difference <= 0){
+    struct a1fs_inode *file = &fs->itable[num];
+    if ((uint64_t)offset >= file->size){
         return 0;
     }
-    int bytes_left_to_read = size;
-    int bytes_read_into_buf = 0;
-    int bytes_read = 0, offset_extent = 0, offset_extent_count = 0, offset_extent_set = 0, in_indirect = 0, offset_found = 0;
-    while(bytes_read < offset) { //first find offset
-        for(int i = 0;i < 13 && bytes_read < offset; i++) {
-            if(file->extent[i].start != 0) {
-                for(int j = 0; j < (int) file->extent[i].count; j++) {
-                    if(bytes_read/A1FS_BLOCK_SIZE < offset/A1FS_BLOCK_SIZE) { //skip blocks
-                        bytes_read += A1FS_BLOCK_SIZE;
-                    } else if(bytes_read/A1FS_BLOCK_SIZE != offset/A1FS_BLOCK_SIZE){ // find exact byte
-                        offset_extent = i;
-                        offset_extent_set = 1;
-                        offset_extent_count = j;
-                        for (int k = 0; k < A1FS_BLOCK_SIZE; k++) {
-                            bytes_read++;
-                            if(bytes_read == offset) { //found byte
-                                if(bytes_left_to_read < (A1FS_BLOCK_SIZE-k)) { //read partial block
-                                    // memcpy(fs->image + (sb->block_table + file->extent[i].start + file->extent[i].count) * A1FS_BLOCK_SIZE +
-                                    //        k, buf, bytes_left_to_read);
-                                    memcpy(buf, fs->image + (sb->block_table + file->extent[i].start + file->extent[i].count) * A1FS_BLOCK_SIZE +
-                                           k, bytes_left_to_read);
-                                    return size;
-                                } else { //read full block and exit looking for offset
-                                    // memcpy(fs->image + (sb->block_table + file->extent[i].start + file->extent[i].count) * A1FS_BLOCK_SIZE +
-                                    //        k, buf, (A1FS_BLOCK_SIZE - bytes_left_to_read));
-                                    memcpy(buf, fs->image + (sb->block_table + file->extent[i].start + file->extent[i].count) * A1FS_BLOCK_SIZE +
-                                           k, (A1FS_BLOCK_SIZE - bytes_left_to_read));
-                                    bytes_left_to_read -= (A1FS_BLOCK_SIZE-bytes_left_to_read);
-                                    bytes_read_into_buf += (A1FS_BLOCK_SIZE-bytes_left_to_read);
-                                    offset_found = 1;
-                                }
-                            }
-                            if(offset_found) {
-                                break;
-                            }
-                        }
-                    }
-                    if(offset_found) {
-                        break;
-                    }
-                }
-            }
-            if(offset_found) {
-                break;
-            }
-        }
-        //same thing as above but if indirect extent is used
-        for(int i = 0;i < 500 && bytes_read < offset; i++) {
-            in_indirect = 1;
-            struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext*)(fs->image +A1FS_BLOCK_SIZE*(sb->block_table+file->indirect));
-            if(indirect->extent[i].start != 0) {
-                for(int j = 0; j < (int) indirect->extent[i].count; j++) {
-                    if(bytes_read/A1FS_BLOCK_SIZE < offset/A1FS_BLOCK_SIZE) { //skip blocks
-                        bytes_read += A1FS_BLOCK_SIZE;
-                    } else if(bytes_read/A1FS_BLOCK_SIZE != offset/A1FS_BLOCK_SIZE){ // find exact byte
-                        offset_extent = i;
-                        offset_extent_set = 1;
-                        offset_extent_count = j;
-                        for (int k = 0; k < A1FS_BLOCK_SIZE; k++) {
-                            bytes_read++;
-                            if(bytes_read == offset) { //found byte
-                                if(bytes_left_to_read < (A1FS_BLOCK_SIZE-k)) { //read partial block
-                                    // memcpy(fs->image + (sb->block_table + indirect->extent[i].start + file->extent[i].count) * A1FS_BLOCK_SIZE +
-                                    //        k, buf, bytes_left_to_read);
-                                    memcpy(buf, fs->image + (sb->block_table + indirect->extent[i].start + indirect->extent[i].count) * A1FS_BLOCK_SIZE +
-                                                k, bytes_left_to_read);
-                                    return size;
-                                } else { //read full block and exit looking for offset
-                                    // memcpy(fs->image + (sb->block_table + indirect->extent[i].start + file->extent[i].count) * A1FS_BLOCK_SIZE +
-                                    //        k, buf, (A1FS_BLOCK_SIZE - bytes_left_to_read));
-                                    memcpy(buf, fs->image + (sb->block_table + indirect->extent[i].start + indirect->extent[i].count) * A1FS_BLOCK_SIZE +
-                                                k, (A1FS_BLOCK_SIZE - bytes_left_to_read));
-                                    bytes_left_to_read -= (A1FS_BLOCK_SIZE-bytes_left_to_read);
-                                    bytes_read_into_buf += (A1FS_BLOCK_SIZE-bytes_left_to_read);
-                                    offset_found = 1;
-                                }
-                            }
-                            if(offset_found) {
-                                break;
-                            }
-                        }
-                    }
-                    if(offset_found) {
-                        break;
-                    }
-                }
-            }
-            if(offset_found) {
-                break;
-            }
-        }
+    if (offset + size > file->size) {
+        size = file->size - offset;
     }
-    //now offset bytes have been read, time to read what we want.
-    if(!in_indirect) {
-        for(int i=offset_extent; i< 13; i++) {
-            if (file->extent[i].start != 0) {
-                for (int j = 0; j < (int) file->extent[i].count; j++) {
-                    if (i == offset_extent && offset_extent_set == 1) { //jump to where offset is
-                        j = offset_extent_count + 1;
-                    }
-                    if (bytes_left_to_read < A1FS_BLOCK_SIZE) { //partial block read
-                        // memcpy(fs->image + (sb->block_table + file->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                        //        buf + bytes_read_into_buf, bytes_left_to_read);
-                        memcpy(buf + bytes_read_into_buf,
-                               fs->image + (sb->block_table + file->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                               bytes_left_to_read);
-                        bytes_read_into_buf += bytes_left_to_read;
-                        return bytes_read_into_buf;
-                    } else { //full block read
-                        // memcpy(fs->image + (sb->block_table + file->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                        //        buf + bytes_read_into_buf, A1FS_BLOCK_SIZE);
-                        memcpy(buf + bytes_read_into_buf,
-                               fs->image + (sb->block_table + file->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                               A1FS_BLOCK_SIZE);
-                        bytes_read_into_buf += A1FS_BLOCK_SIZE;
-                        bytes_left_to_read -= A1FS_BLOCK_SIZE;
-                        if (bytes_left_to_read == 0) {
-                            return bytes_read_into_buf;
-                        }
-                    }
-                }
-            }
-        }
-        //need to continue reading from indirect blocks
-        for(int i = 0;i < 500; i++) {
-            struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext*)(fs->image +A1FS_BLOCK_SIZE*(sb->block_table+file->indirect));
-            for(int j = 0; j < (int) indirect->extent[i].count; j++) {
-                if(bytes_left_to_read < A1FS_BLOCK_SIZE) { //partial block read
-                    // memcpy(fs->image + (sb->block_table + file->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                    //        buf + bytes_read_into_buf, bytes_left_to_read);
-                    memcpy(buf + bytes_read_into_buf, fs->image + (sb->block_table + indirect->extent[i].start + j) * A1FS_BLOCK_SIZE, bytes_left_to_read);
-                    bytes_read_into_buf += bytes_left_to_read;
-                    return bytes_read_into_buf;
-                } else { //full block read
-                    // memcpy(fs->image + (sb->block_table + file->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                    //        buf + bytes_read_into_buf, A1FS_BLOCK_SIZE);
-                    memcpy(buf + bytes_read_into_buf, fs->image + (sb->block_table + indirect->extent[i].start + j) * A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE);
-                    bytes_read_into_buf += A1FS_BLOCK_SIZE;
-                    bytes_left_to_read -= A1FS_BLOCK_SIZE;
-                    if(bytes_left_to_read == 0) {
-                        return bytes_read_into_buf;
-                    }
-                }
-            }
+    if (file->flags & A1FS_INODE_COMPRESS) {
+        int ret = compress_read(fs, file, buf, size, offset);
+        return ret < 0 ? ret : (int)size;
+    }
+
+    //copy block by block; each extent is contiguous on disk (up to the end of
+    //a stripe chunk)
+    size_t bytes_read = 0;
+    while (bytes_read < size) {
+        uint64_t pos = offset + bytes_read;
+        a1fs_blk_t b, run;
+        if (!ext_map(fs, file, pos >> fs->block_shift, &b, &run)) {
+            break;
         }
-    } else {
-        for(int i=offset_extent; i< 500; i++) {
-            struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext*)(fs->image +A1FS_BLOCK_SIZE*(sb->block_table+file->indirect));
-            if (indirect->extent[i].start != 0) {
-                for (int j = 0; j < (int) indirect->extent[i].count; j++) {
-                    if (i == offset_extent && offset_extent_set == 1) { //jump to where offset is
-                        j = offset_extent_count + 1;
-                    }
-                    if (bytes_left_to_read < A1FS_BLOCK_SIZE) { //partial block read
-                        // memcpy(fs->image + (sb->block_table + file->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                        //        buf + bytes_read_into_buf, bytes_left_to_read);
-                        memcpy(buf + bytes_read_into_buf,
-                               fs->image + (sb->block_table + indirect->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                               bytes_left_to_read);
-                        bytes_read_into_buf += bytes_left_to_read;
-                        return bytes_read_into_buf;
-                    } else { //full block read
-                        // memcpy(fs->image + (sb->block_table + file->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                        //        buf + bytes_read_into_buf, A1FS_BLOCK_SIZE);
-                        memcpy(buf + bytes_read_into_buf,
-                               fs->image + (sb->block_table + indirect->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                               A1FS_BLOCK_SIZE);
-                        bytes_read_into_buf += A1FS_BLOCK_SIZE;
-                        bytes_left_to_read -= A1FS_BLOCK_SIZE;
-                        if (bytes_left_to_read == 0) {
-                            return bytes_read_into_buf;
-                        }
-                    }
-                }
-            }
+        run = fs_data_run(fs, b, run);
+        size_t within = fs_block_offset(fs, pos);
+        size_t n = ((size_t)run << fs->block_shift) - within;
+        if (n > size - bytes_read) {
+            n = size - bytes_read;
         }
+        memcpy(buf + bytes_read, fs_data_block(fs, b) + within, n);
+        bytes_read += n;
     }
-
-    //implement 1 block read
-//    struct a1fs_ibitmap *data = (struct a1fs_ibitmap *)(fs->image + A1FS_BLOCK_SIZE*(fs->sb->block_table +in->extent[0].start) + offset);  //shortcut to access bytes
-//    char *p = &data->map[offset];
-//    unsigned int toread = difference - size;
-//    if(toread > 0) {
-//        // strncpy(buf, p, toread);
-//        memcpy(buf, p, size);
-//        return size;
-//    }else if (toread ==0){
-//        *buf = '\0';
-//    }
-
-    return 0;
-    // return -ENOSYS;
+    return bytes_read;
 }
 
 /**
@@ -1456,207 +1247,459 @@ static int a1fs_write(const char *path, const char *buf, size_t size,
     (void)fi;// unused
     fs_ctx *fs = get_fs();
 
-    //TODO: write data from the buffer into the file at given offset, possibly
-    // "zeroing out" the uninitialized range
-    struct a1fs_superblock *sb = fs->sb;
-    // struct a1fs_ibitmap *ibitmap = fs->ibitmap;
-    //struct a1fs_bbitmap *bbitmap = fs->bbitmap;
     int num = path_lookup(path);
-    if (num == -1) {
-        return -errno;
+    if (num < 0) {
+        return lookup_error(num);
     }
-    //find inode of file
-    struct a1fs_inode *file = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE*4 + sizeof(a1fs_inode) * num);
+    return file_write(fs, &fs->itable[num], buf, size, offset);
+}
 
-    if(file->size < offset+size) {
-        a1fs_truncate(path, offset + size); //extend file as necessary
-    }
-    int bytes_left_to_write = size;
-    int bytes_written = 0;
-    int bytes_read = 0, offset_extent = 0, offset_extent_count = 0, offset_extent_set = 0, in_indirect = 0, offset_found = 0;
-    while(bytes_read < offset) { //first find offset
-        for(int i = 0; i < 13 && bytes_read < offset; i++) {
-            if(file->extent[i].start != 0) {
-                for(int j = 0; j < (int) file->extent[i].count; j++) {
-                    if(bytes_read/A1FS_BLOCK_SIZE < offset/A1FS_BLOCK_SIZE) { //skip blocks
-                        bytes_read += A1FS_BLOCK_SIZE;
-                    } else if(bytes_read/A1FS_BLOCK_SIZE != offset/A1FS_BLOCK_SIZE){ // find exact byte
-                        offset_extent = i;
-                        offset_extent_set = 1;
-                        offset_extent_count = j;
-                        for (int k = 0; k < A1FS_BLOCK_SIZE; k++) {
-                            bytes_read++;
-                            if(bytes_read == offset) { //found byte
-                                if(bytes_left_to_write < (A1FS_BLOCK_SIZE-k)) { //write partial block
-                                    memcpy(fs->image + (sb->block_table + file->extent[i].start + file->extent[i].count) * A1FS_BLOCK_SIZE +
-                                           k, buf, bytes_left_to_write);
-                                    clock_gettime(CLOCK_REALTIME, &(file->mtime));
-                                    return size;
-                                } else { //write full block and exit looking for offset
-                                    memcpy(fs->image + (sb->block_table + file->extent[i].start + file->extent[i].count) * A1FS_BLOCK_SIZE +
-                                           k, buf, (A1FS_BLOCK_SIZE - bytes_left_to_write));
-                                    bytes_left_to_write -= (A1FS_BLOCK_SIZE-bytes_left_to_write);
-                                    bytes_written += (A1FS_BLOCK_SIZE-bytes_left_to_write);
-                                    offset_found = 1;
-                                }
-                            }
-                            if(offset_found) {
-                                break;
-                            }
-                        }
-                    }
-                    if(offset_found) {
-                        break;
-                    }
-                }
-            } //else { //need to allocate additional data blocks to reach offset
-            //}
-            if(offset_found) {
-                break;
-            }
+/* Write an extent tree node block of a file back to the image. */
+static void sync_node(fs_ctx *fs, a1fs_blk_t blk, void *arg)
+{
+    bool *ok = arg;
+    *ok &= fs_ctx_sync_data(fs, blk, 1);
+}
+
+/**
+ * Synchronize a file.
+ *
+ * Implements the fsync() system call. The image is a shared file mapping, so
+ * the data is in the page cache already; the deferred timestamps (see
+ * lazytime.h) are copied into the inode and then the file's data blocks, its
+ * extent tree and the inode table block that holds its inode are written back
+ * to the image with msync().
+ *
+ * Errors:
+ *   EIO  writing the blocks back to the image failed.
+ *
+ * @param path      path to the file.
+ * @param datasync  if nonzero, only the file data has to be synchronized.
+ * @param fi        unused.
+ * @return          0 on success; -errno on error.
+ */
+static int a1fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void)fi;// unused
+    fs_ctx *fs = get_fs();
+
+    int num = path_lookup(path);
+    if (num < 0) {
+        return lookup_error(num);
+    }
+    a1fs_inode *in = &fs->itable[num];
+    if (!datasync) lazytime_flush(fs);
+
+    bool ok = true;
+    a1fs_ext_leaf leaf;
+    for (a1fs_blk_t l = 0; ext_find(fs, in, l, &leaf); l = leaf.lblk + leaf.ext.count) {
+        ok &= fs_ctx_sync_data(fs, leaf.ext.start, ext_pcount(fs, &leaf));
+    }
+    ext_for_each_node(fs, in, sync_node, &ok);
+    // the inode holds the size and the extent tree root even for fdatasync()
+    ok &= fs_ctx_sync(fs, in, sizeof(*in));
+    return ok ? 0 : -EIO;
+}
+
+/**
+ * Copy a range of data from one file to another.
+ *
+ * Implements the copy_file_range() system call. See "man 2 copy_file_range"
+ * for details. Only used with the copy_file_range mount option. Copying all
+ * of a file into an empty one (what "cp" does) shares the data blocks instead
+ * of copying them (see reflink.h). For other ranges the kernel is told that
+ * the copy is not supported, and it copies the data through read() and
+ * write() instead.
+ *
+ * Assumptions (already verified by the kernel):
+ *   both files are open, the input for reading and the output for writing.
+ *
+ * Errors:
+ *   EINVAL      flags is not 0, or a path is not a regular file.
+ *   EOPNOTSUPP  the range cannot be copied by sharing the data blocks.
+ *   ENOSPC      not enough free space for the extent tree of the copy.
+ *
+ * @param path_in     path to the file to copy from.
+ * @param fi_in       unused.
+ * @param offset_in   offset in the input file to copy from.
+ * @param path_out    path to the file to copy to.
+ * @param fi_out      unused.
+ * @param offset_out  offset in the output file to copy to.
+ * @param size        number of bytes to copy.
+ * @param flags       must be 0.
+ * @return            number of bytes copied; -errno on error.
+ */
+static ssize_t a1fs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+                                    const char *path_out, struct fuse_file_info *fi_out, off_t offset_out,
+                                    size_t size, int flags)
+{
+    (void)fi_in;// unused
+    (void)fi_out;// unused
+    fs_ctx *fs = get_fs();
+    if (flags != 0) return -EINVAL;
+
+    int src = path_lookup(path_in);
+    if (src < 0) return lookup_error(src);
+    int dst = path_lookup(path_out);
+    if (dst < 0) return lookup_error(dst);
+    a1fs_inode *in = &fs->itable[src];
+    a1fs_inode *out = &fs->itable[dst];
+    if (!S_ISREG(in->mode) || !S_ISREG(out->mode)) return -EINVAL;
+    if ((uint64_t)offset_in >= in->size) return 0;
+
+    // an empty output is left as it was if the clone fails
+    if (src == dst || offset_in != 0 || offset_out != 0 || size < in->size || out->size != 0) {
+        return -EOPNOTSUPP;
+    }
+    int ret = reflink_clone(fs, out, in);
+    if (ret == -EMLINK) return -EOPNOTSUPP;// copied by the kernel instead
+    if (ret < 0) return ret;
+    lazytime_touch(fs, out);
+    return out->size;
+}
+
+/* Checks the names (and for create, the data ranges) of a bulk request.
+ * Invalid entries and repeated names get an error result; the rest get
+ * "pending" (-ENOENT for stat, 0 for create).
+ */
+static void bulk_validate(struct a1fs_bulk *bulk, bool create)
+{
+    for (uint32_t i = 0; i < bulk->count; i++) {
+        struct a1fs_bulk_entry *e = &bulk->entries[i];
+        e->result = create ? 0 : -ENOENT;
+        size_t len = strnlen(e->name, A1FS_NAME_MAX);
+        if (len == A1FS_NAME_MAX) {
+            e->result = -ENAMETOOLONG;
+        } else if (len == 0 || strchr(e->name, '/') != NULL) {
+            e->result = -EINVAL;
+        } else if (create && (e->data_off > A1FS_BULK_DATA || e->data_len > A1FS_BULK_DATA - e->data_off)) {
+            e->result = -EINVAL;
         }
-        //same thing as above but if indirect extent is used
-        for(int i = 0; i < 500 && bytes_read < offset; i++) {
-            in_indirect = 1;
-            struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext*)(fs->image +A1FS_BLOCK_SIZE*(sb->block_table+file->indirect));
-            if(indirect->extent[i].start != 0) {
-                for(int j = 0; j < (int) indirect->extent[i].count; j++) {
-                    if(bytes_read/A1FS_BLOCK_SIZE < offset/A1FS_BLOCK_SIZE) { //skip blocks
-                        bytes_read += A1FS_BLOCK_SIZE;
-                    } else if(bytes_read/A1FS_BLOCK_SIZE != offset/A1FS_BLOCK_SIZE){ // find exact byte
-                        offset_extent = i;
-                        offset_extent_set = 1;
-                        offset_extent_count = j;
-                        for (int k = 0; k < A1FS_BLOCK_SIZE; k++) {
-                            bytes_read++;
-                            if(bytes_read == offset) { //found byte
-                                if(bytes_left_to_write < (A1FS_BLOCK_SIZE-k)) { //write partial block
-                                    memcpy(fs->image + (sb->block_table + indirect->extent[i].start + indirect->extent[i].count) * A1FS_BLOCK_SIZE +
-                                           k, buf, bytes_left_to_write);
-                                    clock_gettime(CLOCK_REALTIME, &(file->mtime));
-                                    return size;
-                                } else { //write full block and exit looking for offset
-                                    memcpy(fs->image + (sb->block_table + indirect->extent[i].start + indirect->extent[i].count) * A1FS_BLOCK_SIZE +
-                                           k, buf, (A1FS_BLOCK_SIZE - bytes_left_to_write));
-                                    bytes_left_to_write -= (A1FS_BLOCK_SIZE-bytes_left_to_write);
-                                    bytes_written += (A1FS_BLOCK_SIZE-bytes_left_to_write);
-                                    offset_found = 1;
-                                }
-                            }
-                            if(offset_found) {
-                                break;
-                            }
-                        }
-                    }
-                    if(offset_found) {
-                        break;
-                    }
-                }
-            } //else { //need to allocate additional data blocks to reach offset
-            //}
-            if(offset_found) {
-                break;
-            }
+        for (uint32_t j = 0; create && e->result == 0 && j < i; j++) {
+            if (strcmp(bulk->entries[j].name, e->name) == 0) e->result = -EEXIST;
         }
-
     }
-    //now offset bytes have been read, time to write.
-    if(!in_indirect) {
-        for (int i = offset_extent; i < 13; i++) {
-            if (file->extent[i].start != 0) {
-                for (int j = 0; j < (int) file->extent[i].count; j++) {
-                    if (i == offset_extent && offset_extent_set == 1) { //jump to where offset is
-                        j = offset_extent_count + 1;
-                    }
-                    if (bytes_left_to_write < A1FS_BLOCK_SIZE) { //partial block write
-                        memcpy(fs->image + (sb->block_table + file->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                               buf + bytes_written, bytes_left_to_write);
-                        bytes_written += bytes_left_to_write;
-                        clock_gettime(CLOCK_REALTIME, &(file->mtime));
-                        return bytes_written;
-                    } else { //full block write
-                        memcpy(fs->image + (sb->block_table + file->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                               buf + bytes_written, A1FS_BLOCK_SIZE);
-                        bytes_written += A1FS_BLOCK_SIZE;
-                        bytes_left_to_write -= A1FS_BLOCK_SIZE;
-                        if (bytes_left_to_write == 0) {
-                            clock_gettime(CLOCK_REALTIME, &(file->mtime));
-                            return bytes_written;
-                        }
-                    }
+}
+
+/* Makes one pass over the entries of directory dir. Every pending request
+ * whose name is found gets -EEXIST (create) or the attributes of the file
+ * (stat). Up to want free entries are collected in free_entries.
+ */
+static void bulk_scan(fs_ctx *fs, a1fs_inode *dir, struct a1fs_bulk *bulk, bool create,
+                      a1fs_dentry **free_entries, unsigned int want, unsigned int *n_free)
+{
+    int pending = create ? 0 : -ENOENT;
+    a1fs_blk_t n = ext_nblocks(fs, dir);
+    for (a1fs_blk_t l = 0; l < n; l++) {
+        a1fs_blk_t b;
+        if (!ext_map(fs, dir, l, &b, NULL)) break;
+        a1fs_dentry *entry = fs_data_block(fs, b);
+        for (unsigned int i = 0; i < fs->block_size / sizeof(a1fs_dentry); i++) {
+            if (entry[i].name[0] == '\0') {
+                if (*n_free < want) free_entries[(*n_free)++] = &entry[i];
+                continue;
+            }
+            for (uint32_t k = 0; k < bulk->count; k++) {
+                struct a1fs_bulk_entry *e = &bulk->entries[k];
+                if (e->result != pending || e->name[0] != entry[i].name[0] ||
+                    strcmp(e->name, entry[i].name) != 0)
+                {
+                    continue;
                 }
+                if (create) {
+                    e->result = -EEXIST;
+                    continue;
+                }
+                a1fs_inode *in = &fs->itable[entry[i].ino];
+                e->result = 0;
+                e->mode = in->mode;
+                e->size = in->size;
+                e->links = in->links;
+                e->blocks = in->block_count * (fs->block_size / 512);
+                e->mtime = lazytime_get(fs, in);
             }
         }
-        for (int i = 0; i < 500; i++) {
-            struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext*)(fs->image +A1FS_BLOCK_SIZE*(sb->block_table+file->indirect));
-            if (indirect->extent[i].start != 0) {
-                for (int j = 0; j < (int) indirect->extent[i].count; j++) {
-                    if (bytes_left_to_write < A1FS_BLOCK_SIZE) { //partial block write
-                        memcpy(fs->image + (sb->block_table + indirect->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                               buf + bytes_written, bytes_left_to_write);
-                        bytes_written += bytes_left_to_write;
-                        clock_gettime(CLOCK_REALTIME, &(file->mtime));
-                        return bytes_written;
-                    } else { //full block write
-                        memcpy(fs->image + (sb->block_table + indirect->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                               buf + bytes_written, A1FS_BLOCK_SIZE);
-                        bytes_written += A1FS_BLOCK_SIZE;
-                        bytes_left_to_write -= A1FS_BLOCK_SIZE;
-                        if (bytes_left_to_write == 0) {
-                            clock_gettime(CLOCK_REALTIME, &(file->mtime));
-                            return bytes_written;
-                        }
-                    }
-                }
+    }
+}
+
+/* Creates the files of an A1FS_IOC_BULK_CREATE request in directory dir. */
+static int bulk_create(fs_ctx *fs, a1fs_inode *dir, struct a1fs_bulk *bulk)
+{
+    a1fs_dentry *free_entries[A1FS_BULK_MAX];
+    unsigned int n_free = 0;
+    bool compacted = false;
+    bulk_validate(bulk, true);
+    bulk_scan(fs, dir, bulk, true, free_entries, bulk->count, &n_free);
+
+    for (uint32_t i = 0; i < bulk->count; i++) {
+        struct a1fs_bulk_entry *e = &bulk->entries[i];
+        if (e->result != 0) continue;
+
+        //the directory only grows once the free entries found are used up;
+        //the rest of a new block is kept for the following requests
+        if (n_free == 0) {
+            a1fs_dentry *entry = compacted ? dir_alloc_entry(fs, dir) : dir_grow(fs, dir);
+            if (entry == NULL) {
+                e->result = -ENOSPC;
+                continue;
+            }
+            unsigned int per_block = compacted ? 1 : fs->block_size / sizeof(a1fs_dentry);
+            for (unsigned int k = per_block; k-- > 0; ) {
+                if (n_free < A1FS_BULK_MAX) free_entries[n_free++] = entry + k;
             }
         }
-    } else {
-        for (int i = offset_extent; i < 500; i++) {
-            struct a1fs_indirect_ext *indirect = (struct a1fs_indirect_ext*)(fs->image +A1FS_BLOCK_SIZE*(sb->block_table+file->indirect));
-            if (indirect->extent[i].start != 0) {
-                for (int j = 0; j < (int) indirect->extent[i].count; j++) {
-                    if (i == offset_extent && offset_extent_set == 1) { //jump to where offset is
-                        j = offset_extent_count + 1;
-                    }
-                    if (bytes_left_to_write < A1FS_BLOCK_SIZE) { //partial block write
-                        memcpy(fs->image + (sb->block_table + indirect->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                               buf + bytes_written, bytes_left_to_write);
-                        bytes_written += bytes_left_to_write;
-                        clock_gettime(CLOCK_REALTIME, &(file->mtime));
-                        return bytes_written;
-                    } else { //full block write
-                        memcpy(fs->image + (sb->block_table + indirect->extent[i].start + j) * A1FS_BLOCK_SIZE,
-                               buf + bytes_written, A1FS_BLOCK_SIZE);
-                        bytes_written += A1FS_BLOCK_SIZE;
-                        bytes_left_to_write -= A1FS_BLOCK_SIZE;
-                        if (bytes_left_to_write == 0) {
-                            clock_gettime(CLOCK_REALTIME, &(file->mtime));
-                            return bytes_written;
-                        }
-                    }
-                }
+        a1fs_dentry *entry = free_entries[--n_free];
+        long ino = file_new(fs, dir, entry, e->name, S_IFREG | (e->mode & 07777));
+        if (ino < 0) {
+            free_entries[n_free++] = entry;
+            e->result = ino;
+            continue;
+        }
+
+        a1fs_inode *in = &fs->itable[ino];
+        if (e->data_len > 0) {
+            int ret = file_write(fs, in, bulk->data + e->data_off, e->data_len, 0);
+            if (ret < 0) {
+                //a file without its data is not left behind; removing the
+                //entry can move other entries and free the last directory
+                //block, so the free entries collected so far are dropped
+                dir_remove_entry(fs, dir, entry);
+                dir->empty -= 1;
+                reclaim_inode(fs, in);
+                n_free = 0;
+                compacted = true;
+                e->result = ret;
+                continue;
             }
         }
+        if (e->mtime.tv_sec != 0 || e->mtime.tv_nsec != 0) lazytime_set(fs, in, &e->mtime);
+    }
+    return 0;
+}
+
+/* Fills in the attributes of an A1FS_IOC_BULK_STAT request in directory dir. */
+static int bulk_stat(fs_ctx *fs, a1fs_inode *dir, struct a1fs_bulk *bulk)
+{
+    unsigned int n_free = 0;
+    bulk_validate(bulk, false);
+    bulk_scan(fs, dir, bulk, false, NULL, 0, &n_free);
+    return 0;
+}
+
+/* Fills in the image mapping part of the A1FS_IOC_STATS result. */
+static void mapping_stats(fs_ctx *fs, struct a1fs_stats *st)
+{
+    st->map_flags = fs->map_flags;
+    st->huge_bytes = st->locked_bytes = 0;
+    for (unsigned int m = 0; m < fs->n_members; m++) {
+        uint64_t huge, locked;
+        if (!map_residency(fs->members[m], &huge, &locked)) {
+            st->huge_bytes = st->locked_bytes = A1FS_STAT_NONE;
+            break;
+        }
+        st->huge_bytes += huge;
+        st->locked_bytes += locked;
     }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    st->minor_faults = ru.ru_minflt;
+    st->major_faults = ru.ru_majflt;
+    st->dtlb_misses = fs->tlb_fd >= 0 ? tlb_counter_read(fs->tlb_fd) : A1FS_STAT_NONE;
+    st->heap_allocs = heap_allocs();
+}
+
+/**
+ * Handle an a1fs specific ioctl on a file or directory.
+ *
+ * Supported commands:
+ *   A1FS_IOC_DEFRAG   move the file into a single extent; see defrag.h.
+ *   A1FS_IOC_STATS    get file system and image mapping statistics; see a1fs.h.
+ *   FS_IOC_GETFLAGS   get the inode flags; only FS_COMPR_FL is supported.
+ *   FS_IOC_SETFLAGS   set the inode flags (e.g. "chattr +c"); see compress.h.
+ *   A1FS_IOC_CLONE    make the file share the data of another; see reflink.h.
+ *   A1FS_IOC_SNAP_CREATE, A1FS_IOC_SNAP_DELETE, A1FS_IOC_SNAP_LIST
+ *                     manage the snapshots of the file system; see snapshot.h.
+ *   A1FS_IOC_BULK_CREATE, A1FS_IOC_BULK_STAT
+ *                     create or stat many files of a directory at once; the
+ *                     result of each file is in its entry; see a1fs.h.
+ *   A1FS_IOC_TRIM     discard the free blocks; can be issued on any file;
+ *                     see discard.h.
+ *
+ * Errors:
+ *   ENOTTY      unknown command.
+ *   EOPNOTSUPP  unsupported inode flag.
+ *   ENOSPC      not enough free space to move or convert the file.
+ *   EMLINK      a block of the clone source is shared too many times, or
+ *               there are too many snapshots.
+ *   EEXIST      a snapshot with the name exists already.
+ *   EROFS       the command modifies a mounted snapshot.
+ *   ENOTDIR     a bulk request is issued on a file.
+ *   EOPNOTSUPP  the host file system cannot punch holes (A1FS_IOC_TRIM).
+ *
+ * @param path   path to the file.
+ * @param cmd    ioctl command.
+ * @param arg    unused.
+ * @param fi     unused.
+ * @param flags  FUSE_IOCTL_* flags.
+ * @param data   buffer with the command argument/result.
+ * @return       0 on success; -errno on error.
+ */
+static int a1fs_ioctl(const char *path, int cmd, void *arg,
+                      struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+    (void)arg;// unused
+    (void)fi;// unused
+    fs_ctx *fs = get_fs();
 
+    if (flags & FUSE_IOCTL_COMPAT) return -ENOSYS;
 
-    return -ENOSYS;
+    int num = path_lookup(path);
+    if (num < 0) return -ENOENT;
+    a1fs_inode *in = &fs->itable[num];
+
+    bool reads = cmd == (int)A1FS_IOC_STATS || cmd == (int)FS_IOC_GETFLAGS
+                 || cmd == (int)A1FS_IOC_SNAP_LIST || cmd == (int)A1FS_IOC_BULK_STAT;
+    if (fs->read_only && !reads) return -EROFS;
+
+    switch ((unsigned int)cmd) {
+    case A1FS_IOC_DEFRAG:
+        return defrag_inode(fs, in, (struct a1fs_defrag_info*)data);
+    case A1FS_IOC_STATS:
+        //reading /proc for the mapping statistics allocates; it is not counted
+        heap_scope_end();
+        compress_stats(fs, (struct a1fs_stats*)data);
+        mapping_stats(fs, (struct a1fs_stats*)data);
+        heap_scope_begin();
+        return 0;
+    case FS_IOC_GETFLAGS:
+        *(long*)data = (in->flags & A1FS_INODE_COMPRESS) ? FS_COMPR_FL : 0;
+        return 0;
+    case A1FS_IOC_CLONE: {
+        struct a1fs_clone_args *args = (struct a1fs_clone_args*)data;
+        args->src[A1FS_PATH_MAX - 1] = '\0';
+        int src = path_lookup(args->src);
+        if (src < 0) return lookup_error(src);
+        if (!S_ISREG(in->mode) || !S_ISREG(fs->itable[src].mode)) return -EINVAL;
+        if (src == num) return 0;
+        int ret = reflink_clone(fs, in, &fs->itable[src]);
+        lazytime_touch(fs, in);
+        return ret;
+    }
+    case FS_IOC_SETFLAGS: {
+        //chattr passes an int, whatever the size encoded in the command
+        int iflags = *(int*)data;
+        if (iflags & ~FS_COMPR_FL) return -EOPNOTSUPP;
+        return compress_set(fs, in, iflags & FS_COMPR_FL);
+    }
+    case A1FS_IOC_SNAP_CREATE:
+    case A1FS_IOC_SNAP_DELETE: {
+        struct a1fs_snap_name *name = (struct a1fs_snap_name*)data;
+        if (cmd == (int)A1FS_IOC_SNAP_DELETE) return snapshot_delete(fs, name->name);
+        lazytime_flush(fs);  //the snapshot copies the inode table
+        return snapshot_create(fs, name->name);
+    }
+    case A1FS_IOC_SNAP_LIST:
+        snapshot_list(fs, (struct a1fs_snap_list*)data);
+        return 0;
+    case A1FS_IOC_BULK_CREATE:
+    case A1FS_IOC_BULK_STAT: {
+        struct a1fs_bulk *bulk = (struct a1fs_bulk*)data;
+        if (!S_ISDIR(in->mode)) return -ENOTDIR;
+        if (bulk->count > A1FS_BULK_MAX) return -EINVAL;
+        return cmd == (int)A1FS_IOC_BULK_CREATE ? bulk_create(fs, in, bulk) : bulk_stat(fs, in, bulk);
+    }
+    case A1FS_IOC_TRIM: {
+        struct a1fs_trim *trim = (struct a1fs_trim*)data;
+        uint64_t blocks;
+        int ret = discard_trim(fs, fs_blocks(fs, trim->minlen), &blocks);
+        trim->trimmed = blocks << fs->block_shift;
+        return ret;
+    }
+    default:
+        return -ENOTTY;
+    }
 }
 
 
+/* Defines name_counted(), which calls name() with the heap allocations it
+ * makes counted (see heapstat.h).
+ */
+#define COUNTED(name, params, args)         \
+    static int name##_counted params        \
+    {                                       \
+        heap_scope_begin();                 \
+        int ret = name args;                \
+        heap_scope_end();                   \
+        return ret;                         \
+    }
+
+COUNTED(a1fs_statfs, (const char *path, struct statvfs *st), (path, st))
+COUNTED(a1fs_read, (const char *path, char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi), (path, buf, size, offset, fi))
+
+/* Defines name_locked(), which calls name() with fs->lock held. The callbacks
+ * that allocate or free anything, or that use the deferred timestamps (see
+ * lazytime.h), are called through these so that they do not run at the same
+ * time as the background reclaimer (see reclaim.h). The
+ * blocks they freed are discarded before they return (see discard.h). Their
+ * heap allocations are counted like those of the COUNTED() callbacks.
+ * LOCKED_AS() is for callbacks that return type instead of int.
+ */
+#define LOCKED_AS(type, name, params, args) \
+    static type name##_locked params        \
+    {                                       \
+        fs_ctx *fs = get_fs();              \
+        pthread_mutex_lock(&fs->lock);      \
+        heap_scope_begin();                 \
+        type ret = name args;               \
+        discard_flush(fs);                  \
+        heap_scope_end();                   \
+        pthread_mutex_unlock(&fs->lock);    \
+        return ret;                         \
+    }
+#define LOCKED(name, params, args) LOCKED_AS(int, name, params, args)
+
+LOCKED(a1fs_getattr, (const char *path, struct stat *st, struct fuse_file_info *fi), (path, st, fi))
+LOCKED(a1fs_readdir, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                      struct fuse_file_info *fi, enum fuse_readdir_flags flags),
+                     (path, buf, filler, offset, fi, flags))
+LOCKED(a1fs_mkdir, (const char *path, mode_t mode), (path, mode))
+LOCKED(a1fs_rmdir, (const char *path), (path))
+LOCKED(a1fs_create, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+LOCKED(a1fs_unlink, (const char *path), (path))
+LOCKED(a1fs_rename, (const char *from, const char *to, unsigned int flags), (from, to, flags))
+LOCKED(a1fs_utimens, (const char *path, const struct timespec times[2], struct fuse_file_info *fi),
+                     (path, times, fi))
+LOCKED(a1fs_truncate, (const char *path, off_t size, struct fuse_file_info *fi), (path, size, fi))
+LOCKED(a1fs_write, (const char *path, const char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi), (path, buf, size, offset, fi))
+LOCKED(a1fs_fsync, (const char *path, int datasync, struct fuse_file_info *fi),
+                   (path, datasync, fi))
+LOCKED(a1fs_ioctl, (const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                    unsigned int flags, void *data), (path, cmd, arg, fi, flags, data))
+LOCKED_AS(ssize_t, a1fs_copy_file_range,
+          (const char *path_in, struct fuse_file_info *fi_in, off_t offset_in, const char *path_out,
+           struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags),
+          (path_in, fi_in, offset_in, path_out, fi_out, offset_out, size, flags))
+
 static struct fuse_operations a1fs_ops = {
+    .init     = a1fs_start,
     .destroy  = a1fs_destroy,
-    .statfs   = a1fs_statfs,
-    .getattr  = a1fs_getattr,
-    .readdir  = a1fs_readdir,
-    .mkdir    = a1fs_mkdir,
-    .rmdir    = a1fs_rmdir,
-    .create   = a1fs_create,
-    .unlink   = a1fs_unlink,
-    .utimens  = a1fs_utimens,
-    .truncate = a1fs_truncate,
-    .read     = a1fs_read,
-    .write    = a1fs_write,
+    .statfs   = a1fs_statfs_counted,
+    .getattr  = a1fs_getattr_locked,
+    .readdir  = a1fs_readdir_locked,
+    .mkdir    = a1fs_mkdir_locked,
+    .rmdir    = a1fs_rmdir_locked,
+    .create   = a1fs_create_locked,
+    .unlink   = a1fs_unlink_locked,
+    .rename   = a1fs_rename_locked,
+    .utimens  = a1fs_utimens_locked,
+    .truncate = a1fs_truncate_locked,
+    .read     = a1fs_read_counted,
+    .write    = a1fs_write_locked,
+    .fsync    = a1fs_fsync_locked,
+    .ioctl    = a1fs_ioctl_locked,
+    // .copy_file_range is set by the copy_file_range option
 };
 
 int main(int argc, char *argv[])
@@ -1671,5 +1714,6 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (opts.copy_file_range) a1fs_ops.copy_file_range = a1fs_copy_file_range_locked;
     return fuse_main(args.argc, args.argv, &a1fs_ops, &fs);
 }
@@ -7,19 +7,29 @@
 #include <assert.h>
 #include <stdint.h>
 #include <limits.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 
 
 /**
- * a1fs block size in bytes. You are not allowed to change this value.
+ * a1fs default (and smallest) block size in bytes.
  *
  * The block size is the unit of space allocation. Each file (and directory)
  * must occupy an integral number of blocks. Each of the file systems metadata
  * partitions, e.g. superblock, inode/block bitmaps, inode table (but not an
  * individual inode) must also occupy an integral number of blocks.
+ *
+ * The block size of an image is chosen by mkfs and recorded in the superblock
+ * as A1FS_BLOCK_SIZE << log_block_size. The superblock itself is always at
+ * byte offset A1FS_BLOCK_SIZE so that it can be found before the block size is
+ * known; with larger blocks it lives in the unused block 0.
  */
 #define A1FS_BLOCK_SIZE 4096
 
+/** Largest supported block size; log_block_size is 0, 2 or 4 (4K/16K/64K). */
+#define A1FS_LOG_BLOCK_SIZE_MAX 4
+#define A1FS_BLOCK_SIZE_MAX (A1FS_BLOCK_SIZE << A1FS_LOG_BLOCK_SIZE_MAX)
+
 /** Block number (block pointer) type. */
 typedef uint32_t a1fs_blk_t;
 
@@ -30,11 +40,40 @@ typedef uint32_t a1fs_ino_t;
 /** Magic value that can be used to identify an a1fs image. */
 #define A1FS_MAGIC 0xC5C369A1C5C369A1ul
 
+/**
+ * Inode table blocks from itable_init onwards have not been zeroed yet. They
+ * are zeroed in the background after mount, or on demand when an inode in one
+ * of them is allocated.
+ */
+#define A1FS_FEATURE_LAZY_ITABLE 0x1
+
+/**
+ * The data region is striped over stripe_count image files (see
+ * a1fs_stripe_hdr). The metadata is only in the first one.
+ */
+#define A1FS_FEATURE_STRIPE 0x2
+
+/**
+ * The metadata area has a table of the generation in which each data block
+ * was last modified (one uint32_t per block tracked by the block bitmap),
+ * starting at block cbt_table. Blocks written from now on get cbt_gen, which
+ * is raised by dump.a1fs -c, so that later dumps can hold only the blocks
+ * changed since then.
+ */
+#define A1FS_FEATURE_CBT 0x4
+
+/**
+ * The file system was unmounted cleanly: the superblock counters and the
+ * free-space summary match the bitmaps. Cleared while the file system is
+ * mounted, so that the next mount after a crash rebuilds them.
+ */
+#define A1FS_STATE_CLEAN 0x1
+
 /** a1fs superblock. */
 typedef struct a1fs_superblock {
     /** Must match A1FS_MAGIC. */
     uint64_t magic;
-    /** File system size in bytes. */
+    /** File system size in bytes (of the first image if it is striped). */
     uint64_t size;
 
     //TODO: add necessary fields
@@ -46,12 +85,81 @@ typedef struct a1fs_superblock {
     unsigned int block_bitmap;      /* Blocks bitmap block */
     unsigned int inode_table;       /* Start of inodes table block */
     unsigned int block_table;       /* Start of data table block */
+    unsigned int features;          /* A1FS_FEATURE_* flags */
+    unsigned int itable_init;       /* Number of initialized inode table blocks */
+    unsigned int log_block_size;    /* Block size is A1FS_BLOCK_SIZE << log_block_size */
+    unsigned int compr_logical;     /* Logical blocks stored in compressed clusters */
+    unsigned int compr_physical;    /* Data blocks used by compressed clusters */
+    unsigned int snap_head;         /* Data block of the newest snapshot; 0 if there is none */
+    unsigned int snap_count;        /* Number of snapshots */
+    unsigned int state;             /* A1FS_STATE_* flags */
+    unsigned int stripe_count;      /* Number of image files with A1FS_FEATURE_STRIPE */
+    unsigned int stripe_log_chunk;  /* Stripe chunk is 1 << stripe_log_chunk blocks */
+    uint64_t stripe_id;             /* Identifies the images of a striped file system */
+    unsigned int orphan_head;       /* First inode on the orphan list; 0 if it is empty */
+    unsigned int cbt_table;         /* First block of the generation table with A1FS_FEATURE_CBT */
+    unsigned int cbt_gen;           /* Generation that data block changes are recorded in */
 } a1fs_superblock;
 
 // Superblock must fit into a single block
 static_assert(sizeof(a1fs_superblock) <= A1FS_BLOCK_SIZE,
               "superblock is too large");
 
+/** Maximum number of image files that a file system can be striped over. */
+#define A1FS_STRIPE_MAX 16
+
+/** Magic value of a stripe member header. */
+#define A1FS_STRIPE_MAGIC 0xC5C369A15781BE00ul
+
+/**
+ * Header in block 0 of every image of a striped file system but the first.
+ *
+ * The data blocks are split into chunks of 1 << stripe_log_chunk blocks that
+ * go round-robin over the images: chunk c lives in image c % stripe_count,
+ * as chunk c / stripe_count of that image's data. The data of the first image
+ * starts at block_table, that of the others right after this header.
+ */
+typedef struct a1fs_stripe_hdr {
+    /** Must match A1FS_STRIPE_MAGIC. */
+    uint64_t magic;
+    /** Must match the superblock stripe_id. */
+    uint64_t id;
+    /** Position of the image in the stripe set (1 .. stripe_count - 1). */
+    uint32_t index;
+    uint32_t count;
+} a1fs_stripe_hdr;
+
+/** Magic value of the free-space summary. */
+#define A1FS_SUMMARY_MAGIC 0xC5C369A1F4EE5A4Dul
+
+/** Number of regions that the data blocks are divided into in the summary. */
+#define A1FS_SUMMARY_REGIONS 512
+/** Number of free run length classes: [1, 2), [2, 4), ... [2^16, 2^17). */
+#define A1FS_SUMMARY_RUN_CLASSES 17
+
+/**
+ * Free-space summary, in the first A1FS_BLOCK_SIZE bytes of the image (which
+ * are not used otherwise). Written on unmount and trusted on the next mount if
+ * the superblock has A1FS_STATE_CLEAN, so that mounting does not have to scan
+ * the bitmaps.
+ */
+typedef struct a1fs_summary {
+    /** Must match A1FS_SUMMARY_MAGIC. */
+    uint64_t magic;
+    /** Number of used blocks and inodes; must match the superblock. */
+    uint32_t used_blocks;
+    uint32_t used_inodes;
+    /** Number of data blocks in each region; the last one may be shorter. */
+    uint32_t region_blocks;
+    /** Number of maximal free runs of each length class. */
+    uint32_t runs[A1FS_SUMMARY_RUN_CLASSES];
+    /** Number of free blocks in each region. */
+    uint32_t region_free[A1FS_SUMMARY_REGIONS];
+} a1fs_summary;
+
+static_assert(sizeof(a1fs_summary) <= A1FS_BLOCK_SIZE, "summary is too large");
+
+
 /** Extent - a contiguous range of blocks. */
 typedef struct a1fs_extent {
     /** Starting block of the extent. */
@@ -61,6 +169,127 @@ typedef struct a1fs_extent {
 
 } a1fs_extent;
 
+
+/*
+ * Extent tree (same idea as in ext4).
+ *
+ * File blocks are mapped by a B+tree of extents. The root node lives in the
+ * inode; the other nodes are whole blocks in the data region. Every node starts
+ * with an a1fs_ext_header followed by an array of entries sorted by logical
+ * block number. Leaf nodes (depth 0) hold extents, index nodes hold pointers to
+ * the nodes one level down, each covering the logical blocks from its lblk up
+ * to the lblk of the next entry.
+ */
+
+/** Magic value stored in every extent tree node header. */
+#define A1FS_EXT_MAGIC 0xE1A1
+
+/** Extent tree node header. */
+typedef struct a1fs_ext_header {
+    /** Must match A1FS_EXT_MAGIC. */
+    uint16_t magic;
+    /** Number of valid entries in the node. */
+    uint16_t entries;
+    /** Capacity of the node. */
+    uint16_t max;
+    /** Distance from the leaves; 0 in leaf nodes. */
+    uint16_t depth;
+} a1fs_ext_header;
+
+/**
+ * Extent tree leaf entry: logical blocks [lblk, lblk + ext.count).
+ *
+ * A compressed extent holds a single cluster (see A1FS_CLUSTER_BLOCKS): its
+ * ext.count logical blocks are stored compressed in the data blocks starting
+ * at ext.start, as many as are needed for the compressed length in zinfo.
+ */
+typedef struct a1fs_ext_leaf {
+    /** First logical block mapped by the extent. */
+    uint32_t lblk;
+    /** Data blocks the logical blocks are mapped to. */
+    a1fs_extent ext;
+    /** Compression algorithm and compressed length; 0 if not compressed. */
+    uint32_t zinfo;
+} a1fs_ext_leaf;
+
+/** Extent tree index entry. */
+typedef struct a1fs_ext_index {
+    /** First logical block covered by the child node. */
+    uint32_t lblk;
+    /** Data block that holds the child node. */
+    a1fs_blk_t child;
+    uint32_t unused[2];
+} a1fs_ext_index;
+
+/** Extent tree node entry; the kind is determined by the node depth. */
+typedef union a1fs_ext_entry {
+    a1fs_ext_leaf leaf;
+    a1fs_ext_index index;
+} a1fs_ext_entry;
+
+/** Number of entries in the extent tree root stored in the inode. */
+#define A1FS_EXT_ROOT_MAX 8
+/** Number of entries in an extent tree node block of block_size bytes. */
+#define A1FS_EXT_NODE_MAX(block_size) (((block_size) - sizeof(a1fs_ext_header)) / sizeof(a1fs_ext_entry))
+
+static_assert(A1FS_EXT_NODE_MAX(A1FS_BLOCK_SIZE_MAX) <= UINT16_MAX, "extent tree node is too large");
+
+static_assert(sizeof(a1fs_ext_entry) == 16, "invalid extent tree entry size");
+
+
+/*
+ * Compression.
+ *
+ * The data of a file with the A1FS_INODE_COMPRESS flag is split into clusters
+ * of A1FS_CLUSTER_BLOCKS logical blocks (the last one can be shorter). Each
+ * cluster is mapped by exactly one extent, which is compressed if that saves at
+ * least one block and stored as is otherwise.
+ */
+
+/** Number of logical blocks in a compression cluster. */
+#define A1FS_CLUSTER_BLOCKS 4
+
+/** Compression algorithms. */
+#define A1FS_COMPR_NONE 0
+#define A1FS_COMPR_LZ4  1   /* LZ4 block format */
+
+/** Build the zinfo field of a compressed extent. */
+#define A1FS_ZINFO(alg, len) (((uint32_t)(alg) << 24) | (uint32_t)(len))
+/** Get the algorithm from zinfo. */
+#define A1FS_ZINFO_ALG(zinfo) ((zinfo) >> 24)
+/** Get the compressed length in bytes from zinfo. */
+#define A1FS_ZINFO_LEN(zinfo) ((zinfo) & 0xFFFFFF)
+
+static_assert(A1FS_CLUSTER_BLOCKS * A1FS_BLOCK_SIZE_MAX <= 0xFFFFFF, "cluster is too large for zinfo");
+
+/** Inode flags. */
+#define A1FS_INODE_COMPRESS 0x1 /* files: data is compressed; directories: new files inherit it */
+/* No entry refers to the inode any more; its blocks are being freed in the
+ * background, after which the inode is freed too. Orphans are linked through
+ * orphan_next from the superblock's orphan_head. */
+#define A1FS_INODE_ORPHAN 0x2
+/* Directories: slot_hint and slot_map are up to date (see below). */
+#define A1FS_INODE_SLOTS 0x4
+
+
+/*
+ * Free entry summary.
+ *
+ * A directory with the A1FS_INODE_SLOTS flag records which of its blocks can
+ * have a free entry, so that adding an entry goes straight to such a block
+ * instead of scanning the directory from the start. Bit i of slot_map covers
+ * the logical blocks [i << slot_shift, (i + 1) << slot_shift) and is set if one
+ * of them can have a free entry; slot_hint is the first logical block that
+ * can. Every block with a free entry is at or after slot_hint and has its bit
+ * set, but a set bit does not mean there is one. Without the flag, the summary
+ * is rebuilt from the entries when the next entry is added.
+ */
+
+/** Number of words and bits in slot_map. */
+#define A1FS_SLOT_WORDS 6
+#define A1FS_SLOT_BITS (A1FS_SLOT_WORDS * 64)
+
+
 /** a1fs inode. */
 typedef struct a1fs_inode {
     /** File mode. */
@@ -90,35 +319,42 @@ typedef struct a1fs_inode {
 
 
     //CUSTOM. Altogether, each inode is 256 bytes.
-    struct a1fs_extent extent[12];  //direct extents
-    unsigned int extent_count;  //EXTENT COUNT; used to check if below cap of 512 extents
-    unsigned int indirect;  //block index of indirect block. 0 = no indirect block
-    unsigned int block_count;   //how many data block allocated. Includes indirect block.
+    struct a1fs_ext_header ext_hdr; //extent tree root header
+    union a1fs_ext_entry ext_root[A1FS_EXT_ROOT_MAX];   //extent tree root entries; follow ext_hdr
+    unsigned int extent_count;  //number of extents (leaf entries) in the tree
+    unsigned int ext_last_leaf; //tree block holding the last extent. 0 = the root is that leaf
+    unsigned int block_count;   //how many data block allocated. Includes extent tree blocks.
     unsigned int num;   //inode index. 0 for root.
     unsigned int parent_num;    //parent inode index
     unsigned int empty; //Basically an entry count for directories. 0 represents empty, >0 not empty
-    char padding[100];
+    unsigned int flags; //A1FS_INODE_* flags
+    unsigned int orphan_next;   //next inode on the orphan list; 0 = last
+    unsigned int slot_hint;     //directories: first logical block that can have a free entry
+    unsigned int slot_shift;    //directories: each slot_map bit covers 2^slot_shift blocks
+    uint64_t slot_map[A1FS_SLOT_WORDS]; //directories: blocks that can have a free entry
 } a1fs_inode;
 
+static_assert(sizeof(a1fs_inode) == 256, "invalid inode size");
 
-/* Our structs  */
 
-// STRUCTURE for indirect extent block
-typedef struct a1fs_indirect_ext {
-    struct a1fs_extent extent[500]; //500 extents in this block
-    char padding [96];  //full 4096 bytes
-} a1fs_indirect_ext;
+/* Our structs  */
 
 // BITMAP STRUCTURES.
-// CHAR ARRAYS of 0s and 1s (4096 bytes)
+// CHAR ARRAYS of 0s and 1s, one block each: only the first block size bytes
+// of map are on disk, so a bitmap tracks at most block size items
 typedef struct a1fs_ibitmap {
-    char map[A1FS_BLOCK_SIZE];
+    char map[A1FS_BLOCK_SIZE_MAX];
 } a1fs_ibitmap;
 
+// The block bitmap holds the reference count of each data block: 0 is free,
+// more than 1 means that the block is shared by cloned files (see reflink.h)
 typedef struct a1fs_bbitmap {
-    char map[A1FS_BLOCK_SIZE];
+    unsigned char map[A1FS_BLOCK_SIZE_MAX];
 } a1fs_bbitmap;
 
+/** Maximum number of extents that can share a data block. */
+#define A1FS_BLOCK_REFS_MAX 255
+
 
 // A single block must fit an integral number of inodes
 static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
@@ -140,3 +376,167 @@ typedef struct a1fs_dentry {
 } a1fs_dentry;
 
 static_assert(sizeof(a1fs_dentry) == 256, "invalid dentry size");
+
+
+/** Magic value of a snapshot header. */
+#define A1FS_SNAP_MAGIC 0xC5C369A15A4B5A4Bul
+
+/** Maximum snapshot name length. Includes the null terminator. */
+#define A1FS_SNAP_NAME_MAX 64
+
+/** Maximum number of snapshots. */
+#define A1FS_SNAP_MAX 16
+
+/**
+ * Snapshot header.
+ *
+ * A snapshot is a run of data blocks: this header, a copy of the inode bitmap
+ * and a copy of the inode table. The copied inodes have extent trees of their
+ * own; files share the data blocks with the live file system and directories
+ * have copies of theirs. See snapshot.h.
+ */
+typedef struct a1fs_snapshot {
+    /** Must match A1FS_SNAP_MAGIC. */
+    uint64_t magic;
+    char name[A1FS_SNAP_NAME_MAX];
+    /** Creation time. */
+    struct timespec ctime;
+    /** Data block of the next older snapshot; 0 if this is the oldest. */
+    a1fs_blk_t next;
+    /** Number of blocks in the run, including this one. */
+    a1fs_blk_t blocks;
+    /** Number of inodes in use when the snapshot was taken. */
+    uint32_t used_inode_count;
+} a1fs_snapshot;
+
+
+/** Result of A1FS_IOC_DEFRAG. */
+struct a1fs_defrag_info {
+    /** Number of extents the file had before and after defragmentation. */
+    uint32_t extents_before;
+    uint32_t extents_after;
+    /** A1FS_DEFRAG_* flags. */
+    uint32_t flags;
+};
+
+/** The file shares data blocks with a clone or a snapshot and was left as it is. */
+#define A1FS_DEFRAG_SHARED 0x1
+
+/** Move a file into a single contiguous extent. See defrag.h. */
+#define A1FS_IOC_DEFRAG _IOR('A', 1, struct a1fs_defrag_info)
+
+/** Result of A1FS_IOC_STATS. */
+struct a1fs_stats {
+    /** Logical blocks stored in compressed clusters and the data blocks they use. */
+    uint64_t compr_logical;
+    uint64_t compr_physical;
+    /** Compressed cluster reads served from and missed by the cluster cache. */
+    uint64_t zcache_hits;
+    uint64_t zcache_misses;
+
+    /** A1FS_MAP_* options the image is mapped with. */
+    uint64_t map_flags;
+    /** Bytes of the image mapping backed by huge pages and locked in memory. */
+    uint64_t huge_bytes;
+    uint64_t locked_bytes;
+    /** Page faults taken by the file system process since it started. */
+    uint64_t minor_faults;
+    uint64_t major_faults;
+    /** Data TLB read misses since mount; A1FS_STAT_NONE if not available. */
+    uint64_t dtlb_misses;
+    /** Heap allocations made by the file system callbacks since mount, other than these. */
+    uint64_t heap_allocs;
+};
+
+/** Value of a statistic that is not available. */
+#define A1FS_STAT_NONE UINT64_MAX
+
+/** Image mapping options (the hugepage, populate and mlock mount options). */
+#define A1FS_MAP_HUGEPAGE 0x1
+#define A1FS_MAP_POPULATE 0x2
+#define A1FS_MAP_MLOCK    0x4
+
+/** Get file system statistics; can be issued on any file. */
+#define A1FS_IOC_STATS _IOR('A', 2, struct a1fs_stats)
+
+/** Argument of A1FS_IOC_CLONE. */
+struct a1fs_clone_args {
+    /** Path of the source file, relative to the root of the file system. */
+    char src[A1FS_PATH_MAX];
+};
+
+/** Make a file share the data of another one. See reflink.h. */
+#define A1FS_IOC_CLONE _IOW('A', 3, struct a1fs_clone_args)
+
+/** Argument of A1FS_IOC_SNAP_CREATE and A1FS_IOC_SNAP_DELETE. */
+struct a1fs_snap_name {
+    char name[A1FS_SNAP_NAME_MAX];
+};
+
+/** Result of A1FS_IOC_SNAP_LIST. */
+struct a1fs_snap_list {
+    uint32_t count;
+    struct {
+        char name[A1FS_SNAP_NAME_MAX];
+        int64_t ctime;
+        /** Number of inodes in use when the snapshot was taken. */
+        uint32_t inodes;
+    } snaps[A1FS_SNAP_MAX];
+};
+
+/** Take, delete and list snapshots; can be issued on any file. See snapshot.h. */
+#define A1FS_IOC_SNAP_CREATE _IOW('A', 4, struct a1fs_snap_name)
+#define A1FS_IOC_SNAP_DELETE _IOW('A', 5, struct a1fs_snap_name)
+#define A1FS_IOC_SNAP_LIST   _IOR('A', 6, struct a1fs_snap_list)
+
+/** Maximum number of entries and bytes of inline file data in one bulk request. */
+#define A1FS_BULK_MAX 32
+#define A1FS_BULK_DATA 6144
+
+/** One file of a bulk create or bulk stat request. */
+struct a1fs_bulk_entry {
+    /** Name of the file in the directory the ioctl is issued on. */
+    char name[A1FS_NAME_MAX];
+    /** Create: permission bits of the new file. Stat: receives the mode. */
+    uint32_t mode;
+    /** Create: initial contents of the file, as a range of a1fs_bulk.data. */
+    uint32_t data_off;
+    uint32_t data_len;
+    /** Receives 0 on success or -errno for this entry; a file whose data
+     *  cannot be written is not created. */
+    int32_t result;
+    /** Stat: receive the size, link count and size in 512-byte units. */
+    uint64_t size;
+    uint32_t links;
+    uint32_t blocks;
+    /** Create: modification time to set, or 0 for the current time.
+     *  Stat: receives the modification time. */
+    struct timespec mtime;
+};
+
+/** Argument of A1FS_IOC_BULK_CREATE and A1FS_IOC_BULK_STAT. */
+struct a1fs_bulk {
+    uint32_t count;
+    uint32_t pad;
+    struct a1fs_bulk_entry entries[A1FS_BULK_MAX];
+    char data[A1FS_BULK_DATA];
+};
+
+/** Create regular files in a directory in one pass over its entries. */
+#define A1FS_IOC_BULK_CREATE _IOWR('A', 7, struct a1fs_bulk)
+/** Get the attributes of files in a directory in one pass over its entries. */
+#define A1FS_IOC_BULK_STAT _IOWR('A', 8, struct a1fs_bulk)
+
+// The size of an ioctl argument is limited to 14 bits
+static_assert(sizeof(struct a1fs_bulk) < (1 << 14), "bulk request is too large");
+
+/** Argument and result of A1FS_IOC_TRIM, like struct fstrim_range. */
+struct a1fs_trim {
+    /** Free runs shorter than this many bytes are left alone. */
+    uint64_t minlen;
+    /** Receives the number of bytes discarded. */
+    uint64_t trimmed;
+};
+
+/** Punch holes in the image files where the free blocks are; see discard.h. */
+#define A1FS_IOC_TRIM _IOWR('A', 9, struct a1fs_trim)
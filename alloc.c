@@ -0,0 +1,216 @@
+/**
+ * CSC369 Assignment 1 - Block and inode allocator implementation.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "discard.h"
+
+
+unsigned int alloc_block_limit(fs_ctx *fs)
+{
+    return fs->sb->block_count < fs->block_size ? fs->sb->block_count : fs->block_size;
+}
+
+unsigned int alloc_inode_limit(fs_ctx *fs)
+{
+    return fs->sb->inode_count < fs->block_size ? fs->sb->inode_count : fs->block_size;
+}
+
+/** Record in the free-space summary that block b was taken (-1) or freed (+1). */
+static void region_update(fs_ctx *fs, a1fs_blk_t b, int delta)
+{
+    __atomic_fetch_add(&fs->summary.region_free[b / fs->summary.region_blocks], delta, __ATOMIC_RELAXED);
+}
+
+/** Take block b if it is free; false if it is not (any more). */
+static bool claim_block(fs_ctx *fs, a1fs_blk_t b)
+{
+    unsigned char free = 0;
+    if (!__atomic_compare_exchange_n(&fs->bbitmap->map[b], &free, 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return false;
+    }
+    region_update(fs, b, -1);
+    return true;
+}
+
+/** Give back count blocks from b on that were claimed but cannot be used. */
+static void unclaim_blocks(fs_ctx *fs, a1fs_blk_t b, a1fs_blk_t count)
+{
+    for (a1fs_blk_t i = 0; i < count; i++) {
+        __atomic_store_n(&fs->bbitmap->map[b + i], 0, __ATOMIC_RELEASE);
+        region_update(fs, b + i, +1);
+    }
+}
+
+/** If the summary region of block b has no free blocks, get its last block. */
+static bool region_full(fs_ctx *fs, unsigned int b, unsigned int *last)
+{
+    unsigned int rb = fs->summary.region_blocks;
+    if (fs->summary.region_free[b / rb] != 0) return false;
+    *last = (b / rb + 1) * rb - 1;
+    return true;
+}
+
+/** Find the first free block in [from, to); returns -1 if there is none. */
+static long find_free(fs_ctx *fs, unsigned int from, unsigned int to)
+{
+    for (unsigned int b = from; b < to; b++) {
+        if (region_full(fs, b, &b)) continue;
+        if (__atomic_load_n(&fs->bbitmap->map[b], __ATOMIC_RELAXED) == 0) return b;
+    }
+    return -1;
+}
+
+long alloc_blocks(fs_ctx *fs, a1fs_blk_t goal, a1fs_blk_t count, a1fs_blk_t *got)
+{
+    unsigned int limit = alloc_block_limit(fs);
+    if (goal >= limit) goal = 0;
+    discard_flush(fs);// the blocks taken below must not be discarded later
+
+    //block 0 always belongs to the root directory; a block found free can be
+    //taken by another thread before it is claimed, then the search goes on
+    long b;
+    do {
+        b = find_free(fs, goal, limit);
+        if (b < 0) b = find_free(fs, 1, goal);
+        if (b < 0) return -1;
+    } while (!claim_block(fs, b));
+
+    a1fs_blk_t n = 1;
+    while (n < count && b + n < limit && claim_block(fs, b + n)) n++;
+    fs_data_changed(fs, b, n);
+    __atomic_fetch_add(&fs->sb->used_block_count, n, __ATOMIC_RELAXED);
+    *got = n;
+    return b;
+}
+
+/**
+ * Find the first run of count free blocks in [from, to); returns -1 if there
+ * is none. If flat, the run must not cross a stripe chunk boundary.
+ */
+static long find_free_run(fs_ctx *fs, unsigned int from, unsigned int to, a1fs_blk_t count, bool flat)
+{
+    unsigned int run = 0;
+    for (unsigned int b = from; b < to; b++) {
+        if (region_full(fs, b, &b)) {
+            run = 0;
+            continue;
+        }
+        if (flat && fs->stripe_count > 1 && (b & ((1u << fs->stripe_shift) - 1)) == 0) run = 0;
+        run = __atomic_load_n(&fs->bbitmap->map[b], __ATOMIC_RELAXED) ? 0 : run + 1;
+        if (run == count) return b + 1 - count;
+    }
+    return -1;
+}
+
+static long take_run(fs_ctx *fs, a1fs_blk_t goal, a1fs_blk_t count, bool flat)
+{
+    unsigned int limit = alloc_block_limit(fs);
+    if (goal == 0 || goal >= limit) goal = 1;
+    discard_flush(fs);
+
+    for (;;) {
+        long b = find_free_run(fs, goal, limit, count, flat);
+        if (b < 0) b = find_free_run(fs, 1, goal + count - 1 < limit ? goal + count - 1 : limit, count, flat);
+        if (b < 0) return -1;
+
+        //if another thread takes a block of the run first, give the rest back
+        //and look again; the block taken is not free any more
+        a1fs_blk_t n = 0;
+        while (n < count && claim_block(fs, b + n)) n++;
+        if (n < count) {
+            unclaim_blocks(fs, b, n);
+            continue;
+        }
+        fs_data_changed(fs, b, count);
+        __atomic_fetch_add(&fs->sb->used_block_count, count, __ATOMIC_RELAXED);
+        return b;
+    }
+}
+
+long alloc_run(fs_ctx *fs, a1fs_blk_t goal, a1fs_blk_t count)
+{
+    return take_run(fs, goal, count, false);
+}
+
+long alloc_flat_run(fs_ctx *fs, a1fs_blk_t goal, a1fs_blk_t count)
+{
+    return take_run(fs, goal, count, true);
+}
+
+void free_blocks(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count)
+{
+    //blocks that are still shared end runs of freed blocks
+    a1fs_blk_t run = 0;
+    unsigned int freed = 0;
+    for (a1fs_blk_t b = start; b < start + count; b++) {
+        //a block that is free already is left alone; decrementing its
+        //reference count would wrap it around and leak the block for good
+        unsigned char refs = __atomic_load_n(&fs->bbitmap->map[b], __ATOMIC_RELAXED);
+        do {
+            if (refs == 0) break;
+        } while (!__atomic_compare_exchange_n(&fs->bbitmap->map[b], &refs, refs - 1, true,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        if (refs == 0) fprintf(stderr, "free_blocks: block %u is already free\n", b);
+
+        if (refs == 1) {
+            freed++;
+            region_update(fs, b, +1);
+            run++;
+        } else if (run > 0) {
+            discard_freed(fs, b - run, run);
+            run = 0;
+        }
+    }
+    if (run > 0) discard_freed(fs, start + count - run, run);
+    __atomic_fetch_sub(&fs->sb->used_block_count, freed, __ATOMIC_RELAXED);
+}
+
+bool ref_blocks(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count)
+{
+    for (a1fs_blk_t b = start; b < start + count; b++) {
+        unsigned char refs = __atomic_load_n(&fs->bbitmap->map[b], __ATOMIC_RELAXED);
+        do {
+            if (refs == A1FS_BLOCK_REFS_MAX) {
+                //undo the references already added
+                for (a1fs_blk_t u = start; u < b; u++) {
+                    __atomic_sub_fetch(&fs->bbitmap->map[u], 1, __ATOMIC_RELAXED);
+                }
+                return false;
+            }
+        } while (!__atomic_compare_exchange_n(&fs->bbitmap->map[b], &refs, refs + 1, true,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+    return true;
+}
+
+long alloc_inode(fs_ctx *fs)
+{
+    unsigned int limit = alloc_inode_limit(fs);
+    //inode 0 is the root directory; the lowest free inode keeps the inode
+    //table blocks that have to be prepared (see fs_ctx_itable_prepare()) few
+    for (unsigned int i = 1; i < limit; i++) {
+        char free = 0;
+        if (__atomic_load_n(&fs->ibitmap->map[i], __ATOMIC_RELAXED) != 0) continue;
+        //preparing the inode table block twice is harmless if another thread wins
+        fs_ctx_itable_prepare(fs, i);
+        if (__atomic_compare_exchange_n(&fs->ibitmap->map[i], &free, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            __atomic_fetch_add(&fs->sb->used_inode_count, 1, __ATOMIC_RELAXED);
+            return i;
+        }
+    }
+    return -1;
+}
+
+void free_inode(fs_ctx *fs, a1fs_ino_t ino)
+{
+    __atomic_store_n(&fs->ibitmap->map[ino], 0, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&fs->sb->used_inode_count, 1, __ATOMIC_RELAXED);
+}
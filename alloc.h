@@ -0,0 +1,89 @@
+/**
+ * CSC369 Assignment 1 - Block and inode allocator header file.
+ *
+ * Blocks and inodes are claimed with atomic compare-and-swap on their bitmap
+ * entries, and the used counts in the superblock are updated atomically, so
+ * the allocator does not need a lock of its own. Discarding (see discard.h)
+ * still relies on the caller holding fs->lock.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Number of data blocks that can be allocated (tracked by the bitmap). */
+unsigned int alloc_block_limit(fs_ctx *fs);
+
+/** Number of inodes that can be allocated (tracked by the bitmap). */
+unsigned int alloc_inode_limit(fs_ctx *fs);
+
+/**
+ * Allocate a run of free data blocks.
+ *
+ * Looks for the first free block at or after goal (wrapping around to the
+ * start of the data region) and extends the run while the following blocks
+ * are free, up to count blocks. Updates the bitmap and the used block count.
+ *
+ * @param fs     file system context.
+ * @param goal   preferred first block, e.g. the one after the file's last.
+ * @param count  maximum number of blocks to allocate.
+ * @param got    receives the number of blocks allocated.
+ * @return       first block of the run; -1 if there are no free blocks.
+ */
+long alloc_blocks(fs_ctx *fs, a1fs_blk_t goal, a1fs_blk_t count, a1fs_blk_t *got);
+
+/**
+ * Allocate a run of exactly count contiguous free data blocks.
+ *
+ * Takes the first such run at or after goal, wrapping around to the start of
+ * the data region. Updates the bitmap and the used block count.
+ *
+ * @return  first block of the run; -1 if there is no run that long.
+ */
+long alloc_run(fs_ctx *fs, a1fs_blk_t goal, a1fs_blk_t count);
+
+/**
+ * Allocate a run like alloc_run() that can also be accessed as one array in
+ * memory, i.e. that does not cross a stripe chunk boundary (see
+ * fs_data_run()). There is no such run longer than a chunk.
+ */
+long alloc_flat_run(fs_ctx *fs, a1fs_blk_t goal, a1fs_blk_t count);
+
+/**
+ * Drop a reference to count data blocks starting at start.
+ *
+ * A block is freed when its last reference is dropped. Blocks that are free
+ * already are reported on stderr and left alone.
+ */
+void free_blocks(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count);
+
+/** Get the reference count of a data block; 0 if it is free. */
+static inline unsigned int block_refs(fs_ctx *fs, a1fs_blk_t b)
+{
+    return fs->bbitmap->map[b];
+}
+
+/**
+ * Add a reference to count in-use data blocks starting at start.
+ *
+ * @return  true on success; false if a block already has
+ *          A1FS_BLOCK_REFS_MAX references (nothing is changed then).
+ */
+bool ref_blocks(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count);
+
+/**
+ * Allocate a free inode.
+ *
+ * The inode table block that holds the inode is initialized if needed; the
+ * inode itself is not cleared.
+ *
+ * @return  inode number; -1 if there are no free inodes.
+ */
+long alloc_inode(fs_ctx *fs);
+
+/** Free an inode. */
+void free_inode(fs_ctx *fs, a1fs_ino_t ino);
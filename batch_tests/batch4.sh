@@ -0,0 +1,26 @@
+mkdir /tmp/test/3
+mkdir /tmp/test/3/a
+mkdir /tmp/test/3/b
+cp example-text /tmp/test/3/a/file0
+cp example-text /tmp/test/3/a/file1
+touch /tmp/test/3/a/file2
+touch /tmp/test/3/b/file3
+mv /tmp/test/3/a/file0 /tmp/test/3/a/renamed0
+mv /tmp/test/3/a/file1 /tmp/test/3/b/file1
+mv /tmp/test/3/a/renamed0 /tmp/test/3/b/file3
+mv -n /tmp/test/3/a/file2 /tmp/test/3/b/file1
+mkdir /tmp/test/3/a/sub
+mkdir /tmp/test/3/a/sub/subsub
+mv /tmp/test/3/a/sub /tmp/test/3/a/sub/subsub/loop
+mv /tmp/test/3/a/sub /tmp/test/3/b/sub
+mkdir /tmp/test/3/b/empty
+mv -T /tmp/test/3/b/sub/subsub /tmp/test/3/b/empty
+mv /tmp/test/3/b/empty /tmp/test/3/a
+mv /tmp/test/3/a/empty /tmp/test/3/renamed
+ls -la /tmp/test/3/a
+ls -la /tmp/test/3/b
+ls -la /tmp/test/3/b/sub
+ls -la /tmp/test/3/renamed
+stat -c "%n %h" /tmp/test/3 /tmp/test/3/a /tmp/test/3/b /tmp/test/3/b/sub /tmp/test/3/renamed
+cmp example-text /tmp/test/3/b/file1
+cmp example-text /tmp/test/3/b/file3
@@ -0,0 +1,12 @@
+mkdir /tmp/test/4
+cp example-text /tmp/test/4/original
+../clone.a1fs /tmp/test/4/original /tmp/test/4/clone
+echo "changed after the clone" >> /tmp/test/4/clone
+cmp example-text /tmp/test/4/original
+../snapshot.a1fs -c before /tmp/test
+rm /tmp/test/4/original
+echo "changed after the snapshot" >> /tmp/test/4/clone
+../snapshot.a1fs /tmp/test
+ls -la /tmp/test/4
+../snapshot.a1fs -d before /tmp/test
+stat -c "%n %s %h" /tmp/test/4/clone
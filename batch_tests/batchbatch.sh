@@ -6,3 +6,9 @@ rm -r /tmp/test/2
 ./batch2.sh
 ls /tmp/test/1
 ls /tmp/test/2
+./batch4.sh
+./batch5.sh
+rm -r /tmp/test/3
+rm -r /tmp/test/4
+./batch4.sh
+ls /tmp/test/3
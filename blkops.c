@@ -0,0 +1,77 @@
+/**
+ * CSC369 Assignment 1 - Block size specific operations implementation.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "blkops.h"
+
+
+/**
+ * Define the operations for block size BS. The compiler sees constant loop
+ * bounds and can unroll the scans.
+ */
+#define DEFINE_BLKOPS(BS)                                                        \
+static a1fs_dentry *dentry_find_##BS(a1fs_dentry *block, const char *name)       \
+{                                                                                \
+    for (unsigned int i = 0; i < (BS) / sizeof(a1fs_dentry); i++) {              \
+        if (block[i].name[0] != '\0' && !strcmp(name, block[i].name)) {          \
+            return &block[i];                                                    \
+        }                                                                        \
+    }                                                                            \
+    return NULL;                                                                 \
+}                                                                                \
+                                                                                 \
+static a1fs_dentry *dentry_find_ino_##BS(a1fs_dentry *block, a1fs_ino_t ino)     \
+{                                                                                \
+    for (unsigned int i = 0; i < (BS) / sizeof(a1fs_dentry); i++) {              \
+        if (block[i].name[0] != '\0' && block[i].ino == ino) return &block[i];   \
+    }                                                                            \
+    return NULL;                                                                 \
+}                                                                                \
+                                                                                 \
+static a1fs_dentry *dentry_free_##BS(a1fs_dentry *block)                         \
+{                                                                                \
+    for (unsigned int i = 0; i < (BS) / sizeof(a1fs_dentry); i++) {              \
+        if (block[i].name[0] == '\0') return &block[i];                          \
+    }                                                                            \
+    return NULL;                                                                 \
+}                                                                                \
+                                                                                 \
+static bool itable_block_used_##BS(const a1fs_ibitmap *ibitmap, unsigned int itable_blk) \
+{                                                                                \
+    /* the bitmap only tracks BS inodes */                                       \
+    const unsigned int per_block = (BS) / sizeof(a1fs_inode);                    \
+    if (itable_blk >= (BS) / per_block) return false;                            \
+    const char *map = ibitmap->map + itable_blk * per_block;                     \
+    char used = 0;                                                               \
+    for (unsigned int i = 0; i < per_block; i++) used |= map[i];                 \
+    return used != 0;                                                            \
+}                                                                                \
+                                                                                 \
+static const a1fs_blkops blkops_##BS = {                                         \
+    .block_size        = (BS),                                                   \
+    .dentry_find       = dentry_find_##BS,                                       \
+    .dentry_find_ino   = dentry_find_ino_##BS,                                   \
+    .dentry_free       = dentry_free_##BS,                                       \
+    .itable_block_used = itable_block_used_##BS,                                 \
+};
+
+DEFINE_BLKOPS(4096)
+DEFINE_BLKOPS(16384)
+DEFINE_BLKOPS(65536)
+
+static_assert(A1FS_BLOCK_SIZE == 4096 && A1FS_BLOCK_SIZE_MAX == 65536,
+              "update the list of supported block sizes");
+
+
+const a1fs_blkops *blkops_get(unsigned int block_size)
+{
+    switch (block_size) {
+        case 4096:  return &blkops_4096;
+        case 16384: return &blkops_16384;
+        case 65536: return &blkops_65536;
+        default:    return NULL;
+    }
+}
@@ -0,0 +1,38 @@
+/**
+ * CSC369 Assignment 1 - Block size specific operations header file.
+ *
+ * The loops that scan the contents of a whole block are compiled once for every
+ * supported block size, so that the number of entries in a block is a constant
+ * rather than a runtime division. fs_ctx_init() picks the set that matches the
+ * block size of the image.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "a1fs.h"
+
+
+/** Operations specialized for one block size. */
+typedef struct a1fs_blkops {
+    /** Block size the operations were compiled for. */
+    unsigned int block_size;
+
+    /** Find the in-use entry named name in a directory block; NULL if none. */
+    a1fs_dentry *(*dentry_find)(a1fs_dentry *block, const char *name);
+    /** Find the in-use entry that refers to inode ino in a directory block; NULL if none. */
+    a1fs_dentry *(*dentry_find_ino)(a1fs_dentry *block, a1fs_ino_t ino);
+    /** Find a free entry in a directory block; NULL if the block is full. */
+    a1fs_dentry *(*dentry_free)(a1fs_dentry *block);
+    /** Check if any inode in inode table block itable_blk is marked in use. */
+    bool (*itable_block_used)(const a1fs_ibitmap *ibitmap, unsigned int itable_blk);
+} a1fs_blkops;
+
+/**
+ * Get the operations for a block size.
+ *
+ * @param block_size  block size in bytes.
+ * @return            operations; NULL if the block size is not supported.
+ */
+const a1fs_blkops *blkops_get(unsigned int block_size);
@@ -0,0 +1,163 @@
+/**
+ * CSC369 Assignment 1 - a1fs file cloner.
+ *
+ * Makes the destination file share the data blocks of the source file on a
+ * mounted a1fs via the A1FS_IOC_CLONE ioctl, like "cp --reflink". Both files
+ * must be on the same a1fs.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+
+
+/** Command line options. */
+typedef struct clone_opts {
+    const char *src;
+    const char *dst;
+
+    /** Print help and exit. */
+    bool help;
+
+} clone_opts;
+
+static const char *help_str = "\
+Usage: %s src dst\n\
+\n\
+Make dst a copy of src that shares its data blocks instead of copying them.\n\
+dst is created if it does not exist. Both files must be on the same mounted\n\
+a1fs.\n\
+\n\
+Options:\n\
+    -h      print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+    fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], clone_opts *opts)
+{
+    int o;
+    while ((o = getopt(argc, argv, "h")) != -1) {
+        switch (o) {
+            case 'h': opts->help = true; return true;// skip other arguments
+
+            case '?': return false;
+            default : assert(false);
+        }
+    }
+
+    if (argc - optind != 2) {
+        fprintf(stderr, "Expected a source and a destination path\n");
+        return false;
+    }
+    opts->src = argv[optind];
+    opts->dst = argv[optind + 1];
+    return true;
+}
+
+
+/**
+ * Get the path of a file relative to the root of the file system it is on.
+ *
+ * The root is the topmost directory above the file on the same device.
+ */
+static bool fs_relative_path(const char *path, char *rel)
+{
+    char full[PATH_MAX];
+    struct stat st, dir;
+    if (realpath(path, full) == NULL || stat(full, &st) < 0) return false;
+
+    // the shortest prefix of the path on the same device is the mount point
+    size_t len = strlen(full);
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && full[i] != '/') continue;
+        char c = full[i];
+        full[i] = '\0';
+        bool root = stat(i == 0 ? "/" : full, &dir) == 0 && dir.st_dev == st.st_dev;
+        full[i] = c;
+        if (root) {
+            snprintf(rel, A1FS_PATH_MAX, "%s", i < len ? full + i : "/");
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Get the device of the file system a file is on, or would be created on.
+ *
+ * If the file does not exist, the device is that of its parent directory.
+ */
+static bool path_dev(const char *path, dev_t *dev)
+{
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        char dir[PATH_MAX];
+        if (errno != ENOENT) return false;
+        snprintf(dir, sizeof(dir), "%s", path);
+        if (stat(dirname(dir), &st) < 0) return false;
+    }
+    *dev = st.st_dev;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    clone_opts opts = {0};// defaults are all 0
+    if (!parse_args(argc, argv, &opts)) {
+        // Invalid arguments, print help to stderr
+        print_help(stderr, argv[0]);
+        return 1;
+    }
+    if (opts.help) {
+        // Help requested, print it to stdout
+        print_help(stdout, argv[0]);
+        return 0;
+    }
+
+    struct a1fs_clone_args args;
+    if (!fs_relative_path(opts.src, args.src)) {
+        perror(opts.src);
+        return 1;
+    }
+    // the ioctl looks the source path up on the destination's file system
+    dev_t src_dev, dst_dev;
+    if (!path_dev(opts.src, &src_dev)) {
+        perror(opts.src);
+        return 1;
+    }
+    if (!path_dev(opts.dst, &dst_dev)) {
+        perror(opts.dst);
+        return 1;
+    }
+    if (src_dev != dst_dev) {
+        fprintf(stderr, "%s: %s\n", opts.dst, strerror(EXDEV));
+        return 1;
+    }
+    int fd = open(opts.dst, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(opts.dst);
+        return 1;
+    }
+    int ret = 0;
+    if (ioctl(fd, A1FS_IOC_CLONE, &args) < 0) {
+        fprintf(stderr, "%s: %s\n", opts.dst, strerror(errno));
+        ret = 1;
+    }
+    close(fd);
+    return ret;
+}
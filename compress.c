@@ -0,0 +1,351 @@
+/**
+ * CSC369 Assignment 1 - Compressed file data implementation.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "compress.h"
+#include "extent.h"
+#include "lz4.h"
+
+
+/** Number of decompressed clusters kept in the cache. */
+#define ZCACHE_SLOTS 8
+
+typedef struct zslot {
+    bool valid;
+    a1fs_ino_t ino;
+    uint32_t cluster;
+    /** Value of the cache clock at the last use; the oldest slot is reused. */
+    uint64_t used;
+    unsigned char *data;
+} zslot;
+
+/** Cluster cache and buffers; allocated on first use. */
+struct zcache {
+    zslot slots[ZCACHE_SLOTS];
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+    /** Cluster being written. */
+    unsigned char *buf;
+    /** Compressed data of the cluster being written. */
+    unsigned char *zbuf;
+    unsigned char mem[];
+};
+
+
+/** Size of a cluster in bytes. */
+static size_t cluster_size(fs_ctx *fs)
+{
+    return (size_t)A1FS_CLUSTER_BLOCKS << fs->block_shift;
+}
+
+static struct zcache *get_cache(fs_ctx *fs)
+{
+    if (fs->zcache != NULL) return fs->zcache;
+
+    size_t csize = cluster_size(fs);
+    struct zcache *zc = calloc(1, sizeof(*zc) + (ZCACHE_SLOTS + 2) * csize);
+    if (zc == NULL) return NULL;
+    for (int i = 0; i < ZCACHE_SLOTS; i++) zc->slots[i].data = zc->mem + i * csize;
+    zc->buf = zc->mem + ZCACHE_SLOTS * csize;
+    zc->zbuf = zc->buf + csize;
+    fs->zcache = zc;
+    return zc;
+}
+
+void compress_forget(fs_ctx *fs, a1fs_ino_t ino)
+{
+    if (fs->zcache == NULL) return;
+    for (int i = 0; i < ZCACHE_SLOTS; i++) {
+        if (fs->zcache->slots[i].ino == ino) fs->zcache->slots[i].valid = false;
+    }
+}
+
+/** Drop the cached clusters of an inode from cluster from onwards. */
+static void forget_from(struct zcache *zc, a1fs_ino_t ino, uint32_t from)
+{
+    for (int i = 0; i < ZCACHE_SLOTS; i++) {
+        if (zc->slots[i].ino == ino && zc->slots[i].cluster >= from) zc->slots[i].valid = false;
+    }
+}
+
+/** Find a cached cluster; NULL if it is not in the cache. */
+static zslot *cache_find(struct zcache *zc, a1fs_ino_t ino, uint32_t c)
+{
+    for (int i = 0; i < ZCACHE_SLOTS; i++) {
+        zslot *slot = &zc->slots[i];
+        if (slot->valid && slot->ino == ino && slot->cluster == c) {
+            slot->used = ++zc->clock;
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/** Take the least recently used slot for a cluster; its data is not filled in. */
+static zslot *cache_take(struct zcache *zc, a1fs_ino_t ino, uint32_t c)
+{
+    zslot *slot = &zc->slots[0];
+    for (int i = 0; i < ZCACHE_SLOTS; i++) {
+        zslot *s = &zc->slots[i];
+        if (s->valid && s->ino == ino && s->cluster == c) {
+            slot = s;
+            break;
+        }
+        if (!s->valid || s->used < slot->used) slot = s;
+    }
+    slot->valid = true;
+    slot->ino = ino;
+    slot->cluster = c;
+    slot->used = ++zc->clock;
+    return slot;
+}
+
+
+/**
+ * Decompress (or copy) a cluster of a file into buf.
+ *
+ * Everything past the end of file or the blocks mapped by the cluster is zeroed.
+ * Compressed data that is split over stripe chunks is gathered in the zbuf of
+ * the cluster cache, which must have been allocated.
+ *
+ * @return  0 on success; -EIO if the compressed data is corrupt.
+ */
+static int load_cluster(fs_ctx *fs, const a1fs_inode *in, uint32_t c, unsigned char *buf)
+{
+    size_t csize = cluster_size(fs);
+    a1fs_blk_t lblk = c * A1FS_CLUSTER_BLOCKS;
+    size_t len = 0;
+    a1fs_ext_leaf leaf;
+
+    // the cluster of an uncompressed file (one that is being converted) can
+    // be spread over several extents, which can also start before it
+    while (len < csize && ext_find(fs, in, lblk + (len >> fs->block_shift), &leaf)) {
+        if (leaf.zinfo != 0) {
+            // a truncated compressed extent decompresses to more than it maps
+            size_t n = (size_t)leaf.ext.count << fs->block_shift;
+            if (len != 0 || leaf.lblk != lblk || A1FS_ZINFO_ALG(leaf.zinfo) != A1FS_COMPR_LZ4) {
+                return -EIO;
+            }
+            // data split over stripe chunks is put back together first
+            const void *data = fs_data_block(fs, leaf.ext.start);
+            a1fs_blk_t pcount = ext_pcount(fs, &leaf);
+            if (fs_data_run(fs, leaf.ext.start, pcount) < pcount) {
+                fs_data_load(fs, fs->zcache->zbuf, leaf.ext.start, A1FS_ZINFO_LEN(leaf.zinfo));
+                data = fs->zcache->zbuf;
+            }
+            if (lz4_decompress(data, A1FS_ZINFO_LEN(leaf.zinfo), buf, csize) < (long)n) return -EIO;
+            len = n;
+            break;
+        }
+
+        a1fs_blk_t skip = lblk + (len >> fs->block_shift) - leaf.lblk;
+        size_t n = ((size_t)(leaf.ext.count - skip)) << fs->block_shift;
+        if (n > csize - len) n = csize - len;
+        fs_data_load(fs, buf + len, leaf.ext.start + skip, n);
+        len += n;
+    }
+
+    // whatever the last block holds past the end of file reads as zeros
+    uint64_t start = (uint64_t)c * csize;
+    if (in->size < start + len) len = in->size > start ? in->size - start : 0;
+    memset(buf + len, 0, csize - len);
+    return 0;
+}
+
+/**
+ * Write a cluster of a compressed file.
+ *
+ * The first nblocks blocks of buf are compressed if that saves at least one
+ * block and written into newly allocated blocks. The cluster must either be
+ * mapped already or be the one right after the end of the file.
+ *
+ * @return  0 on success; -ENOSPC if there is no free run for the data.
+ */
+static int store_cluster(fs_ctx *fs, struct zcache *zc, a1fs_inode *in, uint32_t c,
+                         const unsigned char *buf, a1fs_blk_t nblocks)
+{
+    size_t len = (size_t)nblocks << fs->block_shift;
+    a1fs_ext_leaf leaf = { .lblk = c * A1FS_CLUSTER_BLOCKS, .ext = { 0, nblocks }, .zinfo = 0 };
+    const void *data = buf;
+
+    size_t zlen = 0;
+    if (nblocks > 1) zlen = lz4_compress(buf, len, zc->zbuf, len - fs->block_size);
+    if (zlen > 0) {
+        leaf.zinfo = A1FS_ZINFO(A1FS_COMPR_LZ4, zlen);
+        data = zc->zbuf;
+    }
+    a1fs_blk_t pcount = ext_pcount(fs, &leaf);
+
+    // keep the clusters of a file next to each other
+    a1fs_ext_leaf prev;
+    a1fs_blk_t goal = 0;
+    if (c > 0 && ext_find(fs, in, leaf.lblk - 1, &prev)) goal = prev.ext.start + ext_pcount(fs, &prev);
+    long b = alloc_run(fs, goal, pcount);
+    if (b < 0) return -ENOSPC;
+    leaf.ext.start = b;
+
+    size_t n = zlen > 0 ? zlen : len;
+    fs_data_store(fs, b, data, n);
+
+    int ret = leaf.lblk < ext_nblocks(fs, in) ? ext_set(fs, in, &leaf) : ext_insert(fs, in, &leaf);
+    if (ret < 0) free_blocks(fs, b, pcount);
+    return ret;
+}
+
+/**
+ * Rewrite the clusters that hold bytes [from, to) of a compressed file.
+ *
+ * The bytes come from data, or keep their current contents (zeros past the
+ * end of file) if data is NULL. The file size becomes size, which must be at
+ * least to and the current size.
+ */
+static int update_clusters(fs_ctx *fs, a1fs_inode *in, uint64_t from, uint64_t to,
+                           const unsigned char *data, uint64_t size)
+{
+    struct zcache *zc = get_cache(fs);
+    if (zc == NULL) return -ENOMEM;
+    size_t csize = cluster_size(fs);
+    uint64_t nblocks = fs_blocks(fs, size);
+
+    // the last cluster of the file grows too if the new data starts past it
+    uint64_t first = from < in->size ? from : in->size;
+    int ret = 0;
+    for (uint32_t c = first / csize; (uint64_t)c * csize < to; c++) {
+        uint64_t start = (uint64_t)c * csize;
+        zslot *slot = cache_find(zc, in->num, c);
+        if (slot != NULL) {
+            memcpy(zc->buf, slot->data, csize);
+        } else if ((ret = load_cluster(fs, in, c, zc->buf)) < 0) {
+            break;
+        }
+
+        if (data != NULL && from < start + csize) {
+            uint64_t lo = from > start ? from : start;
+            uint64_t hi = to < start + csize ? to : start + csize;
+            memcpy(zc->buf + (lo - start), data + (lo - from), hi - lo);
+        }
+
+        a1fs_blk_t n = nblocks - c * A1FS_CLUSTER_BLOCKS;
+        if (n > A1FS_CLUSTER_BLOCKS) n = A1FS_CLUSTER_BLOCKS;
+        if ((ret = store_cluster(fs, zc, in, c, zc->buf, n)) < 0) break;
+        memcpy(cache_take(zc, in->num, c)->data, zc->buf, csize);
+    }
+
+    // on failure the file keeps the clusters that were written
+    uint64_t mapped = (uint64_t)ext_nblocks(fs, in) << fs->block_shift;
+    if (ret == 0 || mapped > size) mapped = size;
+    if (mapped > in->size) in->size = mapped;
+    return ret;
+}
+
+int compress_read(fs_ctx *fs, a1fs_inode *in, void *buf, size_t size, uint64_t offset)
+{
+    struct zcache *zc = get_cache(fs);
+    if (zc == NULL) return -ENOMEM;
+    size_t csize = cluster_size(fs);
+
+    for (size_t done = 0; done < size; ) {
+        uint64_t pos = offset + done;
+        uint32_t c = pos / csize;
+        zslot *slot = cache_find(zc, in->num, c);
+        if (slot != NULL) {
+            zc->hits++;
+        } else {
+            zc->misses++;
+            slot = cache_take(zc, in->num, c);
+            int ret = load_cluster(fs, in, c, slot->data);
+            if (ret < 0) {
+                slot->valid = false;
+                return ret;
+            }
+        }
+
+        size_t within = pos - (uint64_t)c * csize;
+        size_t n = csize - within < size - done ? csize - within : size - done;
+        memcpy(buf + done, slot->data + within, n);
+        done += n;
+    }
+    return 0;
+}
+
+int compress_write(fs_ctx *fs, a1fs_inode *in, const void *buf, size_t size, uint64_t offset)
+{
+    uint64_t end = offset + size;
+    return update_clusters(fs, in, offset, end, buf, end > in->size ? end : in->size);
+}
+
+int compress_resize(fs_ctx *fs, a1fs_inode *in, uint64_t size)
+{
+    if (size >= in->size) return update_clusters(fs, in, in->size, size, NULL, size);
+
+    // a cluster cut in the middle keeps its compressed data: it still
+    // decompresses, and the bytes past the end of file read as zeros anyway
+    if (fs->zcache != NULL) forget_from(fs->zcache, in->num, size / cluster_size(fs));
+    ext_truncate(fs, in, fs_blocks(fs, size));
+    in->size = size;
+    return 0;
+}
+
+int compress_set(fs_ctx *fs, a1fs_inode *in, bool on)
+{
+    if (on == !!(in->flags & A1FS_INODE_COMPRESS)) return 0;
+    if (S_ISDIR(in->mode)) {
+        in->flags ^= A1FS_INODE_COMPRESS;
+        return 0;
+    }
+    struct zcache *zc = get_cache(fs);
+    if (zc == NULL) return -ENOMEM;
+    compress_forget(fs, in->num);
+
+    // build a new tree from a copy of the old one, which is freed at the end
+    a1fs_inode old = *in;
+    ext_init(in);
+    in->block_count = 0;
+    in->flags ^= A1FS_INODE_COMPRESS;
+
+    a1fs_blk_t nblocks = ext_nblocks(fs, &old);
+    int ret = 0;
+    for (uint32_t c = 0; (uint64_t)c * A1FS_CLUSTER_BLOCKS < nblocks && ret == 0; c++) {
+        if ((ret = load_cluster(fs, &old, c, zc->buf)) < 0) break;
+
+        a1fs_blk_t n = nblocks - c * A1FS_CLUSTER_BLOCKS;
+        if (n > A1FS_CLUSTER_BLOCKS) n = A1FS_CLUSTER_BLOCKS;
+        if (on) {
+            ret = store_cluster(fs, zc, in, c, zc->buf, n);
+            continue;
+        }
+
+        // uncompressed clusters are merged into as few extents as possible
+        a1fs_ext_leaf last;
+        a1fs_blk_t goal = ext_last(fs, in, &last) ? last.ext.start + last.ext.count : 0;
+        long b = alloc_run(fs, goal, n);
+        if (b < 0 || ext_append(fs, in, b, n) < 0) {
+            if (b >= 0) free_blocks(fs, b, n);
+            ret = -ENOSPC;
+            break;
+        }
+        fs_data_store(fs, b, zc->buf, (size_t)n << fs->block_shift);
+    }
+
+    if (ret < 0) {
+        ext_truncate(fs, in, 0);
+        *in = old;
+        return ret;
+    }
+    ext_truncate(fs, &old, 0);
+    return 0;
+}
+
+void compress_stats(fs_ctx *fs, struct a1fs_stats *st)
+{
+    st->compr_logical = fs->sb->compr_logical;
+    st->compr_physical = fs->sb->compr_physical;
+    st->zcache_hits = fs->zcache ? fs->zcache->hits : 0;
+    st->zcache_misses = fs->zcache ? fs->zcache->misses : 0;
+}
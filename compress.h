@@ -0,0 +1,68 @@
+/**
+ * CSC369 Assignment 1 - Compressed file data header file.
+ *
+ * The data of a file with the A1FS_INODE_COMPRESS flag is read and written one
+ * cluster at a time (see a1fs.h). Writing any part of a cluster recompresses
+ * the whole cluster into newly allocated blocks, and the old blocks are freed
+ * once the cluster is mapped to the new ones. Decompressed clusters are kept in
+ * a small cache, so sequential reads decompress every cluster only once.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/**
+ * Read from a compressed file.
+ *
+ * @param fs      file system context.
+ * @param in      inode of the file.
+ * @param buf     buffer that receives the data.
+ * @param size    number of bytes to read; must not go past the end of file.
+ * @param offset  offset from the beginning of the file.
+ * @return        0 on success; -errno on error.
+ */
+int compress_read(fs_ctx *fs, a1fs_inode *in, void *buf, size_t size, uint64_t offset);
+
+/**
+ * Write to a compressed file, extending it if needed.
+ *
+ * @param fs      file system context.
+ * @param in      inode of the file.
+ * @param buf     data to write.
+ * @param size    number of bytes to write.
+ * @param offset  offset from the beginning of the file.
+ * @return        0 on success; -errno on error.
+ */
+int compress_write(fs_ctx *fs, a1fs_inode *in, const void *buf, size_t size, uint64_t offset);
+
+/**
+ * Set the size of a compressed file. New data reads as zeros.
+ *
+ * @return  0 on success; -ENOSPC or -ENOMEM on error.
+ */
+int compress_resize(fs_ctx *fs, a1fs_inode *in, uint64_t size);
+
+/**
+ * Turn compression of a file or directory on or off.
+ *
+ * The data of a regular file is rewritten in the new format; a directory only
+ * passes the flag on to the files and directories created in it.
+ *
+ * @param fs  file system context.
+ * @param in  inode.
+ * @param on  whether the data should be compressed.
+ * @return    0 on success; -ENOSPC or -ENOMEM on error (the file is unchanged).
+ */
+int compress_set(fs_ctx *fs, a1fs_inode *in, bool on);
+
+/** Drop the cached clusters of an inode, e.g. when it is freed. */
+void compress_forget(fs_ctx *fs, a1fs_ino_t ino);
+
+/** Fill in the compression statistics. */
+void compress_stats(fs_ctx *fs, struct a1fs_stats *st);
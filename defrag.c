@@ -0,0 +1,72 @@
+/**
+ * CSC369 Assignment 1 - File defragmentation implementation.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "defrag.h"
+#include "extent.h"
+
+
+/** Check if any data block of a file is shared with another file or a snapshot. */
+static bool shares_blocks(fs_ctx *fs, const a1fs_inode *in, a1fs_blk_t n_blocks)
+{
+    for (a1fs_blk_t l = 0; l < n_blocks; ) {
+        a1fs_blk_t b, count;
+        if (!ext_map(fs, in, l, &b, &count)) return false;
+        for (a1fs_blk_t i = 0; i < count; i++) {
+            if (block_refs(fs, b + i) > 1) return true;
+        }
+        l += count;
+    }
+    return false;
+}
+
+int defrag_inode(fs_ctx *fs, a1fs_inode *in, struct a1fs_defrag_info *info)
+{
+    info->extents_before = in->extent_count;
+    info->extents_after = in->extent_count;
+    info->flags = 0;
+    //compressed files keep one extent per cluster
+    if (in->extent_count <= 1 || (in->flags & A1FS_INODE_COMPRESS)) return 0;
+
+    a1fs_blk_t n_blocks = ext_nblocks(fs, in);
+    if (shares_blocks(fs, in, n_blocks)) {
+        info->flags |= A1FS_DEFRAG_SHARED;
+        return 0;
+    }
+    long run = alloc_run(fs, 1, n_blocks);
+    if (run < 0) return -ENOSPC;
+
+    // Copy the data into the new run and make sure it is on disk before the
+    // inode refers to it
+    for (a1fs_blk_t l = 0; l < n_blocks; ) {
+        a1fs_blk_t b, count;
+        if (!ext_map(fs, in, l, &b, &count)) {
+            free_blocks(fs, run, n_blocks);
+            return -EIO;
+        }
+        fs_data_copy(fs, run + l, b, count);
+        l += count;
+    }
+    fs_ctx_sync_data(fs, run, n_blocks);
+
+    // Switch the inode over to a tree with the single new extent
+    a1fs_inode old = *in;
+    ext_init(in);
+    in->ext_hdr.entries = 1;
+    in->ext_root[0].leaf.lblk = 0;
+    in->ext_root[0].leaf.ext.start = run;
+    in->ext_root[0].leaf.ext.count = n_blocks;
+    in->extent_count = 1;
+    in->block_count = n_blocks;
+    fs_ctx_sync(fs, in, sizeof(*in));
+
+    // Free the old data blocks and tree nodes through a copy of the old root
+    ext_truncate(fs, &old, 0);
+
+    info->extents_after = 1;
+    return 0;
+}
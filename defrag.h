@@ -0,0 +1,29 @@
+/**
+ * CSC369 Assignment 1 - File defragmentation header file.
+ */
+
+#pragma once
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/**
+ * Move the data blocks of a file (or directory) into one contiguous extent.
+ *
+ * The data is copied into a free run of blocks that is large enough to hold
+ * the whole file and flushed before the inode is switched over to the new
+ * extent, so the file never refers to a partially copied run. The old blocks
+ * and extent tree nodes are freed afterwards.
+ *
+ * A file that shares data blocks with a reflink clone or a snapshot is left as
+ * it is: moving it would give it a private copy of the shared blocks and use
+ * the space twice. info->flags then has A1FS_DEFRAG_SHARED.
+ *
+ * @param fs    file system context.
+ * @param in    inode of the file to defragment.
+ * @param info  receives the number of extents before and after, and flags.
+ * @return      0 on success (including files that are already contiguous);
+ *              -ENOSPC if there is no free run large enough for the file.
+ */
+int defrag_inode(fs_ctx *fs, a1fs_inode *in, struct a1fs_defrag_info *info);
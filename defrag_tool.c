@@ -0,0 +1,170 @@
+/**
+ * CSC369 Assignment 1 - a1fs defragmenter.
+ *
+ * Offline mode defragments every file in an unmounted image. Online mode asks
+ * a mounted a1fs to defragment the given files via the A1FS_IOC_DEFRAG ioctl.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "alloc.h"
+#include "defrag.h"
+#include "fs_ctx.h"
+#include "map.h"
+
+
+/** Command line options. */
+typedef struct defrag_opts {
+    /** Image file paths, more than one if striped (offline), or file paths (online). */
+    char **paths;
+    int n_paths;
+
+    /** Print help and exit. */
+    bool help;
+    /** Defragment files on a mounted file system. */
+    bool online;
+    /** Report every file, not just the totals. */
+    bool verbose;
+
+} defrag_opts;
+
+static const char *help_str = "\
+Usage: %s [-v] image [image...]\n\
+       %s -o file...\n\
+\n\
+Move the data of each file into a single contiguous extent and report the\n\
+number of extents before and after. A file system striped over several\n\
+image files is defragmented with all of them, in order.\n\
+\n\
+Options:\n\
+    -o      online mode - defragment files on a mounted a1fs\n\
+    -v      report every file (offline mode)\n\
+    -h      print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+    fprintf(f, help_str, progname, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], defrag_opts *opts)
+{
+    int o;
+    while ((o = getopt(argc, argv, "ovh")) != -1) {
+        switch (o) {
+            case 'h': opts->help    = true; return true;// skip other arguments
+            case 'o': opts->online  = true; break;
+            case 'v': opts->verbose = true; break;
+
+            case '?': return false;
+            default : assert(false);
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Missing %s path\n", opts->online ? "file" : "image");
+        return false;
+    }
+    opts->paths = argv + optind;
+    opts->n_paths = argc - optind;
+    return true;
+}
+
+
+static int defrag_online(const defrag_opts *opts)
+{
+    int ret = 0;
+    for (int i = 0; i < opts->n_paths; i++) {
+        int fd = open(opts->paths[i], O_RDONLY);
+        if (fd < 0) {
+            perror(opts->paths[i]);
+            ret = 1;
+            continue;
+        }
+        struct a1fs_defrag_info info;
+        if (ioctl(fd, A1FS_IOC_DEFRAG, &info) < 0) {
+            fprintf(stderr, "%s: %s\n", opts->paths[i], strerror(errno));
+            ret = 1;
+        } else {
+            printf("%s: %u -> %u extents%s\n", opts->paths[i], info.extents_before, info.extents_after,
+                   (info.flags & A1FS_DEFRAG_SHARED) ? " (shares blocks, left as it is)" : "");
+        }
+        close(fd);
+    }
+    return ret;
+}
+
+static int defrag_offline(fs_ctx *fs, const defrag_opts *opts)
+{
+    unsigned int files = 0, moved = 0, failed = 0, shared = 0, before = 0, after = 0;
+    unsigned int n_inodes = alloc_inode_limit(fs);
+    for (unsigned int ino = 0; ino < n_inodes; ino++) {
+        //orphans are about to be freed; no point in moving them
+        if (!fs->ibitmap->map[ino] || (fs->itable[ino].flags & A1FS_INODE_ORPHAN)) continue;
+
+        struct a1fs_defrag_info info;
+        int r = defrag_inode(fs, &fs->itable[ino], &info);
+        files++;
+        before += info.extents_before;
+        after += info.extents_after;
+        bool skipped = r < 0 || (info.flags & A1FS_DEFRAG_SHARED);
+        if (r < 0) failed++;
+        else if (info.flags & A1FS_DEFRAG_SHARED) shared++;
+        else if (info.extents_after != info.extents_before) moved++;
+
+        if (opts->verbose && (skipped || info.extents_after != info.extents_before)) {
+            printf("inode %u: %u -> %u extents%s\n", ino, info.extents_before, info.extents_after,
+                   r < 0 ? " (no free run large enough)" : skipped ? " (shares blocks)" : "");
+        }
+    }
+    printf("%s: %u files, %u defragmented, %u skipped, %u sharing blocks; %u -> %u extents\n",
+           opts->paths[0], files, moved, failed, shared, before, after);
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    defrag_opts opts = {0};// defaults are all 0
+    if (!parse_args(argc, argv, &opts)) {
+        // Invalid arguments, print help to stderr
+        print_help(stderr, argv[0]);
+        return 1;
+    }
+    if (opts.help) {
+        // Help requested, print it to stdout
+        print_help(stdout, argv[0]);
+        return 0;
+    }
+    if (opts.online) return defrag_online(&opts);
+
+    // Map image file into memory
+    size_t size;
+    void *image = map_file(opts.paths[0], A1FS_BLOCK_SIZE, &size);
+    if (image == NULL) return 1;
+
+    int ret = 1;
+    fs_ctx fs = {0};
+    if (!fs_ctx_init(&fs, image, size)) {
+        fprintf(stderr, "%s: not an a1fs image\n", opts.paths[0]);
+        goto end;
+    }
+    if (fs_ctx_map_members(&fs, opts.paths + 1, opts.n_paths - 1, true, 0)) {
+        fs_ctx_mount(&fs);
+        ret = defrag_offline(&fs, &opts);
+    }
+    fs_ctx_destroy(&fs);
+end:
+    munmap(image, size);
+    return ret;
+}
@@ -0,0 +1,107 @@
+/**
+ * CSC369 Assignment 1 - Discarding free blocks implementation.
+ */
+
+#define _GNU_SOURCE //for fallocate()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "discard.h"
+
+
+bool discard_open(fs_ctx *fs, const char *path, char *const members[], unsigned int n)
+{
+    for (unsigned int m = 0; m <= n && m < A1FS_STRIPE_MAX; m++) {
+        const char *p = m == 0 ? path : members[m - 1];
+        fs->discard_fd[m] = open(p, O_RDWR);
+        if (fs->discard_fd[m] < 0) {
+            perror(p);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Punch a hole where count data blocks from start are, split at stripe chunk
+ * boundaries. Returns 0 on success or -errno.
+ */
+static int punch(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count)
+{
+    while (count > 0) {
+        a1fs_blk_t n = fs_data_run(fs, start, count);
+        unsigned int m = (start >> fs->stripe_shift) % fs->stripe_count;
+        off_t off = (char*)fs_data_block(fs, start) - (char*)fs->members[m];
+        if (fs->discard_fd[m] < 0) return -EBADF;
+        if (fallocate(fs->discard_fd[m], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      off, (off_t)n << fs->block_shift) < 0)
+        {
+            return -errno;
+        }
+        start += n;
+        count -= n;
+    }
+    return 0;
+}
+
+void discard_freed(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count)
+{
+    if (!fs->discard) return;
+    if (fs->discard_count > 0) {
+        if (start == fs->discard_start + fs->discard_count) {
+            fs->discard_count += count;
+            return;
+        }
+        //extents are often freed from the end of the file backwards
+        if (start + count == fs->discard_start) {
+            fs->discard_start = start;
+            fs->discard_count += count;
+            return;
+        }
+        discard_flush(fs);
+    }
+    fs->discard_start = start;
+    fs->discard_count = count;
+}
+
+void discard_flush(fs_ctx *fs)
+{
+    if (fs->discard_count == 0) return;
+    int ret = punch(fs, fs->discard_start, fs->discard_count);
+    fs->discard_count = 0;
+    if (ret < 0) {
+        // e.g. the host file system cannot punch holes; no point in trying again
+        fprintf(stderr, "discard: %s; disabled\n", strerror(-ret));
+        fs->discard = false;
+    }
+}
+
+int discard_trim(fs_ctx *fs, a1fs_blk_t minlen, uint64_t *blocks)
+{
+    if (minlen == 0) minlen = 1;
+    *blocks = 0;
+
+    // block 0 always belongs to the root directory
+    unsigned int limit = alloc_block_limit(fs);
+    if (fs_ctx_data_capacity(fs) < limit) limit = fs_ctx_data_capacity(fs);
+    for (unsigned int b = 1; b < limit; ) {
+        if (fs->bbitmap->map[b] != 0) {
+            b++;
+            continue;
+        }
+        unsigned int end = b + 1;
+        while (end < limit && fs->bbitmap->map[end] == 0) end++;
+        if (end - b >= minlen) {
+            int ret = punch(fs, b, end - b);
+            if (ret < 0) return ret;
+            *blocks += end - b;
+        }
+        b = end;
+    }
+    return 0;
+}
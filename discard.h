@@ -0,0 +1,57 @@
+/**
+ * CSC369 Assignment 1 - Discarding free blocks header file.
+ *
+ * Image files are usually sparse. Freeing a block does not make the host file
+ * system take the space back, so the image files only ever grow. Discarding a
+ * free block punches a hole in the image file where it is, after which it
+ * reads as zeros.
+ *
+ * With the "discard" mount option, blocks are discarded as they are freed.
+ * Adjacent runs of freed blocks are gathered and discarded together by
+ * discard_flush(), which must be called before blocks are allocated (so that a
+ * pending block is not reused before it is discarded) and at the end of every
+ * operation. discard_trim() discards all the free blocks at once.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/**
+ * Open the image files for discarding; they are closed by fs_ctx_destroy().
+ *
+ * @param fs       file system context.
+ * @param path     first image file.
+ * @param members  the other image files of a striped file system, in order.
+ * @param n        number of members.
+ * @return         true on success; false (after printing an error) if an
+ *                 image cannot be opened.
+ */
+bool discard_open(fs_ctx *fs, const char *path, char *const members[], unsigned int n);
+
+/**
+ * Record that blocks were freed. Does nothing unless fs->discard is set.
+ *
+ * @param fs     file system context.
+ * @param start  first block.
+ * @param count  number of blocks.
+ */
+void discard_freed(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count);
+
+/** Discard the blocks recorded by discard_freed() since the last call. */
+void discard_flush(fs_ctx *fs);
+
+/**
+ * Discard every run of at least minlen free blocks.
+ *
+ * @param fs      file system context.
+ * @param minlen  minimum run length in blocks.
+ * @param blocks  receives the number of blocks discarded.
+ * @return        0 on success; -errno if the image cannot be punched.
+ */
+int discard_trim(fs_ctx *fs, a1fs_blk_t minlen, uint64_t *blocks);
@@ -0,0 +1,65 @@
+/**
+ * CSC369 Assignment 1 - Image dump stream format.
+ *
+ * A dump (see dump_tool.c) holds what is needed to rebuild the image files of
+ * a file system: the blocks of the metadata area (everything before the data
+ * region) and the data blocks that are in use, leaving out blocks that are
+ * all zeros. It is a header followed by records, each one a run of blocks
+ * followed by their contents, and ends with an A1FS_DUMP_END record. All the
+ * A1FS_DUMP_META records come before the A1FS_DUMP_DATA ones.
+ *
+ * The image files are rebuilt (see restore_tool.c) as sparse files of the
+ * original size that only hold the blocks in the dump.
+ *
+ * An incremental dump (since != 0) only holds the used data blocks that were
+ * modified after generation since (see A1FS_FEATURE_CBT), but all the blocks
+ * of the metadata area, zero or not. It is applied on top of images that were
+ * restored up to that generation.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Magic value of a dump header. */
+#define A1FS_DUMP_MAGIC 0xC5C369A1D0D0D0D0ul
+/** Version of the dump format. */
+#define A1FS_DUMP_VERSION 1
+
+/** Largest number of blocks in one record. */
+#define A1FS_DUMP_RUN_MAX 256
+
+
+/** Header at the start of a dump. */
+typedef struct a1fs_dump_hdr {
+    /** Must match A1FS_DUMP_MAGIC. */
+    uint64_t magic;
+    uint32_t version;
+    /** File system block size; records count blocks of this size. */
+    uint32_t block_size;
+    /** Number of image files (1 unless striped). */
+    uint32_t n_images;
+    /** Generation that the dump holds the changes since; 0 for a full dump. */
+    uint32_t since;
+    /** Size of each image file in bytes. */
+    uint64_t image_size[A1FS_STRIPE_MAX];
+} a1fs_dump_hdr;
+
+/** Record types. */
+#define A1FS_DUMP_META 1 /* blocks of an image file, before its data region */
+#define A1FS_DUMP_DATA 2 /* data blocks, numbered as in the block bitmap */
+#define A1FS_DUMP_END  3 /* last record; count is the number of blocks in the dump */
+
+/** Record header; followed by count blocks, except for A1FS_DUMP_END. */
+typedef struct a1fs_dump_rec {
+    uint32_t type;
+    /** A1FS_DUMP_META: index of the image file. */
+    uint32_t image;
+    /** First block of the run. */
+    uint64_t start;
+    /** Number of blocks in the run. */
+    uint64_t count;
+} a1fs_dump_rec;
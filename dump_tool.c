@@ -0,0 +1,292 @@
+/**
+ * CSC369 Assignment 1 - a1fs image dump.
+ *
+ * Writes the metadata and the used data blocks of an unmounted image into a
+ * compact stream (see dump.h) that restore.a1fs turns back into an image. The
+ * time and size of a dump depend on how much of the image is in use, not on
+ * its size. An incremental dump only holds the data blocks modified since an
+ * earlier dump taken with -c, so its size depends on how much has changed.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "alloc.h"
+#include "dump.h"
+#include "fs_ctx.h"
+#include "map.h"
+
+/** Size of the output buffer; the runs are written with I/O this large. */
+#define DUMP_BUF_SIZE (1 << 20)
+
+
+/** Command line options. */
+typedef struct dump_opts {
+    /** Image file paths, more than one if striped. */
+    char **paths;
+    unsigned int n_paths;
+    /** Output file path; NULL for stdout. */
+    const char *out_path;
+    /** Only dump the data blocks modified after this generation; 0 for all. */
+    unsigned long since;
+
+    /** Print help and exit. */
+    bool help;
+    /** Print a summary of the dump to stderr. */
+    bool verbose;
+    /** Start a new generation once the dump is written. */
+    bool checkpoint;
+
+} dump_opts;
+
+static const char *help_str = "\
+Usage: %s [-o file] [-s gen] [-c] [-v] image [image...]\n\
+\n\
+Write the metadata and the used data blocks of the a1fs file system in the\n\
+image file to a dump that restore.a1fs can rebuild the image from. Blocks\n\
+that are free or all zeros are left out. The file system must not be mounted\n\
+while it is being dumped. A file system striped over several image files is\n\
+dumped with all of them, in order.\n\
+\n\
+With -c, the generation of block changes that the dump covers is ended and\n\
+its number printed; a later dump with -s and that number only holds the data\n\
+blocks modified since, and restore.a1fs applies it on top of the images\n\
+restored so far.\n\
+\n\
+Options:\n\
+    -o file  write the dump to file instead of stdout\n\
+    -s gen   only dump the changes made after checkpoint gen\n\
+    -c       end the current generation (checkpoint) after the dump\n\
+    -v       print the number of blocks and runs dumped to stderr\n\
+    -h       print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+    fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], dump_opts *opts)
+{
+    int o;
+    while ((o = getopt(argc, argv, "o:s:cvh")) != -1) {
+        switch (o) {
+            case 'o': opts->out_path = optarg; break;
+            case 's': opts->since = strtoul(optarg, NULL, 10); break;
+
+            case 'h': opts->help       = true; return true;// skip other arguments
+            case 'c': opts->checkpoint = true; break;
+            case 'v': opts->verbose    = true; break;
+
+            case '?': return false;
+            default : assert(false);
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Missing image path\n");
+        return false;
+    }
+    opts->paths = argv + optind;
+    opts->n_paths = argc - optind;
+    return true;
+}
+
+
+/** Dump being written. */
+typedef struct dump_state {
+    fs_ctx *fs;
+    FILE *out;
+    /** Generation the changes are dumped since; 0 for a full dump. */
+    uint32_t since;
+    /** Number of blocks and records written so far. */
+    uint64_t blocks;
+    uint64_t runs;
+    bool failed;
+} dump_state;
+
+static bool zero_block(fs_ctx *fs, const void *p)
+{
+    const uint64_t *w = p;
+    for (size_t i = 0; i < fs->block_size / sizeof(*w); i++) {
+        if (w[i] != 0) return false;
+    }
+    return true;
+}
+
+static void put(dump_state *st, const void *buf, size_t len)
+{
+    if (!st->failed && fwrite(buf, 1, len, st->out) != len) st->failed = true;
+}
+
+static void put_rec(dump_state *st, uint32_t type, uint32_t image, uint64_t start, uint64_t count)
+{
+    a1fs_dump_rec rec = { .type = type, .image = image, .start = start, .count = count };
+    put(st, &rec, sizeof(rec));
+    if (type == A1FS_DUMP_END) return;
+    st->blocks += count;
+    st->runs++;
+}
+
+/**
+ * Dump blocks [from, to) of image file m. A full dump leaves out the ones that
+ * are all zeros; an incremental one cannot, as they may not have been before.
+ */
+static void dump_meta(dump_state *st, unsigned int m, size_t from, size_t to)
+{
+    fs_ctx *fs = st->fs;
+    void *image = fs->members[m];
+    size_t b = from;
+    while (b < to) {
+        if (st->since == 0 && zero_block(fs, image + (b << fs->block_shift))) {
+            b++;
+            continue;
+        }
+        size_t end = b + 1;
+        while (end < to && end - b < A1FS_DUMP_RUN_MAX &&
+               (st->since != 0 || !zero_block(fs, image + (end << fs->block_shift))))
+        {
+            end++;
+        }
+        put_rec(st, A1FS_DUMP_META, m, b, end - b);
+        put(st, image + (b << fs->block_shift), (end - b) << fs->block_shift);
+        b = end;
+    }
+}
+
+/** Whether data block b goes into the dump. */
+static bool want_data(dump_state *st, a1fs_blk_t b)
+{
+    fs_ctx *fs = st->fs;
+    if (fs->bbitmap->map[b] == 0) return false;
+    return st->since == 0 ? !zero_block(fs, fs_data_block(fs, b)) : fs->cbt[b] > st->since;
+}
+
+/**
+ * Dump the data blocks that are in use: all but the ones that are all zeros,
+ * or the ones modified since st->since.
+ */
+static void dump_data(dump_state *st)
+{
+    fs_ctx *fs = st->fs;
+    a1fs_blk_t limit = alloc_block_limit(fs);
+    if (fs_ctx_data_capacity(fs) < limit) limit = fs_ctx_data_capacity(fs);
+
+    a1fs_blk_t b = 0;
+    while (b < limit) {
+        if (!want_data(st, b)) {
+            b++;
+            continue;
+        }
+        a1fs_blk_t end = b + 1;
+        while (end < limit && end - b < A1FS_DUMP_RUN_MAX && want_data(st, end)) end++;
+        put_rec(st, A1FS_DUMP_DATA, 0, b, end - b);
+        // a run is contiguous in memory up to the next stripe chunk boundary
+        for (a1fs_blk_t x = b; x < end; ) {
+            a1fs_blk_t n = fs_data_run(fs, x, end - x);
+            put(st, fs_data_block(fs, x), (size_t)n << fs->block_shift);
+            x += n;
+        }
+        b = end;
+    }
+}
+
+static int dump(fs_ctx *fs, const dump_opts *opts)
+{
+    if ((opts->since != 0 || opts->checkpoint) && fs->cbt == NULL) {
+        fprintf(stderr, "%s: the file system does not keep track of changed blocks\n", opts->paths[0]);
+        return 1;
+    }
+    if (fs->cbt != NULL && opts->since >= fs->sb->cbt_gen) {
+        fprintf(stderr, "%s: checkpoint %lu has not been taken yet\n", opts->paths[0], opts->since);
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (opts->out_path != NULL && (out = fopen(opts->out_path, "w")) == NULL) {
+        perror(opts->out_path);
+        return 1;
+    }
+    setvbuf(out, NULL, _IOFBF, DUMP_BUF_SIZE);
+
+    // the blocks are read in order, each once
+    for (unsigned int m = 0; m < fs->n_members; m++) {
+        madvise(fs->members[m], fs->member_size[m], MADV_SEQUENTIAL);
+    }
+
+    dump_state st = { .fs = fs, .out = out, .since = opts->since };
+    a1fs_dump_hdr hdr = {
+        .magic = A1FS_DUMP_MAGIC,
+        .version = A1FS_DUMP_VERSION,
+        .block_size = fs->block_size,
+        .n_images = fs->n_members,
+        .since = opts->since,
+    };
+    for (unsigned int m = 0; m < fs->n_members; m++) hdr.image_size[m] = fs->member_size[m];
+    put(&st, &hdr, sizeof(hdr));
+
+    // metadata first, so that restore can find the data region
+    dump_meta(&st, 0, 0, fs->sb->block_table);
+    for (unsigned int m = 1; m < fs->n_members; m++) dump_meta(&st, m, 0, 1);
+    dump_data(&st);
+    put_rec(&st, A1FS_DUMP_END, 0, 0, st.blocks);
+
+    if ((out != stdout ? fclose(out) : fflush(out)) != 0) st.failed = true;
+    if (st.failed) {
+        perror(opts->out_path ? opts->out_path : "stdout");
+        return 1;
+    }
+    if (opts->verbose) {
+        fprintf(stderr, "%s: %lu blocks in %lu runs (%lu bytes)\n", opts->paths[0],
+                (unsigned long)st.blocks, (unsigned long)st.runs,
+                (unsigned long)st.blocks << fs->block_shift);
+    }
+    // blocks written from now on are in the next dump with -s
+    if (opts->checkpoint) {
+        fprintf(stderr, "%s: checkpoint %u\n", opts->paths[0], fs->sb->cbt_gen);
+        fs->sb->cbt_gen += 1;
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    dump_opts opts = {0};// defaults are all 0
+    if (!parse_args(argc, argv, &opts)) {
+        // Invalid arguments, print help to stderr
+        print_help(stderr, argv[0]);
+        return 1;
+    }
+    if (opts.help) {
+        // Help requested, print it to stdout
+        print_help(stdout, argv[0]);
+        return 0;
+    }
+
+    // Map image file into memory
+    size_t size;
+    void *image = opts.checkpoint ? map_file(opts.paths[0], A1FS_BLOCK_SIZE, &size)
+                                  : map_file_readonly(opts.paths[0], A1FS_BLOCK_SIZE, &size);
+    if (image == NULL) return 1;
+
+    int ret = 1;
+    fs_ctx fs = {0};
+    if (!fs_ctx_init(&fs, image, size)) {
+        fprintf(stderr, "%s: not an a1fs image\n", opts.paths[0]);
+        goto end;
+    }
+    if (fs_ctx_map_members(&fs, opts.paths + 1, opts.n_paths - 1, false, 0)) {
+        ret = dump(&fs, &opts);
+    }
+    fs_ctx_destroy(&fs);
+end:
+    munmap(image, size);
+    return ret;
+}
@@ -0,0 +1,498 @@
+/**
+ * CSC369 Assignment 1 - Extent tree implementation.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "extent.h"
+
+
+/** One level of the path from the root to a leaf. */
+typedef struct ext_path {
+    /** Node header; the root's is in the inode. */
+    a1fs_ext_header *hdr;
+    /** Block that holds the node; 0 for the root. */
+    a1fs_blk_t blk;
+    /** Index of the entry the path goes through (-1 if there is none). */
+    int idx;
+} ext_path;
+
+
+static a1fs_ext_header *root_hdr(const a1fs_inode *in)
+{
+    return (a1fs_ext_header*)&in->ext_hdr;
+}
+
+static a1fs_ext_header *node_hdr(fs_ctx *fs, a1fs_blk_t blk)
+{
+    return (a1fs_ext_header*)fs_data_block(fs, blk);
+}
+
+static a1fs_ext_entry *entries(a1fs_ext_header *hdr)
+{
+    return (a1fs_ext_entry*)(hdr + 1);
+}
+
+static_assert(offsetof(a1fs_inode, ext_root) == offsetof(a1fs_inode, ext_hdr) + sizeof(a1fs_ext_header),
+              "extent tree root entries must follow the header");
+
+
+void ext_init(a1fs_inode *in)
+{
+    memset(&in->ext_hdr, 0, sizeof(in->ext_hdr));
+    memset(in->ext_root, 0, sizeof(in->ext_root));
+    in->ext_hdr.magic = A1FS_EXT_MAGIC;
+    in->ext_hdr.max = A1FS_EXT_ROOT_MAX;
+    in->extent_count = 0;
+    in->ext_last_leaf = 0;
+}
+
+/** Find the last entry with lblk <= the given one; -1 if there is none. */
+static int search(a1fs_ext_header *hdr, uint32_t lblk)
+{
+    a1fs_ext_entry *e = entries(hdr);
+    int lo = 0, hi = (int)hdr->entries - 1, ret = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (e[mid].leaf.lblk <= lblk) {
+            ret = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return ret;
+}
+
+/** Fill in the path from the root to the leaf that covers lblk; returns the depth. */
+static int find_path(fs_ctx *fs, const a1fs_inode *in, uint32_t lblk, ext_path *path)
+{
+    a1fs_ext_header *hdr = root_hdr(in);
+    int depth = hdr->depth;
+    a1fs_blk_t blk = 0;
+    for (int level = 0; ; level++) {
+        path[level].hdr = hdr;
+        path[level].blk = blk;
+        path[level].idx = search(hdr, lblk);
+        if (level == depth) break;
+
+        //index nodes are never empty; go left if lblk is before the first entry
+        if (path[level].idx < 0) path[level].idx = 0;
+        blk = entries(hdr)[path[level].idx].index.child;
+        hdr = node_hdr(fs, blk);
+    }
+    return depth;
+}
+
+/** Record that the nodes on a path (other than the root) are being modified. */
+static void path_changed(fs_ctx *fs, const ext_path *path, int depth)
+{
+    for (int level = 1; level <= depth; level++) fs_data_changed(fs, path[level].blk, 1);
+}
+
+/** Recompute the block that holds the last extent. */
+static void update_last(fs_ctx *fs, a1fs_inode *in)
+{
+    ext_path path[A1FS_EXT_MAX_DEPTH + 1];
+    int depth = find_path(fs, in, UINT32_MAX, path);
+    in->ext_last_leaf = path[depth].blk;
+}
+
+bool ext_last(fs_ctx *fs, const a1fs_inode *in, a1fs_ext_leaf *last)
+{
+    a1fs_ext_header *hdr = in->ext_last_leaf ? node_hdr(fs, in->ext_last_leaf) : root_hdr(in);
+    if (hdr->entries == 0) return false;
+    *last = entries(hdr)[hdr->entries - 1].leaf;
+    return true;
+}
+
+a1fs_blk_t ext_nblocks(fs_ctx *fs, const a1fs_inode *in)
+{
+    a1fs_ext_leaf last;
+    if (!ext_last(fs, in, &last)) return 0;
+    return last.lblk + last.ext.count;
+}
+
+a1fs_blk_t ext_pcount(fs_ctx *fs, const a1fs_ext_leaf *leaf)
+{
+    if (leaf->zinfo == 0) return leaf->ext.count;
+    return fs_blocks(fs, A1FS_ZINFO_LEN(leaf->zinfo));
+}
+
+/**
+ * Find the leaf entry that covers lblk; NULL if lblk is not mapped. If modify,
+ * the nodes on the way are recorded as changed.
+ */
+static a1fs_ext_leaf *find_leaf(fs_ctx *fs, const a1fs_inode *in, a1fs_blk_t lblk, bool modify)
+{
+    ext_path path[A1FS_EXT_MAX_DEPTH + 1];
+    int depth = find_path(fs, in, lblk, path);
+    if (path[depth].idx < 0) return NULL;
+    if (modify) path_changed(fs, path, depth);
+
+    a1fs_ext_leaf *leaf = &entries(path[depth].hdr)[path[depth].idx].leaf;
+    if (lblk >= leaf->lblk + leaf->ext.count) return NULL;
+    return leaf;
+}
+
+bool ext_find(fs_ctx *fs, const a1fs_inode *in, a1fs_blk_t lblk, a1fs_ext_leaf *leaf)
+{
+    a1fs_ext_leaf *found = find_leaf(fs, in, lblk, false);
+    if (found == NULL) return false;
+    *leaf = *found;
+    return true;
+}
+
+bool ext_map(fs_ctx *fs, const a1fs_inode *in, a1fs_blk_t lblk, a1fs_blk_t *pblk, a1fs_blk_t *run)
+{
+    a1fs_ext_leaf *leaf = find_leaf(fs, in, lblk, false);
+    if (leaf == NULL || leaf->zinfo != 0) return false;
+    *pblk = leaf->ext.start + (lblk - leaf->lblk);
+    if (run) *run = leaf->lblk + leaf->ext.count - lblk;
+    return true;
+}
+
+
+/** Allocate a block for a tree node near goal; returns 0 if there is none. */
+static a1fs_blk_t alloc_node(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t goal)
+{
+    a1fs_blk_t got;
+    long b = alloc_blocks(fs, goal, 1, &got);
+    if (b < 0) return 0;
+    in->block_count += 1;
+    return b;
+}
+
+static void free_node(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t blk)
+{
+    free_blocks(fs, blk, 1);
+    in->block_count -= 1;
+}
+
+/** Count the data blocks of an extent in (sign 1) or out of (sign -1) the counters. */
+static void account(fs_ctx *fs, a1fs_inode *in, const a1fs_ext_leaf *leaf, int sign)
+{
+    a1fs_blk_t pcount = ext_pcount(fs, leaf);
+    in->block_count += sign * pcount;
+    if (leaf->zinfo != 0) {
+        fs->sb->compr_logical += sign * leaf->ext.count;
+        fs->sb->compr_physical += sign * pcount;
+    }
+}
+
+/** Free the data blocks of (part of) an uncompressed extent. */
+static void free_data(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t start, a1fs_blk_t count)
+{
+    free_blocks(fs, start, count);
+    in->block_count -= count;
+}
+
+/** Free all data blocks of an extent. */
+static void free_leaf(fs_ctx *fs, a1fs_inode *in, const a1fs_ext_leaf *leaf)
+{
+    free_blocks(fs, leaf->ext.start, ext_pcount(fs, leaf));
+    account(fs, in, leaf, -1);
+}
+
+/** Move the root into a new block and make the root point to it. */
+static int grow(fs_ctx *fs, a1fs_inode *in)
+{
+    a1fs_ext_header *root = root_hdr(in);
+    if (root->depth + 1 > A1FS_EXT_MAX_DEPTH) return -ENOSPC;
+    a1fs_blk_t blk = alloc_node(fs, in, in->ext_last_leaf);
+    if (blk == 0) return -ENOSPC;
+
+    a1fs_ext_header *hdr = node_hdr(fs, blk);
+    memcpy(hdr, root, sizeof(*root) + root->entries * sizeof(a1fs_ext_entry));
+    hdr->max = A1FS_EXT_NODE_MAX(fs->block_size);
+
+    a1fs_ext_entry *e = entries(root);
+    e[0].index.lblk = root->entries ? entries(hdr)[0].leaf.lblk : 0;
+    e[0].index.child = blk;
+    memset(e[0].index.unused, 0, sizeof(e[0].index.unused));
+    root->entries = 1;
+    root->depth += 1;
+    return 0;
+}
+
+/** Insert an index entry for child right after the entry at path[level].idx. */
+static void insert_index(ext_path *path, int level, uint32_t lblk, a1fs_blk_t child)
+{
+    a1fs_ext_header *hdr = path[level].hdr;
+    a1fs_ext_entry *e = entries(hdr);
+    int pos = path[level].idx + 1;
+    memmove(&e[pos + 1], &e[pos], (hdr->entries - pos) * sizeof(*e));
+    e[pos].index.lblk = lblk;
+    e[pos].index.child = child;
+    memset(e[pos].index.unused, 0, sizeof(e[pos].index.unused));
+    hdr->entries += 1;
+}
+
+/**
+ * Split the node at path[level]; its parent must have room for one more entry.
+ *
+ * A leaf that is being appended to is not split in half: the new entry goes
+ * into a new empty leaf so that the leaves of files that only grow stay full.
+ */
+static int split(fs_ctx *fs, a1fs_inode *in, ext_path *path, int level, uint32_t lblk)
+{
+    a1fs_ext_header *hdr = path[level].hdr;
+    a1fs_ext_entry *e = entries(hdr);
+    bool append = hdr->depth == 0 && path[level].idx == hdr->entries - 1 && e[hdr->entries - 1].leaf.lblk < lblk;
+
+    a1fs_blk_t blk = alloc_node(fs, in, path[level].blk);
+    if (blk == 0) return -ENOSPC;
+    path_changed(fs, path, level);
+
+    int from = append ? hdr->entries : hdr->entries / 2;
+    a1fs_ext_header *new = node_hdr(fs, blk);
+    new->magic = A1FS_EXT_MAGIC;
+    new->max = A1FS_EXT_NODE_MAX(fs->block_size);
+    new->depth = hdr->depth;
+    new->entries = hdr->entries - from;
+    memcpy(entries(new), &e[from], new->entries * sizeof(*e));
+    hdr->entries = from;
+
+    insert_index(path, level - 1, append ? lblk : entries(new)[0].leaf.lblk, blk);
+    return 0;
+}
+
+int ext_insert(fs_ctx *fs, a1fs_inode *in, const a1fs_ext_leaf *leaf)
+{
+    ext_path path[A1FS_EXT_MAX_DEPTH + 1];
+    int depth;
+    for (;;) {
+        depth = find_path(fs, in, leaf->lblk, path);
+
+        //find the lowest level that has room; split the node below it
+        int level = depth;
+        while (level >= 0 && path[level].hdr->entries == path[level].hdr->max) level--;
+        if (level == depth) break;
+
+        int ret = level < 0 ? grow(fs, in) : split(fs, in, path, level + 1, leaf->lblk);
+        if (ret < 0) return ret;
+    }
+
+    path_changed(fs, path, depth);
+    a1fs_ext_header *hdr = path[depth].hdr;
+    a1fs_ext_entry *e = entries(hdr);
+    int pos = path[depth].idx + 1;
+    memmove(&e[pos + 1], &e[pos], (hdr->entries - pos) * sizeof(*e));
+    e[pos].leaf = *leaf;
+    hdr->entries += 1;
+
+    //a new first entry lowers the lblk of the index entries above it
+    for (int level = depth - 1; pos == 0 && level >= 0; level--) {
+        a1fs_ext_index *index = &entries(path[level].hdr)[path[level].idx].index;
+        if (index->lblk > leaf->lblk) index->lblk = leaf->lblk;
+        pos = path[level].idx;
+    }
+
+    in->extent_count += 1;
+    account(fs, in, leaf, 1);
+    update_last(fs, in);
+    return 0;
+}
+
+int ext_append(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t start, a1fs_blk_t count)
+{
+    a1fs_ext_header *hdr = in->ext_last_leaf ? node_hdr(fs, in->ext_last_leaf) : root_hdr(in);
+    if (hdr->entries > 0) {
+        a1fs_ext_leaf *last = &entries(hdr)[hdr->entries - 1].leaf;
+        if (last->zinfo == 0 && last->ext.start + last->ext.count == start) {
+            if (in->ext_last_leaf != 0) fs_data_changed(fs, in->ext_last_leaf, 1);
+            last->ext.count += count;
+            in->block_count += count;
+            return 0;
+        }
+    }
+
+    a1fs_ext_leaf leaf = { .lblk = ext_nblocks(fs, in), .ext = { start, count }, .zinfo = 0 };
+    return ext_insert(fs, in, &leaf);
+}
+
+int ext_set(fs_ctx *fs, a1fs_inode *in, const a1fs_ext_leaf *leaf)
+{
+    a1fs_ext_leaf *old = find_leaf(fs, in, leaf->lblk, true);
+    if (old == NULL || old->lblk != leaf->lblk) return -ENOENT;
+
+    free_leaf(fs, in, old);
+    *old = *leaf;
+    account(fs, in, leaf, 1);
+    return 0;
+}
+
+int ext_remap(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t lblk, a1fs_blk_t count, a1fs_blk_t start)
+{
+    a1fs_ext_leaf *leaf = find_leaf(fs, in, lblk, true);
+    assert(leaf != NULL && leaf->zinfo == 0 && lblk + count <= leaf->lblk + leaf->ext.count);
+    a1fs_ext_leaf old = *leaf;
+    a1fs_blk_t head = lblk - old.lblk;
+    a1fs_blk_t tail = old.lblk + old.ext.count - (lblk + count);
+
+    //each of the two inserts can split a node on every level and grow the
+    //tree; checking for that up front means that a half-done split never has
+    //to be undone
+    int depth = root_hdr(in)->depth;
+    if (depth + 2 > A1FS_EXT_MAX_DEPTH ||
+        alloc_block_limit(fs) - fs->sb->used_block_count < 2 * (a1fs_blk_t)(depth + 2))
+    {
+        return -ENOSPC;
+    }
+
+    //the new entries go after the old one, which is shrunk last; the leaf
+    //pointer is stale once an entry has been inserted
+    if (tail > 0) {
+        a1fs_ext_leaf right = { .lblk = lblk + count, .ext = { old.ext.start + head + count, tail }, .zinfo = 0 };
+        if (ext_insert(fs, in, &right) < 0) return -ENOSPC;
+    }
+    if (head > 0) {
+        a1fs_ext_leaf middle = { .lblk = lblk, .ext = { start, count }, .zinfo = 0 };
+        if (ext_insert(fs, in, &middle) < 0) return -ENOSPC;
+        find_leaf(fs, in, old.lblk, true)->ext.count = head;
+    } else {
+        leaf = find_leaf(fs, in, lblk, true);
+        leaf->ext.start = start;
+        leaf->ext.count = count;
+    }
+    //the inserted entries were counted as new data blocks
+    in->block_count -= tail + (head > 0 ? count : 0);
+    return 0;
+}
+
+
+/** Remove the entry at path[level].idx, freeing nodes that become empty. */
+static void remove_entry(fs_ctx *fs, a1fs_inode *in, ext_path *path, int level)
+{
+    a1fs_ext_header *hdr = path[level].hdr;
+    a1fs_ext_entry *e = entries(hdr);
+    int pos = path[level].idx;
+    path_changed(fs, path, level);
+    memmove(&e[pos], &e[pos + 1], (hdr->entries - pos - 1) * sizeof(*e));
+    hdr->entries -= 1;
+
+    if (level == 0) {
+        //an empty root is an empty leaf
+        if (hdr->entries == 0) hdr->depth = 0;
+        return;
+    }
+    if (hdr->entries == 0) {
+        free_node(fs, in, path[level].blk);
+        remove_entry(fs, in, path, level - 1);
+    } else if (pos == 0) {
+        entries(path[level - 1].hdr)[path[level - 1].idx].index.lblk = e[0].leaf.lblk;
+    }
+}
+
+/** Merge the rightmost node of a level into its left sibling if it fits. */
+static bool merge_right(fs_ctx *fs, a1fs_inode *in)
+{
+    ext_path path[A1FS_EXT_MAX_DEPTH + 1];
+    int depth = find_path(fs, in, UINT32_MAX, path);
+    for (int level = depth; level > 0; level--) {
+        ext_path *parent = &path[level - 1];
+        if (parent->idx == 0) continue;
+
+        a1fs_ext_header *right = path[level].hdr;
+        a1fs_ext_header *left = node_hdr(fs, entries(parent->hdr)[parent->idx - 1].index.child);
+        if (left->entries + right->entries > left->max) continue;
+
+        fs_data_changed(fs, entries(parent->hdr)[parent->idx - 1].index.child, 1);
+        memcpy(&entries(left)[left->entries], entries(right), right->entries * sizeof(a1fs_ext_entry));
+        left->entries += right->entries;
+        right->entries = 0;
+        free_node(fs, in, path[level].blk);
+        remove_entry(fs, in, path, level - 1);
+        return true;
+    }
+    return false;
+}
+
+/** Pull the only child of the root into the root while it fits. */
+static void shrink_root(fs_ctx *fs, a1fs_inode *in)
+{
+    a1fs_ext_header *root = root_hdr(in);
+    while (root->depth > 0 && root->entries == 1) {
+        a1fs_blk_t blk = entries(root)[0].index.child;
+        a1fs_ext_header *child = node_hdr(fs, blk);
+        if (child->entries > A1FS_EXT_ROOT_MAX) break;
+
+        memcpy(entries(root), entries(child), child->entries * sizeof(a1fs_ext_entry));
+        root->entries = child->entries;
+        root->depth = child->depth;
+        free_node(fs, in, blk);
+    }
+}
+
+/** Unmap the logical blocks from nblocks onwards; their data blocks are freed if free. */
+static void unmap_from(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t nblocks, bool free)
+{
+    ext_path path[A1FS_EXT_MAX_DEPTH + 1];
+    for (;;) {
+        int depth = find_path(fs, in, UINT32_MAX, path);
+        if (path[depth].idx < 0) break;
+
+        a1fs_ext_leaf *leaf = &entries(path[depth].hdr)[path[depth].idx].leaf;
+        if (leaf->lblk >= nblocks) {
+            if (free) {
+                free_leaf(fs, in, leaf);
+            } else {
+                account(fs, in, leaf, -1);
+            }
+            remove_entry(fs, in, path, depth);
+            in->extent_count -= 1;
+            continue;
+        }
+        if (leaf->lblk + leaf->ext.count > nblocks) {
+            path_changed(fs, path, depth);
+            a1fs_blk_t keep = nblocks - leaf->lblk;
+            if (leaf->zinfo == 0) {
+                if (free) {
+                    free_data(fs, in, leaf->ext.start + keep, leaf->ext.count - keep);
+                } else {
+                    in->block_count -= leaf->ext.count - keep;
+                }
+            } else {
+                //the compressed data stays as it is; it still decompresses fine
+                fs->sb->compr_logical -= leaf->ext.count - keep;
+            }
+            leaf->ext.count = keep;
+        }
+        break;
+    }
+
+    while (merge_right(fs, in)) {}
+    shrink_root(fs, in);
+    update_last(fs, in);
+}
+
+void ext_truncate(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t nblocks)
+{
+    unmap_from(fs, in, nblocks, true);
+}
+
+void ext_detach(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t nblocks)
+{
+    unmap_from(fs, in, nblocks, false);
+}
+
+
+static void for_each_node(fs_ctx *fs, a1fs_ext_header *hdr,
+                          void (*fn)(fs_ctx *fs, a1fs_blk_t blk, void *arg), void *arg)
+{
+    if (hdr->depth == 0) return;
+    for (int i = 0; i < hdr->entries; i++) {
+        a1fs_blk_t child = entries(hdr)[i].index.child;
+        for_each_node(fs, node_hdr(fs, child), fn, arg);
+        fn(fs, child, arg);
+    }
+}
+
+void ext_for_each_node(fs_ctx *fs, const a1fs_inode *in,
+                       void (*fn)(fs_ctx *fs, a1fs_blk_t blk, void *arg), void *arg)
+{
+    for_each_node(fs, root_hdr(in), fn, arg);
+}
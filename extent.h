@@ -0,0 +1,131 @@
+/**
+ * CSC369 Assignment 1 - Extent tree header file.
+ *
+ * See the description of the on-disk format in a1fs.h. All functions keep the
+ * inode's extent_count, ext_last_leaf and block_count fields up to date;
+ * block_count includes both data blocks and extent tree node blocks. The
+ * superblock's compressed block counters are kept up to date as well.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Maximum depth of an extent tree. */
+#define A1FS_EXT_MAX_DEPTH 5
+
+
+/** Initialize an empty extent tree in an inode. */
+void ext_init(a1fs_inode *in);
+
+/**
+ * Get the last extent of a file. O(1).
+ *
+ * @param fs    file system context.
+ * @param in    inode.
+ * @param last  receives the last extent.
+ * @return      true on success; false if the file has no blocks.
+ */
+bool ext_last(fs_ctx *fs, const a1fs_inode *in, a1fs_ext_leaf *last);
+
+/** Get the number of logical blocks mapped by a file. O(1). */
+a1fs_blk_t ext_nblocks(fs_ctx *fs, const a1fs_inode *in);
+
+/** Get the number of data blocks used by an extent. */
+a1fs_blk_t ext_pcount(fs_ctx *fs, const a1fs_ext_leaf *leaf);
+
+/**
+ * Find the extent that maps a logical block of a file. O(log n).
+ *
+ * @param fs    file system context.
+ * @param in    inode.
+ * @param lblk  logical block number.
+ * @param leaf  receives the extent.
+ * @return      true on success; false if lblk is not mapped.
+ */
+bool ext_find(fs_ctx *fs, const a1fs_inode *in, a1fs_blk_t lblk, a1fs_ext_leaf *leaf);
+
+/**
+ * Map a logical block of a file to a data block. O(log n).
+ *
+ * @param fs    file system context.
+ * @param in    inode.
+ * @param lblk  logical block number.
+ * @param pblk  receives the data block number.
+ * @param run   receives the number of contiguous blocks from pblk onwards
+ *              that belong to the same extent; can be NULL.
+ * @return      true on success; false if lblk is not mapped or is in a
+ *              compressed extent.
+ */
+bool ext_map(fs_ctx *fs, const a1fs_inode *in, a1fs_blk_t lblk, a1fs_blk_t *pblk, a1fs_blk_t *run);
+
+/**
+ * Insert an extent for a logical range that is not mapped yet.
+ *
+ * Splits full nodes on the way and grows the tree if the root is full.
+ *
+ * @return  0 on success; -ENOSPC if there is no free block for a new node.
+ */
+int ext_insert(fs_ctx *fs, a1fs_inode *in, const a1fs_ext_leaf *leaf);
+
+/**
+ * Map count data blocks starting at start after the last block of a file.
+ *
+ * Extends the last extent instead of adding a new one if the blocks follow
+ * it on disk and it is not compressed.
+ *
+ * @return  0 on success; -ENOSPC if there is no free block for a new node.
+ */
+int ext_append(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t start, a1fs_blk_t count);
+
+/**
+ * Replace the data blocks of an extent.
+ *
+ * The extent that starts at leaf->lblk gets the data blocks and compression
+ * info of leaf; its old data blocks are freed. Only the last extent of a file
+ * can change its ext.count.
+ *
+ * @return  0 on success; -ENOENT if no extent starts at leaf->lblk.
+ */
+int ext_set(fs_ctx *fs, a1fs_inode *in, const a1fs_ext_leaf *leaf);
+
+/**
+ * Map a range of logical blocks to other data blocks.
+ *
+ * The range must lie within one uncompressed extent, which is split into up
+ * to three. The old data blocks of the range are not freed.
+ *
+ * @param fs     file system context.
+ * @param in     inode.
+ * @param lblk   first logical block of the range.
+ * @param count  number of blocks in the range.
+ * @param start  first of the data blocks the range is mapped to.
+ * @return       0 on success; -ENOSPC if there may not be enough free blocks
+ *               for the new tree nodes (nothing is changed then).
+ */
+int ext_remap(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t lblk, a1fs_blk_t count, a1fs_blk_t start);
+
+/**
+ * Unmap and free all logical blocks of a file from nblocks onwards.
+ *
+ * Frees the tree nodes that become empty, merges the rightmost nodes with
+ * their left siblings when they fit and shrinks the tree when the root can
+ * hold the whole next level.
+ */
+void ext_truncate(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t nblocks);
+
+/**
+ * Unmap all logical blocks of a file from nblocks onwards like ext_truncate(),
+ * but without freeing their data blocks, which must have been handed over to
+ * another inode. The data of a compressed extent that nblocks falls into
+ * stays with the file.
+ */
+void ext_detach(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t nblocks);
+
+/** Call fn for every extent tree node block of a file (not the root). */
+void ext_for_each_node(fs_ctx *fs, const a1fs_inode *in,
+                       void (*fn)(fs_ctx *fs, a1fs_blk_t blk, void *arg), void *arg);
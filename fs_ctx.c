@@ -2,8 +2,41 @@
  * CSC369 Assignment 1 - File system runtime context implementation.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "fs_ctx.h"
+#include "map.h"
+#include "memops.h"
+#include "util.h"
+
+/** Number of inodes in one inode table block. */
+#define INODES_PER_BLOCK(fs) ((fs)->block_size / sizeof(a1fs_inode))
+/** Number of inode table blocks the background thread zeroes at a time. */
+#define ITABLE_INIT_BATCH 16
+
+
+/** Number of data blocks tracked by the block bitmap; see alloc_block_limit(). */
+static unsigned int block_limit(fs_ctx *fs)
+{
+    return fs->sb->block_count < fs->block_size ? fs->sb->block_count : fs->block_size;
+}
 
+/** Number of inodes tracked by the inode bitmap; see alloc_inode_limit(). */
+static unsigned int inode_limit(fs_ctx *fs)
+{
+    return fs->sb->inode_count < fs->block_size ? fs->sb->inode_count : fs->block_size;
+}
+
+/** Number of data blocks in each region of the free-space summary. */
+static unsigned int region_blocks(fs_ctx *fs)
+{
+    unsigned int n = (block_limit(fs) + A1FS_SUMMARY_REGIONS - 1) / A1FS_SUMMARY_REGIONS;
+    return n > 0 ? n : 1;
+}
 
 bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
 {
@@ -14,14 +47,333 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
     fs->sb = (struct a1fs_superblock *)(image + A1FS_BLOCK_SIZE);
     if (fs->sb->magic != A1FS_MAGIC)
         return false;
-    fs->ibitmap = (struct a1fs_ibitmap *)(image + A1FS_BLOCK_SIZE*2); //block 2
-    fs->bbitmap = (struct a1fs_bbitmap *)(image + A1FS_BLOCK_SIZE*3);   //block 3
-    fs->itable = (struct a1fs_inode *)(image + A1FS_BLOCK_SIZE*4);  //block 4
-    fs->btable = (struct a1fs_dentry *)(image + A1FS_BLOCK_SIZE*fs->sb->block_table);
+
+    //the superblock is at the same offset for every block size
+    if (fs->sb->log_block_size > A1FS_LOG_BLOCK_SIZE_MAX)
+        return false;
+    fs->block_size = A1FS_BLOCK_SIZE << fs->sb->log_block_size;
+    fs->block_shift = __builtin_ctz(fs->block_size);
+    fs->ops = blkops_get(fs->block_size);
+    if (fs->ops == NULL || size % fs->block_size != 0)
+        return false;
+
+    fs->ibitmap = fs_block(fs, fs->sb->inode_bitmap);
+    fs->bbitmap = fs_block(fs, fs->sb->block_bitmap);
+    fs->itable = fs_block(fs, fs->sb->inode_table);
+    fs->btable = fs_block(fs, fs->sb->block_table);
+    fs->cbt = fs->sb->features & A1FS_FEATURE_CBT ? fs_block(fs, fs->sb->cbt_table) : NULL;
+
+    fs->members[0] = image;
+    fs->member_size[0] = size;
+    fs->n_members = 1;
+    fs->stripe_count = 1;
+    fs->stripe_shift = 0;
+    if (fs->sb->features & A1FS_FEATURE_STRIPE) {
+        if (fs->sb->stripe_count < 2 || fs->sb->stripe_count > A1FS_STRIPE_MAX ||
+            fs->sb->stripe_log_chunk > 16)
+        {
+            return false;
+        }
+        fs->stripe_count = fs->sb->stripe_count;
+        fs->stripe_shift = fs->sb->stripe_log_chunk;
+    }
+
+    pthread_mutex_init(&fs->itable_lock, NULL);
+    fs->itable_thread_running = false;
+    fs->itable_stop = false;
+    pthread_mutex_init(&fs->lock, NULL);
+    pthread_cond_init(&fs->reclaim_wake, NULL);
+    fs->reclaim_running = false;
+    fs->reclaim_quit = false;
+    for (unsigned int m = 0; m < A1FS_STRIPE_MAX; m++) fs->discard_fd[m] = -1;
+    fs->discard = false;
+    fs->discard_count = 0;
+    fs->zcache = NULL;
+    fs->lazytime = NULL;
+    fs->map_flags = 0;
+    fs->tlb_fd = -1;
+    fs->read_only = false;
+    fs->mounted = false;
+
+    // after a clean unmount the stored summary is exact; otherwise (or if it
+    // disagrees with the superblock) it has to be rebuilt from the bitmaps
+    const a1fs_summary *stored = image;
+    fs->summary_rebuilt = !(fs->sb->state & A1FS_STATE_CLEAN) ||
+                          stored->magic != A1FS_SUMMARY_MAGIC ||
+                          stored->used_blocks != fs->sb->used_block_count ||
+                          stored->used_inodes != fs->sb->used_inode_count ||
+                          stored->region_blocks != region_blocks(fs);
+    if (fs->summary_rebuilt) {
+        fs_ctx_summary_build(fs, &fs->summary);
+    } else {
+        fs->summary = *stored;
+    }
     return true;
 }
 
+void fs_ctx_mount(fs_ctx *fs)
+{
+    if (fs->summary_rebuilt) {
+        fs->sb->used_block_count = fs->summary.used_blocks;
+        fs->sb->used_inode_count = fs->summary.used_inodes;
+    }
+    fs->sb->state &= ~A1FS_STATE_CLEAN;
+    fs->mounted = true;
+}
+
 void fs_ctx_destroy(fs_ctx *fs)
 {
-    (void)fs;
+    if (fs->itable_thread_running) {
+        pthread_mutex_lock(&fs->itable_lock);
+        fs->itable_stop = true;
+        pthread_mutex_unlock(&fs->itable_lock);
+        pthread_join(fs->itable_thread, NULL);
+        fs->itable_thread_running = false;
+    }
+    pthread_mutex_destroy(&fs->itable_lock);
+    pthread_cond_destroy(&fs->reclaim_wake);
+    pthread_mutex_destroy(&fs->lock);
+    free(fs->zcache);
+    if (fs->tlb_fd >= 0) close(fs->tlb_fd);
+    for (unsigned int m = 0; m < A1FS_STRIPE_MAX; m++) {
+        if (fs->discard_fd[m] >= 0) close(fs->discard_fd[m]);
+        fs->discard_fd[m] = -1;
+    }
+
+    if (fs->mounted) {
+        fs_ctx_summary_build(fs, &fs->summary);
+        memcpy(fs->image, &fs->summary, sizeof(fs->summary));
+        fs->sb->state |= A1FS_STATE_CLEAN;
+        fs->mounted = false;
+    }
+    for (unsigned int m = 1; m < fs->n_members; m++) munmap(fs->members[m], fs->member_size[m]);
+    fs->n_members = 1;
+}
+
+bool fs_ctx_map_members(fs_ctx *fs, char *const paths[], unsigned int n, bool writable, int flags)
+{
+    if (n > 0 && fs->stripe_count == 1) {
+        fprintf(stderr, "The file system is not striped\n");
+        return false;
+    }
+    if (n != fs->stripe_count - 1) {
+        fprintf(stderr, "The file system is striped over %u images, %u given\n",
+                fs->stripe_count, n + 1);
+        return false;
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        size_t size;
+        void *image = writable ? map_file_flags(paths[i], fs->block_size, &size, flags)
+                               : map_file_readonly(paths[i], fs->block_size, &size);
+        if (image == NULL) return false;
+
+        const a1fs_stripe_hdr *hdr = image;
+        if (hdr->magic != A1FS_STRIPE_MAGIC || hdr->id != fs->sb->stripe_id ||
+            hdr->index != fs->n_members || hdr->count != fs->stripe_count)
+        {
+            fprintf(stderr, "%s: not image %u of the stripe set\n", paths[i], fs->n_members + 1);
+            munmap(image, size);
+            return false;
+        }
+        fs->members[fs->n_members] = image;
+        fs->member_size[fs->n_members] = size;
+        fs->n_members++;
+    }
+
+    if (fs->stripe_count > 1 && fs_ctx_data_capacity(fs) < block_limit(fs)) {
+        fprintf(stderr, "The images are too small for the file system\n");
+        return false;
+    }
+    return true;
+}
+
+a1fs_blk_t fs_ctx_data_capacity(fs_ctx *fs)
+{
+    size_t first = fs->size >> fs->block_shift;
+    first = first > fs->sb->block_table ? first - fs->sb->block_table : 0;
+    if (fs->stripe_count == 1) return first < UINT32_MAX ? first : UINT32_MAX;
+    if (fs->n_members < fs->stripe_count) return 0;
+
+    // only whole rows of chunks (one in each image) are used
+    size_t rows = first >> fs->stripe_shift;
+    for (unsigned int m = 1; m < fs->n_members; m++) {
+        size_t blocks = fs->member_size[m] >> fs->block_shift;
+        size_t n = blocks > 1 ? (blocks - 1) >> fs->stripe_shift : 0;
+        if (n < rows) rows = n;
+    }
+    size_t cap = (rows * fs->stripe_count) << fs->stripe_shift;
+    return cap < UINT32_MAX ? cap : UINT32_MAX;
+}
+
+a1fs_blk_t fs_data_block_num(fs_ctx *fs, const void *p)
+{
+    unsigned int m = 0;
+    while (m + 1 < fs->n_members && !(p >= fs->members[m] && p < fs->members[m] + fs->member_size[m])) m++;
+    size_t blk = (size_t)(p - fs->members[m]) >> fs->block_shift;
+    blk -= m == 0 ? fs->sb->block_table : 1;
+    if (fs->stripe_count == 1) return blk;
+
+    size_t row = blk >> fs->stripe_shift;
+    size_t chunk = row * fs->stripe_count + m;
+    return (chunk << fs->stripe_shift) + (blk & ((1u << fs->stripe_shift) - 1));
+}
+
+void fs_data_copy(fs_ctx *fs, a1fs_blk_t dst, a1fs_blk_t src, a1fs_blk_t n)
+{
+    fs_data_changed(fs, dst, n);
+    while (n > 0) {
+        a1fs_blk_t k = fs_data_run(fs, src, fs_data_run(fs, dst, n));
+        mem_copy(fs_data_block(fs, dst), fs_data_block(fs, src), (size_t)k << fs->block_shift);
+        dst += k;
+        src += k;
+        n -= k;
+    }
+}
+
+void fs_data_zero(fs_ctx *fs, a1fs_blk_t b, a1fs_blk_t n)
+{
+    fs_data_changed(fs, b, n);
+    while (n > 0) {
+        a1fs_blk_t k = fs_data_run(fs, b, n);
+        mem_zero(fs_data_block(fs, b), (size_t)k << fs->block_shift);
+        b += k;
+        n -= k;
+    }
+}
+
+void fs_data_load(fs_ctx *fs, void *buf, a1fs_blk_t b, size_t len)
+{
+    while (len > 0) {
+        size_t n = (size_t)fs_data_run(fs, b, fs_blocks(fs, len)) << fs->block_shift;
+        if (n > len) n = len;
+        memcpy(buf, fs_data_block(fs, b), n);
+        buf += n;
+        b += n >> fs->block_shift;
+        len -= n;
+    }
+}
+
+void fs_data_store(fs_ctx *fs, a1fs_blk_t b, const void *buf, size_t len)
+{
+    fs_data_changed(fs, b, fs_blocks(fs, len));
+    while (len > 0) {
+        size_t n = (size_t)fs_data_run(fs, b, fs_blocks(fs, len)) << fs->block_shift;
+        void *dst = fs_data_block(fs, b);
+        if (n > len) {
+            memset(dst + len, 0, n - len);
+            n = len;
+        }
+        memcpy(dst, buf, n);
+        buf += n;
+        b += n >> fs->block_shift;
+        len -= n;
+    }
+}
+
+void fs_ctx_summary_build(fs_ctx *fs, a1fs_summary *sum)
+{
+    memset(sum, 0, sizeof(*sum));
+    sum->magic = A1FS_SUMMARY_MAGIC;
+    sum->region_blocks = region_blocks(fs);
+
+    unsigned int run = 0;
+    unsigned int limit = block_limit(fs);
+    for (unsigned int b = 0; b <= limit; b++) {
+        if (b < limit && fs->bbitmap->map[b] == 0) {
+            sum->region_free[b / sum->region_blocks]++;
+            run++;
+            continue;
+        }
+        if (b < limit) sum->used_blocks++;
+        if (run > 0) {
+            unsigned int class = 31 - __builtin_clz(run);
+            if (class >= A1FS_SUMMARY_RUN_CLASSES) class = A1FS_SUMMARY_RUN_CLASSES - 1;
+            sum->runs[class]++;
+            run = 0;
+        }
+    }
+    for (unsigned int i = 0; i < inode_limit(fs); i++) {
+        if (fs->ibitmap->map[i]) sum->used_inodes++;
+    }
+}
+
+
+/** Number of blocks in the inode table. */
+static unsigned int itable_blocks(fs_ctx *fs)
+{
+    return fs->sb->block_table - fs->sb->inode_table;
+}
+
+/**
+ * Zero the next uninitialized inode table block. Must hold itable_lock.
+ *
+ * A block that holds an in-use inode is never zeroed, even if the superblock
+ * says that it has not been initialized yet.
+ */
+static void itable_init_next(fs_ctx *fs)
+{
+    a1fs_superblock *sb = fs->sb;
+    if (!fs->ops->itable_block_used(fs->ibitmap, sb->itable_init)) {
+        memset(fs_block(fs, sb->inode_table + sb->itable_init), 0, fs->block_size);
+    }
+
+    sb->itable_init++;
+    if (sb->itable_init == itable_blocks(fs)) sb->features &= ~A1FS_FEATURE_LAZY_ITABLE;
+}
+
+static void *itable_init_thread(void *arg)
+{
+    fs_ctx *fs = (fs_ctx*)arg;
+    for (;;) {
+        pthread_mutex_lock(&fs->itable_lock);
+        for (int i = 0; i < ITABLE_INIT_BATCH && !fs->itable_stop &&
+                        (fs->sb->features & A1FS_FEATURE_LAZY_ITABLE); i++)
+        {
+            itable_init_next(fs);
+        }
+        bool done = fs->itable_stop || !(fs->sb->features & A1FS_FEATURE_LAZY_ITABLE);
+        pthread_mutex_unlock(&fs->itable_lock);
+        if (done) return NULL;
+    }
+}
+
+bool fs_ctx_start_itable_init(fs_ctx *fs)
+{
+    if (!(fs->sb->features & A1FS_FEATURE_LAZY_ITABLE)) return true;
+    if (pthread_create(&fs->itable_thread, NULL, itable_init_thread, fs) != 0) return false;
+    fs->itable_thread_running = true;
+    return true;
+}
+
+void fs_ctx_itable_prepare(fs_ctx *fs, a1fs_ino_t ino)
+{
+    if (!(fs->sb->features & A1FS_FEATURE_LAZY_ITABLE)) return;
+
+    unsigned int block = ino / INODES_PER_BLOCK(fs);
+    pthread_mutex_lock(&fs->itable_lock);
+    while ((fs->sb->features & A1FS_FEATURE_LAZY_ITABLE) && fs->sb->itable_init <= block) {
+        itable_init_next(fs);
+    }
+    pthread_mutex_unlock(&fs->itable_lock);
+}
+
+bool fs_ctx_sync(fs_ctx *fs, void *addr, size_t len)
+{
+    // the images are mapped at block aligned addresses
+    size_t start = (size_t)addr & ~((size_t)fs->block_size - 1);
+    size_t end = align_up((size_t)addr + len, fs->block_size);
+    return msync((void*)start, end - start, MS_SYNC) == 0;
+}
+
+bool fs_ctx_sync_data(fs_ctx *fs, a1fs_blk_t b, a1fs_blk_t count)
+{
+    bool ok = true;
+    while (count > 0) {
+        a1fs_blk_t k = fs_data_run(fs, b, count);
+        ok &= fs_ctx_sync(fs, fs_data_block(fs, b), (size_t)k << fs->block_shift);
+        b += k;
+        count -= k;
+    }
+    return ok;
 }
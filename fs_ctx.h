@@ -4,17 +4,19 @@
 
 #pragma once
 
+#include <pthread.h>
 #include <stddef.h>
 
 #include "options.h"
 
 #include "a1fs.h"
+#include "blkops.h"
 
 /**
  * Mounted file system runtime state - "fs context".
  */
 typedef struct fs_ctx {
-    /** Pointer to the start of the image. */
+    /** Pointer to the start of the image (and of the on-disk free-space summary). */
     void *image;
     /** Image size in bytes. */
     size_t size;
@@ -24,21 +26,252 @@ typedef struct fs_ctx {
     struct a1fs_bbitmap *bbitmap;
     struct a1fs_inode *itable;
     struct a1fs_dentry *btable;
+
+    /**
+     * Image files that the data region is striped over; members[0] is image.
+     * stripe_count is 1 if the file system is not striped.
+     */
+    void *members[A1FS_STRIPE_MAX];
+    size_t member_size[A1FS_STRIPE_MAX];
+    unsigned int stripe_count;
+    /** Number of members mapped so far (see fs_ctx_map_members()). */
+    unsigned int n_members;
+    /** log2 of the stripe chunk size in blocks. */
+    unsigned int stripe_shift;
+
+    /** Block size of the image in bytes; always a power of 2. */
+    unsigned int block_size;
+    /** log2(block_size). */
+    unsigned int block_shift;
+    /** Operations specialized for the block size. */
+    const a1fs_blkops *ops;
+    /** Cache of decompressed clusters (see compress.c); NULL until first used. */
+    struct zcache *zcache;
+    /** Deferred timestamp updates (see lazytime.h); NULL unless enabled. */
+    struct lazytime *lazytime;
+    /** A1FS_MAP_* options the image is mapped with. */
+    unsigned int map_flags;
+    /** Data TLB miss counter (see map.h); -1 if not available. */
+    int tlb_fd;
+    /**
+     * Free-space summary. Only region_free is kept up to date by the
+     * allocator; the rest is recomputed when the summary is stored.
+     */
+    a1fs_summary summary;
+    /** The summary was rebuilt from the bitmaps because the last unmount was not clean. */
+    bool summary_rebuilt;
+    /** fs_ctx_mount() was called; the summary is stored on destroy. */
+    bool mounted;
+    /** A snapshot is mounted; the file system must not be modified. */
+    bool read_only;
+
+    /** Background zeroing of the uninitialized part of the inode table. */
+    pthread_t itable_thread;
+    /** Protects sb->itable_init and the blocks past it. */
+    pthread_mutex_t itable_lock;
+    bool itable_thread_running;
+    bool itable_stop;
+
+    /**
+     * Held by the callbacks that modify the file system and by the background
+     * reclaimer while it frees a batch of blocks (see reclaim.h).
+     */
+    pthread_mutex_t lock;
+    pthread_t reclaim_thread;
+    /** Signalled when an inode is put on the orphan list or the reclaimer should quit. */
+    pthread_cond_t reclaim_wake;
+    bool reclaim_running;
+    bool reclaim_quit;
+
+    /**
+     * Generation in which each data block was last modified (see
+     * A1FS_FEATURE_CBT); NULL if the image does not keep track.
+     */
+    uint32_t *cbt;
+
+    /** Image files opened by discard_open(), in stripe order; -1 if not open. */
+    int discard_fd[A1FS_STRIPE_MAX];
+    /** Discard blocks as they are freed (see discard.h). */
+    bool discard;
+    /** FUSE connection options of the mount (see a1fs_start()). */
+    bool writeback_cache;
+    bool readdirplus;
+    /** Largest read or write request in bytes. */
+    unsigned int max_io;
+    /** Freed blocks that have not been discarded yet. */
+    a1fs_blk_t discard_start;
+    a1fs_blk_t discard_count;
 } fs_ctx;
 
+/** Get a pointer to a block of the image. */
+static inline void *fs_block(fs_ctx *fs, size_t b)
+{
+    return fs->image + (b << fs->block_shift);
+}
+
+/** Get a pointer to a block in the data region. */
+static inline void *fs_data_block(fs_ctx *fs, a1fs_blk_t b)
+{
+    if (fs->stripe_count == 1) return fs_block(fs, (size_t)fs->sb->block_table + b);
+
+    a1fs_blk_t chunk = b >> fs->stripe_shift;
+    unsigned int m = chunk % fs->stripe_count;
+    size_t blk = ((size_t)(chunk / fs->stripe_count) << fs->stripe_shift) +
+                 (b & ((1u << fs->stripe_shift) - 1));
+    blk += m == 0 ? fs->sb->block_table : 1;
+    return fs->members[m] + (blk << fs->block_shift);
+}
+
+/**
+ * Get the number of data blocks from b on (at most n) that are next to each
+ * other in memory. Less than n only if b + n crosses a stripe chunk boundary.
+ */
+static inline a1fs_blk_t fs_data_run(const fs_ctx *fs, a1fs_blk_t b, a1fs_blk_t n)
+{
+    if (fs->stripe_count == 1) return n;
+    a1fs_blk_t left = (1u << fs->stripe_shift) - (b & ((1u << fs->stripe_shift) - 1));
+    return n < left ? n : left;
+}
+
+/**
+ * Record that n data blocks from b on are being modified, so that they go into
+ * the next incremental dump. Blocks that are allocated or written through
+ * fs_data_copy(), fs_data_zero() and fs_data_store() are recorded already.
+ */
+static inline void fs_data_changed(fs_ctx *fs, a1fs_blk_t b, a1fs_blk_t n)
+{
+    if (fs->cbt == NULL) return;
+    for (a1fs_blk_t i = 0; i < n; i++) fs->cbt[b + i] = fs->sb->cbt_gen;
+}
+
+/** Get the number of blocks needed to hold size bytes. */
+static inline uint64_t fs_blocks(const fs_ctx *fs, uint64_t size)
+{
+    return (size + fs->block_size - 1) >> fs->block_shift;
+}
+
+/** Get the offset of byte pos within its block. */
+static inline size_t fs_block_offset(const fs_ctx *fs, uint64_t pos)
+{
+    return pos & (fs->block_size - 1);
+}
+
 /**
  * Initialize file system context.
  *
  * @param fs     pointer to the context to initialize.
  * @param image  pointer to the start of the image.
  * @param size   image size in bytes.
- * @return       true on success; false on failure (e.g. invalid superblock).
+ * @return       true on success; false on failure (e.g. invalid superblock
+ *               or unsupported block size).
  */
 bool fs_ctx_init(fs_ctx *fs, void *image, size_t size);
 
+/**
+ * Map the other image files of a striped file system.
+ *
+ * Must be called after fs_ctx_init(), also with no paths, which only checks
+ * that the file system is not striped. The members are unmapped by
+ * fs_ctx_destroy().
+ *
+ * @param fs        file system context.
+ * @param paths     image files in stripe order, without the first one.
+ * @param n         number of paths.
+ * @param writable  map the images for writing; flags are ignored if not.
+ * @param flags     mapping flags; see map_file_flags().
+ * @return          true on success; false (after printing an error) if an
+ *                  image cannot be mapped, is not the next member of the
+ *                  stripe set, or there are too few or too many of them.
+ */
+bool fs_ctx_map_members(fs_ctx *fs, char *const paths[], unsigned int n, bool writable, int flags);
+
+/**
+ * Get the number of data blocks that the mapped images have room for, counted
+ * from the start of the data region.
+ */
+a1fs_blk_t fs_ctx_data_capacity(fs_ctx *fs);
+
+/** Get the number of the data block that p points into; the inverse of fs_data_block(). */
+a1fs_blk_t fs_data_block_num(fs_ctx *fs, const void *p);
+
+/** Copy n data blocks from src to dst; the ranges must not overlap. */
+void fs_data_copy(fs_ctx *fs, a1fs_blk_t dst, a1fs_blk_t src, a1fs_blk_t n);
+
+/** Zero n data blocks. */
+void fs_data_zero(fs_ctx *fs, a1fs_blk_t b, a1fs_blk_t n);
+
+/** Copy len bytes from the data blocks starting at b into buf. */
+void fs_data_load(fs_ctx *fs, void *buf, a1fs_blk_t b, size_t len);
+
+/**
+ * Copy len bytes from buf into the data blocks starting at b; the rest of the
+ * last block is zeroed.
+ */
+void fs_data_store(fs_ctx *fs, a1fs_blk_t b, const void *buf, size_t len);
+
 /**
  * Destroy file system context.
  *
- * Must cleanup all the resources created in fs_ctx_init().
+ * Must cleanup all the resources created in fs_ctx_init(). Must be called
+ * before the image is unmapped, and after reclaim_stop(). Stores the free-space summary and marks the
+ * file system clean if it was mounted with fs_ctx_mount().
  */
 void fs_ctx_destroy(fs_ctx *fs);
+
+/**
+ * Start modifying the file system.
+ *
+ * Fixes the superblock counters if the summary had to be rebuilt, and clears
+ * A1FS_STATE_CLEAN until fs_ctx_destroy().
+ */
+void fs_ctx_mount(fs_ctx *fs);
+
+/**
+ * Compute the free-space summary from the bitmaps.
+ *
+ * Takes time proportional to the number of blocks.
+ */
+void fs_ctx_summary_build(fs_ctx *fs, a1fs_summary *sum);
+
+/**
+ * Start zeroing the uninitialized inode table blocks in the background.
+ *
+ * Does nothing if the whole inode table is already initialized.
+ *
+ * @param fs  file system context.
+ * @return    true on success; false if the thread could not be created.
+ */
+bool fs_ctx_start_itable_init(fs_ctx *fs);
+
+/**
+ * Make sure the inode table block that holds an inode is initialized.
+ *
+ * Must be called before a newly allocated inode is written to.
+ *
+ * @param fs   file system context.
+ * @param ino  inode number.
+ */
+void fs_ctx_itable_prepare(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Write a range of the image mapping back to the image file (msync).
+ *
+ * The range is extended to whole blocks.
+ *
+ * @param fs    file system context.
+ * @param addr  start of the range.
+ * @param len   length of the range in bytes.
+ * @return      true on success; false if the write failed.
+ */
+bool fs_ctx_sync(fs_ctx *fs, void *addr, size_t len);
+
+/**
+ * Write a range of data blocks, which can be split over stripe chunks, back
+ * to the image files.
+ *
+ * @param fs     file system context.
+ * @param b      first data block.
+ * @param count  number of blocks.
+ * @return       true on success; false if the write failed.
+ */
+bool fs_ctx_sync_data(fs_ctx *fs, a1fs_blk_t b, a1fs_blk_t count);
@@ -0,0 +1,844 @@
+/**
+ * CSC369 Assignment 1 - a1fs file system checker.
+ *
+ * Checks an unmounted a1fs image for consistency: superblock counters, inode
+ * and block bitmaps against the inodes and extents that are actually in use,
+ * directory entries, link counts, the parent_num/empty inode fields, the free
+ * entry summaries of directories and the list of orphans whose blocks are
+ * still being freed.
+ *
+ * The inode table is checked by a pool of worker threads in two passes. The
+ * first pass walks every in-use inode, records which blocks it owns and scans
+ * the entries of every directory. The second pass cross-checks the reference
+ * maps built by the first one against the on-disk bitmaps and inode fields.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "extent.h"
+#include "fs_ctx.h"
+#include "map.h"
+
+
+/** fsck exit codes, same meaning as in e2fsck(8). */
+#define FSCK_OK          0
+#define FSCK_CORRECTED   1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR       8
+
+/** Number of inodes or blocks handed to a worker at a time. */
+#define FSCK_CHUNK 64
+
+
+/** Command line options. */
+typedef struct fsck_opts {
+    /** File system image file path. */
+    const char *img_path;
+    /** The other image files of a striped file system. */
+    char *const *members;
+    unsigned int n_members;
+    /** Number of worker threads. */
+    long n_threads;
+
+    /** Print help and exit. */
+    bool help;
+    /** Repair the errors that can be fixed. */
+    bool repair;
+    /** Print a summary of what was checked. */
+    bool verbose;
+
+} fsck_opts;
+
+static const char *help_str = "\
+Usage: %s options image [image...]\n\
+\n\
+Check the a1fs file system in the image file. The file system must not be\n\
+mounted while it is being checked. A file system striped over several image\n\
+files is checked with all of them, in order.\n\
+\n\
+Options:\n\
+    -j num  number of worker threads; defaults to the number of CPUs\n\
+    -y      repair bitmaps, counters and inode fields that are inconsistent\n\
+    -v      print a summary of the check\n\
+    -h      print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+    fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], fsck_opts *opts)
+{
+    int o;
+    while ((o = getopt(argc, argv, "j:yvh")) != -1) {
+        switch (o) {
+            case 'j': opts->n_threads = strtol(optarg, NULL, 10); break;
+
+            case 'h': opts->help    = true; return true;// skip other arguments
+            case 'y': opts->repair  = true; break;
+            case 'v': opts->verbose = true; break;
+
+            case '?': return false;
+            default : assert(false);
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Missing image path\n");
+        return false;
+    }
+    opts->img_path = argv[optind];
+    opts->members = argv + optind + 1;
+    opts->n_members = argc - optind - 1;
+
+    if (opts->n_threads <= 0) {
+        opts->n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (opts->n_threads <= 0) opts->n_threads = 1;
+    }
+    return true;
+}
+
+
+/** Checker state shared by all worker threads. */
+typedef struct fsck_state {
+    fs_ctx *fs;
+    const fsck_opts *opts;
+
+    /** Number of inodes and data blocks that can be tracked by the bitmaps. */
+    unsigned int n_inodes;
+    unsigned int n_blocks;
+    /** Number of data blocks that the images have room for. */
+    a1fs_blk_t capacity;
+
+    /** Number of extents that references each data block. */
+    uint16_t *block_refs;
+    /** Number of directory entries that reference each inode. */
+    uint16_t *inode_refs;
+    /** Directory in which each inode was found. */
+    uint32_t *found_parent;
+    /** Which inodes are on the orphan list. */
+    bool *orphan;
+
+    /** Number of bits set in the on-disk bitmaps. */
+    unsigned int used_inodes;
+    unsigned int used_blocks;
+    /** Logical and data blocks of the compressed clusters found. */
+    unsigned int compr_logical;
+    unsigned int compr_physical;
+
+    /** Number of errors found and number of errors repaired. */
+    unsigned int errors;
+    unsigned int fixed;
+
+    /** Serializes the error messages. */
+    pthread_mutex_t log_lock;
+} fsck_state;
+
+
+/** Print an error message; "fixed" tells if the error has been repaired. */
+static void report(fsck_state *st, bool fixed, const char *fmt, ...)
+{
+    va_list ap;
+    pthread_mutex_lock(&st->log_lock);
+    va_start(ap, fmt);
+    vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    fprintf(stdout, fixed ? " (fixed)\n" : "\n");
+    pthread_mutex_unlock(&st->log_lock);
+
+    __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+    if (fixed) __atomic_fetch_add(&st->fixed, 1, __ATOMIC_RELAXED);
+}
+
+/** Check if a data block number is within the image and the block bitmap. */
+static bool valid_block(fsck_state *st, a1fs_blk_t b)
+{
+    return b < st->n_blocks && b < st->capacity;
+}
+
+
+/*
+ * Worker thread pool.
+ *
+ * The workers are created once and wait on a barrier for the next pass. Each
+ * pass splits the index range [0, count) into FSCK_CHUNK sized chunks that the
+ * workers (and the main thread) grab until there are none left.
+ */
+
+typedef void (*fsck_job)(fsck_state *st, unsigned int from, unsigned int to);
+
+typedef struct fsck_pool {
+    pthread_t *threads;
+    long n_threads;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+
+    fsck_state *st;
+    fsck_job job;
+    unsigned int count;
+    unsigned int next;
+    bool quit;
+} fsck_pool;
+
+static void pool_work(fsck_pool *pool)
+{
+    for (;;) {
+        unsigned int from = __atomic_fetch_add(&pool->next, FSCK_CHUNK, __ATOMIC_RELAXED);
+        if (from >= pool->count) break;
+        unsigned int to = from + FSCK_CHUNK < pool->count ? from + FSCK_CHUNK : pool->count;
+        pool->job(pool->st, from, to);
+    }
+}
+
+static void *pool_thread(void *arg)
+{
+    fsck_pool *pool = (fsck_pool*)arg;
+    for (;;) {
+        pthread_barrier_wait(&pool->start);
+        if (pool->quit) return NULL;
+        pool_work(pool);
+        pthread_barrier_wait(&pool->done);
+    }
+}
+
+static bool pool_init(fsck_pool *pool, fsck_state *st, long n_threads)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->st = st;
+    pool->threads = calloc(n_threads, sizeof(pthread_t));
+    if (!pool->threads) return false;
+
+    // The main thread is one of the workers
+    pthread_barrier_init(&pool->start, NULL, n_threads);
+    pthread_barrier_init(&pool->done, NULL, n_threads);
+    for (long i = 1; i < n_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_thread, pool) != 0) {
+            perror("pthread_create");
+            exit(FSCK_ERROR);
+        }
+    }
+    pool->n_threads = n_threads;
+    return true;
+}
+
+/** Run job over [0, count) on all workers and wait for it to finish. */
+static void pool_run(fsck_pool *pool, fsck_job job, unsigned int count)
+{
+    pool->job = job;
+    pool->count = count;
+    pool->next = 0;
+    pthread_barrier_wait(&pool->start);
+    pool_work(pool);
+    pthread_barrier_wait(&pool->done);
+}
+
+static void pool_destroy(fsck_pool *pool)
+{
+    pool->quit = true;
+    pthread_barrier_wait(&pool->start);
+    for (long i = 1; i < pool->n_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+    free(pool->threads);
+}
+
+
+/*
+ * Pass 1: walk the in-use inodes.
+ */
+
+/** Record the blocks of an extent; returns the number of valid blocks in it. */
+static unsigned int check_extent(fsck_state *st, const a1fs_inode *in, const a1fs_extent *ext)
+{
+    unsigned int n = 0;
+    for (a1fs_blk_t f = 0; f < ext->count; f++) {
+        a1fs_blk_t b = ext->start + f;
+        if (!valid_block(st, b)) {
+            report(st, false, "Inode %u: extent [%u, +%u) is out of range",
+                   in->num, ext->start, ext->count);
+            break;
+        }
+        __atomic_fetch_add(&st->block_refs[b], 1, __ATOMIC_RELAXED);
+        n++;
+    }
+    return n;
+}
+
+/** Check the entries in one directory block. */
+static void check_dentries(fsck_state *st, a1fs_inode *dir, a1fs_blk_t b,
+                           unsigned int *entries, unsigned int *subdirs)
+{
+    fs_ctx *fs = st->fs;
+    for (unsigned int i = 0; i < fs->block_size / sizeof(a1fs_dentry); i++) {
+        a1fs_dentry *entry = (a1fs_dentry*)fs_data_block(fs, b) + i;
+        if (entry->name[0] == '\0') continue;
+
+        if (strnlen(entry->name, A1FS_NAME_MAX) == A1FS_NAME_MAX) {
+            report(st, false, "Directory %u: entry name is not terminated", dir->num);
+            continue;
+        }
+        if (entry->ino == 0 || entry->ino >= st->n_inodes ||
+            !fs->ibitmap->map[entry->ino])
+        {
+            report(st, st->opts->repair, "Directory %u: entry '%s' refers to free inode %u",
+                   dir->num, entry->name, entry->ino);
+            if (st->opts->repair) memset(entry, 0, sizeof(*entry));
+            continue;
+        }
+
+        __atomic_fetch_add(&st->inode_refs[entry->ino], 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->found_parent[entry->ino], dir->num, __ATOMIC_RELAXED);
+        (*entries)++;
+        if (S_ISDIR(fs->itable[entry->ino].mode)) (*subdirs)++;
+    }
+}
+
+/** State of the extent tree walk of one inode. */
+typedef struct inode_walk {
+    a1fs_inode *in;
+    /** Logical block that the next extent must start at. */
+    a1fs_blk_t next_lblk;
+    /** Data and tree node blocks found so far. */
+    unsigned int blocks;
+    unsigned int extents;
+    /** Block that holds the last leaf entry (0 for the root). */
+    a1fs_blk_t last_leaf;
+    unsigned int entries;
+    unsigned int subdirs;
+    /** The inode belongs to a snapshot; its directory entries are not checked. */
+    bool snapshot;
+    /** The inode is an orphan; see check_orphans(). */
+    bool orphan;
+    /** A block with a free entry is left out of the free entry summary. */
+    bool slots_missed;
+} inode_walk;
+
+/** Whether the free entry summary of directory dir covers logical block l. */
+static bool slot_covers(const a1fs_inode *dir, a1fs_blk_t l)
+{
+    if (dir->slot_shift >= 32 || l < dir->slot_hint) return false;
+    unsigned int g = l >> dir->slot_shift;
+    return g < A1FS_SLOT_BITS && ((dir->slot_map[g / 64] >> (g % 64)) & 1);
+}
+
+/**
+ * Check an extent tree node and everything below it.
+ *
+ * @param blk    block that holds the node; 0 for the root in the inode.
+ * @param max    expected capacity of the node.
+ * @param depth  expected depth of the node.
+ * @return       false if the tree is corrupt and the walk has to stop.
+ */
+static bool check_node(fsck_state *st, inode_walk *w, a1fs_ext_header *hdr,
+                       a1fs_blk_t blk, unsigned int max, unsigned int depth)
+{
+    a1fs_inode *in = w->in;
+    if (hdr->magic != A1FS_EXT_MAGIC || hdr->max != max ||
+        hdr->entries > max || hdr->depth != depth)
+    {
+        report(st, false, "Inode %u: extent tree node in block %u is corrupt", in->num, blk);
+        return false;
+    }
+    a1fs_ext_entry *e = (a1fs_ext_entry*)(hdr + 1);
+
+    for (unsigned int i = 0; i < hdr->entries; i++) {
+        // the tail cut off a file by truncate starts where the file now ends
+        if (w->orphan && w->extents == 0 && w->next_lblk == 0) w->next_lblk = e[i].leaf.lblk;
+        // every entry has to start where the previous one ended, sparse
+        // files are not supported
+        if (e[i].leaf.lblk != w->next_lblk) {
+            report(st, false, "Inode %u: extent tree entry in block %u starts at %u, expected %u",
+                   in->num, blk, e[i].leaf.lblk, w->next_lblk);
+            return false;
+        }
+
+        if (depth > 0) {
+            a1fs_blk_t child = e[i].index.child;
+            if (child == 0 || !valid_block(st, child)) {
+                report(st, false, "Inode %u: extent tree node %u is out of range", in->num, child);
+                return false;
+            }
+            __atomic_fetch_add(&st->block_refs[child], 1, __ATOMIC_RELAXED);
+            w->blocks++;
+            if (!check_node(st, w, fs_data_block(st->fs, child), child, A1FS_EXT_NODE_MAX(st->fs->block_size), depth - 1)) {
+                return false;
+            }
+            continue;
+        }
+
+        const a1fs_ext_leaf *leaf = &e[i].leaf;
+        if (leaf->ext.count == 0) {
+            report(st, false, "Inode %u: empty extent in block %u", in->num, blk);
+            return false;
+        }
+        // a compressed extent is one cluster (or a truncated one) and only
+        // takes the blocks that the compressed data needs
+        a1fs_extent ext = leaf->ext;
+        if (leaf->zinfo != 0) {
+            size_t len = A1FS_ZINFO_LEN(leaf->zinfo);
+            if (S_ISDIR(in->mode) || A1FS_ZINFO_ALG(leaf->zinfo) != A1FS_COMPR_LZ4 ||
+                leaf->lblk % A1FS_CLUSTER_BLOCKS != 0 || ext.count > A1FS_CLUSTER_BLOCKS ||
+                len == 0 || len > (size_t)A1FS_CLUSTER_BLOCKS << st->fs->block_shift)
+            {
+                report(st, false, "Inode %u: compressed extent at block %u is corrupt",
+                       in->num, leaf->lblk);
+                return false;
+            }
+            ext.count = fs_blocks(st->fs, len);
+            __atomic_fetch_add(&st->compr_logical, leaf->ext.count, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&st->compr_physical, ext.count, __ATOMIC_RELAXED);
+        }
+        unsigned int n = check_extent(st, in, &ext);
+        if (n != ext.count) return false;
+        for (unsigned int f = 0; S_ISDIR(in->mode) && !w->snapshot && !w->orphan && f < n; f++) {
+            check_dentries(st, in, ext.start + f, &w->entries, &w->subdirs);
+            if ((in->flags & A1FS_INODE_SLOTS) && !slot_covers(in, leaf->lblk + f) &&
+                st->fs->ops->dentry_free(fs_data_block(st->fs, ext.start + f)) != NULL)
+            {
+                w->slots_missed = true;
+            }
+        }
+        w->blocks += n;
+        w->next_lblk += leaf->ext.count;
+        w->extents++;
+        w->last_leaf = blk;
+    }
+    return true;
+}
+
+static void check_inodes(fsck_state *st, unsigned int from, unsigned int to)
+{
+    fs_ctx *fs = st->fs;
+    for (unsigned int ino = from; ino < to; ino++) {
+        if (!fs->ibitmap->map[ino]) continue;
+        a1fs_inode *in = &fs->itable[ino];
+
+        if ((fs->sb->features & A1FS_FEATURE_LAZY_ITABLE) &&
+            ino / (fs->block_size / sizeof(a1fs_inode)) >= fs->sb->itable_init)
+        {
+            report(st, false, "Inode %u: in use but its inode table block is not initialized", ino);
+            continue;
+        }
+        if (in->num != ino) {
+            report(st, st->opts->repair, "Inode %u: num field is %u", ino, in->num);
+            if (st->opts->repair) in->num = ino;
+        }
+        if (!S_ISDIR(in->mode) && !S_ISREG(in->mode)) {
+            report(st, false, "Inode %u: invalid mode %o", ino, in->mode);
+            continue;
+        }
+
+        bool dir = S_ISDIR(in->mode);
+        bool orphan = in->flags & A1FS_INODE_ORPHAN;
+        inode_walk w = { .in = in, .orphan = orphan };
+        if (in->ext_hdr.depth >= A1FS_EXT_MAX_DEPTH ||
+            !check_node(st, &w, &in->ext_hdr, 0, A1FS_EXT_ROOT_MAX, in->ext_hdr.depth))
+        {
+            // the counters below would only be misleading
+            continue;
+        }
+        unsigned int entries = w.entries, subdirs = w.subdirs;
+
+        if (in->extent_count != w.extents) {
+            report(st, st->opts->repair, "Inode %u: extent_count is %u, should be %u",
+                   ino, in->extent_count, w.extents);
+            if (st->opts->repair) in->extent_count = w.extents;
+        }
+        if (in->ext_last_leaf != w.last_leaf) {
+            report(st, st->opts->repair, "Inode %u: last extent is in block %u, should be %u",
+                   ino, in->ext_last_leaf, w.last_leaf);
+            if (st->opts->repair) in->ext_last_leaf = w.last_leaf;
+        }
+        if (in->block_count != w.blocks) {
+            report(st, st->opts->repair, "Inode %u: block_count is %u, should be %u",
+                   ino, in->block_count, w.blocks);
+            if (st->opts->repair) in->block_count = w.blocks;
+        }
+        if (orphan) continue;// only its blocks are left
+
+        if (fs_blocks(fs, in->size) != w.next_lblk ||
+            (dir && in->size != (uint64_t)w.next_lblk << fs->block_shift))
+        {
+            report(st, false, "Inode %u: size %lu does not match its %u mapped blocks",
+                   ino, (unsigned long)in->size, w.next_lblk);
+        }
+        if (!dir) continue;
+
+        if (in->empty != entries) {
+            report(st, st->opts->repair, "Directory %u: entry count is %u, should be %u",
+                   ino, in->empty, entries);
+            if (st->opts->repair) in->empty = entries;
+        }
+        if (w.slots_missed) {
+            report(st, st->opts->repair, "Directory %u: free entry summary misses a block", ino);
+            if (st->opts->repair) in->flags &= ~A1FS_INODE_SLOTS;
+        }
+        if (in->links != 2 + subdirs) {
+            report(st, st->opts->repair, "Directory %u: link count is %u, should be %u",
+                   ino, in->links, 2 + subdirs);
+            if (st->opts->repair) in->links = 2 + subdirs;
+        }
+    }
+}
+
+/**
+ * Walk the snapshots: the blocks that hold them and the blocks of their inodes
+ * are referenced just like those of the live inodes.
+ */
+static void check_snapshots(fsck_state *st)
+{
+    fs_ctx *fs = st->fs;
+    a1fs_superblock *sb = fs->sb;
+    a1fs_blk_t run = 2 + (sb->block_table - sb->inode_table);
+    unsigned int count = 0;
+
+    for (a1fs_blk_t blk = sb->snap_head; blk != 0; count++) {
+        a1fs_snapshot *hdr = fs_data_block(fs, blk);
+        if (count == A1FS_SNAP_MAX || !valid_block(st, blk) || !valid_block(st, blk + run - 1) ||
+            fs_data_run(fs, blk, run) < run || hdr->magic != A1FS_SNAP_MAGIC || hdr->blocks != run ||
+            strnlen(hdr->name, A1FS_SNAP_NAME_MAX) == A1FS_SNAP_NAME_MAX)
+        {
+            report(st, false, "Snapshot list is corrupt at block %u", blk);
+            break;
+        }
+        for (a1fs_blk_t b = blk; b < blk + run; b++) st->block_refs[b]++;
+
+        a1fs_ibitmap *ibitmap = fs_data_block(fs, blk + 1);
+        a1fs_inode *itable = fs_data_block(fs, blk + 2);
+        for (unsigned int ino = 0; ino < st->n_inodes; ino++) {
+            if (!ibitmap->map[ino]) continue;
+            a1fs_inode *in = &itable[ino];
+            inode_walk w = { .in = in, .snapshot = true };
+            if (in->ext_hdr.depth >= A1FS_EXT_MAX_DEPTH ||
+                !check_node(st, &w, &in->ext_hdr, 0, A1FS_EXT_ROOT_MAX, in->ext_hdr.depth))
+            {
+                report(st, false, "Snapshot '%s': inode %u is corrupt", hdr->name, ino);
+                continue;
+            }
+            if (in->block_count != w.blocks) {
+                report(st, st->opts->repair, "Snapshot '%s': inode %u block_count is %u, should be %u",
+                       hdr->name, ino, in->block_count, w.blocks);
+                if (st->opts->repair) in->block_count = w.blocks;
+            }
+        }
+        blk = hdr->next;
+    }
+
+    if (sb->snap_count != count) {
+        report(st, st->opts->repair, "Superblock: snapshot count is %u, should be %u",
+               sb->snap_count, count);
+        if (st->opts->repair) sb->snap_count = count;
+    }
+}
+
+
+/**
+ * Walk the orphan list (see reclaim.h) and look for orphans that are not on
+ * it, which would never be freed. The orphans themselves are checked with the
+ * other inodes in pass 1, except for the fields that only matter to files
+ * that a directory refers to.
+ */
+static void check_orphans(fsck_state *st)
+{
+    fs_ctx *fs = st->fs;
+    bool repair = st->opts->repair;
+
+    // every step marks another inode, so a cycle ends the walk too
+    unsigned int *link = &fs->sb->orphan_head;
+    while (*link != 0) {
+        unsigned int ino = *link;
+        if (ino >= st->n_inodes || !fs->ibitmap->map[ino] || st->orphan[ino] ||
+            !(fs->itable[ino].flags & A1FS_INODE_ORPHAN))
+        {
+            report(st, repair, "Orphan list is corrupt at inode %u", ino);
+            if (repair) *link = 0;// the orphans past it are put back below
+            break;
+        }
+        st->orphan[ino] = true;
+        link = &fs->itable[ino].orphan_next;
+    }
+
+    for (unsigned int ino = 1; ino < st->n_inodes; ino++) {
+        a1fs_inode *in = &fs->itable[ino];
+        if (!fs->ibitmap->map[ino] || !(in->flags & A1FS_INODE_ORPHAN) || st->orphan[ino]) continue;
+        report(st, repair, "Inode %u: orphan is not on the orphan list", ino);
+        if (repair) {
+            in->orphan_next = fs->sb->orphan_head;
+            fs->sb->orphan_head = ino;
+            st->orphan[ino] = true;
+        }
+    }
+}
+
+
+/*
+ * Pass 2: cross-check the reference maps against the bitmaps.
+ */
+
+/** Check that following the parents of an inode leads to the root. */
+static bool reachable(fsck_state *st, unsigned int ino)
+{
+    for (unsigned int steps = 0; steps < st->n_inodes; steps++) {
+        if (ino == 0) return true;
+        if (st->inode_refs[ino] == 0) return false;
+        ino = st->found_parent[ino];
+    }
+    return false;// cycle
+}
+
+static void cross_check_inodes(fsck_state *st, unsigned int from, unsigned int to)
+{
+    fs_ctx *fs = st->fs;
+    unsigned int used = 0;
+    for (unsigned int ino = from; ino < to; ino++) {
+        if (!fs->ibitmap->map[ino]) continue;
+        used++;
+        a1fs_inode *in = &fs->itable[ino];
+        if (ino == 0) continue;
+
+        if (in->flags & A1FS_INODE_ORPHAN) {
+            if (st->inode_refs[ino] > 0) {
+                report(st, false, "Inode %u: orphan is referenced by a directory", ino);
+            }
+            continue;
+        }
+        if (st->inode_refs[ino] == 0) {
+            report(st, false, "Inode %u: in use but not referenced by any directory", ino);
+            continue;
+        }
+        if (st->inode_refs[ino] > 1) {
+            report(st, false, "Inode %u: referenced by %u directory entries",
+                   ino, st->inode_refs[ino]);
+        }
+        if (!reachable(st, ino)) {
+            report(st, false, "Inode %u: not reachable from the root directory", ino);
+        }
+        if (in->parent_num != st->found_parent[ino]) {
+            report(st, st->opts->repair, "Inode %u: parent_num is %u, should be %u",
+                   ino, in->parent_num, st->found_parent[ino]);
+            if (st->opts->repair) in->parent_num = st->found_parent[ino];
+        }
+        if (S_ISREG(in->mode) && in->links != st->inode_refs[ino]) {
+            report(st, st->opts->repair, "Inode %u: link count is %u, should be %u",
+                   ino, in->links, st->inode_refs[ino]);
+            if (st->opts->repair) in->links = st->inode_refs[ino];
+        }
+    }
+    __atomic_fetch_add(&st->used_inodes, used, __ATOMIC_RELAXED);
+}
+
+static void cross_check_blocks(fsck_state *st, unsigned int from, unsigned int to)
+{
+    fs_ctx *fs = st->fs;
+    unsigned int used = 0;
+    for (unsigned int b = from; b < to; b++) {
+        // the bitmap holds the reference count of each block
+        uint16_t refs = st->block_refs[b];
+        if (refs > A1FS_BLOCK_REFS_MAX) {
+            report(st, false, "Block %u: claimed by %u extents", b, refs);
+        } else if (refs > 0 && !fs->bbitmap->map[b]) {
+            report(st, st->opts->repair, "Block %u: in use but marked free", b);
+            if (st->opts->repair) fs->bbitmap->map[b] = refs;
+        } else if (refs == 0 && fs->bbitmap->map[b]) {
+            report(st, st->opts->repair, "Block %u: marked in use but not referenced", b);
+            if (st->opts->repair) fs->bbitmap->map[b] = 0;
+        } else if (refs != fs->bbitmap->map[b]) {
+            report(st, st->opts->repair, "Block %u: reference count is %u, should be %u",
+                   b, fs->bbitmap->map[b], refs);
+            if (st->opts->repair) fs->bbitmap->map[b] = refs;
+        }
+        if (fs->bbitmap->map[b]) used++;
+    }
+    __atomic_fetch_add(&st->used_blocks, used, __ATOMIC_RELAXED);
+}
+
+
+/** Check the superblock fields that the rest of the checker relies on. */
+static bool check_superblock(fsck_state *st)
+{
+    fs_ctx *fs = st->fs;
+    a1fs_superblock *sb = fs->sb;
+    size_t image_blocks = fs->size >> fs->block_shift;
+
+    if (sb->size != fs->size) {
+        report(st, false, "Superblock: size is %lu, image is %zu bytes", sb->size, fs->size);
+    }
+    size_t itable_blocks = fs_blocks(fs, (uint64_t)sb->inode_count * sizeof(a1fs_inode));
+    if (sb->inode_table + itable_blocks > sb->block_table || sb->block_table >= image_blocks) {
+        report(st, false, "Superblock: inode table and data region overlap or are out of range");
+        return false;
+    }
+    size_t cbt_blocks = fs_blocks(fs, (uint64_t)(sb->block_count < fs->block_size ? sb->block_count : fs->block_size) *
+                                      sizeof(uint32_t));
+    if ((sb->features & A1FS_FEATURE_CBT) && (sb->cbt_table < 4 || sb->cbt_table + cbt_blocks > sb->inode_table)) {
+        report(st, false, "Superblock: changed-block table overlaps the inode table or is out of range");
+        return false;
+    }
+    if ((sb->features & A1FS_FEATURE_LAZY_ITABLE) && sb->itable_init > sb->block_table - sb->inode_table) {
+        report(st, false, "Superblock: itable_init is past the end of the inode table");
+        return false;
+    }
+    if (!fs->ibitmap->map[0] || !S_ISDIR(fs->itable[0].mode)) {
+        report(st, false, "Root directory is missing");
+        return false;
+    }
+
+    st->n_inodes = sb->inode_count < fs->block_size ? sb->inode_count : fs->block_size;
+    st->n_blocks = sb->block_count < fs->block_size ? sb->block_count : fs->block_size;
+    st->capacity = fs_ctx_data_capacity(fs);
+    return true;
+}
+
+/** Check the superblock counters against the bitmaps. */
+static void check_counters(fsck_state *st)
+{
+    a1fs_superblock *sb = st->fs->sb;
+    bool repair = st->opts->repair;
+
+    if (sb->used_inode_count != st->used_inodes) {
+        report(st, repair, "Superblock: used inode count is %u, should be %u",
+               sb->used_inode_count, st->used_inodes);
+        if (repair) sb->used_inode_count = st->used_inodes;
+    }
+    if (sb->used_block_count != st->used_blocks) {
+        report(st, repair, "Superblock: used block count is %u, should be %u",
+               sb->used_block_count, st->used_blocks);
+        if (repair) sb->used_block_count = st->used_blocks;
+    }
+    if (sb->compr_logical != st->compr_logical || sb->compr_physical != st->compr_physical) {
+        report(st, repair, "Superblock: compressed cluster blocks are %u/%u, should be %u/%u",
+               sb->compr_logical, sb->compr_physical, st->compr_logical, st->compr_physical);
+        if (repair) {
+            sb->compr_logical = st->compr_logical;
+            sb->compr_physical = st->compr_physical;
+        }
+    }
+}
+
+/**
+ * Check the stored free-space summary if the file system claims to have been
+ * unmounted cleanly (otherwise the next mount rebuilds it anyway).
+ */
+static void check_summary(fsck_state *st)
+{
+    fs_ctx *fs = st->fs;
+    if (!(fs->sb->state & A1FS_STATE_CLEAN)) return;
+
+    // the repairs made above invalidate the stored summary too
+    a1fs_summary sum;
+    fs_ctx_summary_build(fs, &sum);
+    if (st->fixed > 0 || memcmp(&sum, fs->image, sizeof(sum)) != 0) {
+        report(st, st->opts->repair, "Free-space summary does not match the bitmaps");
+        // the next mount rebuilds it
+        if (st->opts->repair) fs->sb->state &= ~A1FS_STATE_CLEAN;
+    }
+}
+
+
+static int fsck(fs_ctx *fs, const fsck_opts *opts)
+{
+    fsck_state st = {0};
+    st.fs = fs;
+    st.opts = opts;
+    pthread_mutex_init(&st.log_lock, NULL);
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    if (!check_superblock(&st)) return FSCK_UNCORRECTED;
+
+    st.block_refs   = calloc(st.n_blocks, sizeof(*st.block_refs));
+    st.inode_refs   = calloc(st.n_inodes, sizeof(*st.inode_refs));
+    st.found_parent = calloc(st.n_inodes, sizeof(*st.found_parent));
+    st.orphan       = calloc(st.n_inodes, sizeof(*st.orphan));
+    if (!st.block_refs || !st.inode_refs || !st.found_parent || !st.orphan) {
+        fprintf(stderr, "Out of memory\n");
+        return FSCK_ERROR;
+    }
+
+    fsck_pool pool;
+    if (!pool_init(&pool, &st, opts->n_threads)) {
+        fprintf(stderr, "Out of memory\n");
+        return FSCK_ERROR;
+    }
+    check_orphans(&st);
+    pool_run(&pool, check_inodes, st.n_inodes);
+    check_snapshots(&st);
+    pool_run(&pool, cross_check_inodes, st.n_inodes);
+    pool_run(&pool, cross_check_blocks, st.n_blocks);
+    pool_destroy(&pool);
+    check_counters(&st);
+    check_summary(&st);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (opts->verbose) {
+        double secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        printf("%s: %u/%u inodes, %u/%u blocks, %u errors (%u fixed), %.3fs with %ld threads\n",
+               opts->img_path, st.used_inodes, st.n_inodes, st.used_blocks,
+               st.n_blocks, st.errors, st.fixed, secs, opts->n_threads);
+        if (st.compr_logical > 0) {
+            printf("%s: %u blocks compressed into %u (ratio %.2f)\n", opts->img_path,
+                   st.compr_logical, st.compr_physical, (double)st.compr_logical / st.compr_physical);
+        }
+    }
+
+    free(st.block_refs);
+    free(st.inode_refs);
+    free(st.found_parent);
+    free(st.orphan);
+    pthread_mutex_destroy(&st.log_lock);
+
+    if (st.errors == 0) return FSCK_OK;
+    return st.errors == st.fixed ? FSCK_CORRECTED : FSCK_UNCORRECTED;
+}
+
+
+int main(int argc, char *argv[])
+{
+    fsck_opts opts = {0};// defaults are all 0
+    if (!parse_args(argc, argv, &opts)) {
+        // Invalid arguments, print help to stderr
+        print_help(stderr, argv[0]);
+        return FSCK_ERROR;
+    }
+    if (opts.help) {
+        // Help requested, print it to stdout
+        print_help(stdout, argv[0]);
+        return FSCK_OK;
+    }
+
+    // Map image file into memory; read-only unless repairing, so that checking
+    // a mounted image cannot modify it
+    size_t size;
+    void *image = opts.repair ? map_file(opts.img_path, A1FS_BLOCK_SIZE, &size)
+                              : map_file_readonly(opts.img_path, A1FS_BLOCK_SIZE, &size);
+    if (image == NULL) return FSCK_ERROR;
+
+    int ret = FSCK_ERROR;
+    fs_ctx fs = {0};
+    if (!fs_ctx_init(&fs, image, size)) {
+        fprintf(stderr, "%s: not an a1fs image\n", opts.img_path);
+        goto end;
+    }
+    if (fs_ctx_map_members(&fs, opts.members, opts.n_members, opts.repair, 0)) {
+        ret = fsck(&fs, &opts);
+    }
+    fs_ctx_destroy(&fs);
+end:
+    munmap(image, size);
+    return ret;
+}
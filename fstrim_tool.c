@@ -0,0 +1,165 @@
+/**
+ * CSC369 Assignment 1 - a1fs free block discarding tool.
+ *
+ * Offline mode punches holes in an unmounted image where its free blocks are.
+ * Online mode asks a mounted a1fs to do the same via the A1FS_IOC_TRIM ioctl.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "discard.h"
+#include "fs_ctx.h"
+#include "map.h"
+
+
+/** Command line options. */
+typedef struct fstrim_opts {
+    /** Image file paths, more than one if striped (offline), or the mount point (online). */
+    char **paths;
+    int n_paths;
+    /** Free runs shorter than this many bytes are left alone. */
+    unsigned long minlen;
+
+    /** Print help and exit. */
+    bool help;
+    /** Trim a mounted file system. */
+    bool online;
+    /** Report the number of bytes discarded. */
+    bool verbose;
+
+} fstrim_opts;
+
+static const char *help_str = "\
+Usage: %s [-m minlen] [-v] image [image...]\n\
+       %s -o [-m minlen] [-v] mountpoint\n\
+\n\
+Punch holes in the image files where the free blocks of the file system are,\n\
+so that the host file system can reuse the space. An image must not be\n\
+mounted while it is being trimmed offline. A file system striped over\n\
+several image files is trimmed with all of them, in order.\n\
+\n\
+Options:\n\
+    -o         online mode - trim a mounted a1fs\n\
+    -m minlen  skip runs of free blocks shorter than minlen bytes\n\
+    -v         report the number of bytes discarded\n\
+    -h         print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+    fprintf(f, help_str, progname, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], fstrim_opts *opts)
+{
+    int o;
+    while ((o = getopt(argc, argv, "m:ovh")) != -1) {
+        switch (o) {
+            case 'm': opts->minlen = strtoul(optarg, NULL, 10); break;
+
+            case 'h': opts->help    = true; return true;// skip other arguments
+            case 'o': opts->online  = true; break;
+            case 'v': opts->verbose = true; break;
+
+            case '?': return false;
+            default : assert(false);
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Missing %s path\n", opts->online ? "mount point" : "image");
+        return false;
+    }
+    opts->paths = argv + optind;
+    opts->n_paths = argc - optind;
+    if (opts->online && opts->n_paths > 1) {
+        fprintf(stderr, "Only one mount point can be trimmed at a time\n");
+        return false;
+    }
+    return true;
+}
+
+
+static void report(const fstrim_opts *opts, uint64_t bytes)
+{
+    if (opts->verbose) printf("%s: %lu bytes were trimmed\n", opts->paths[0], (unsigned long)bytes);
+}
+
+static int fstrim_online(const fstrim_opts *opts)
+{
+    int fd = open(opts->paths[0], O_RDONLY);
+    if (fd < 0) {
+        perror(opts->paths[0]);
+        return 1;
+    }
+    struct a1fs_trim trim = { .minlen = opts->minlen };
+    int ret = 0;
+    if (ioctl(fd, A1FS_IOC_TRIM, &trim) < 0) {
+        fprintf(stderr, "%s: %s\n", opts->paths[0], strerror(errno));
+        ret = 1;
+    } else {
+        report(opts, trim.trimmed);
+    }
+    close(fd);
+    return ret;
+}
+
+static int fstrim_offline(fs_ctx *fs, const fstrim_opts *opts)
+{
+    uint64_t blocks;
+    int ret = discard_trim(fs, fs_blocks(fs, opts->minlen), &blocks);
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", opts->paths[0], strerror(-ret));
+        return 1;
+    }
+    report(opts, blocks << fs->block_shift);
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    fstrim_opts opts = {0};// defaults are all 0
+    if (!parse_args(argc, argv, &opts)) {
+        // Invalid arguments, print help to stderr
+        print_help(stderr, argv[0]);
+        return 1;
+    }
+    if (opts.help) {
+        // Help requested, print it to stdout
+        print_help(stdout, argv[0]);
+        return 0;
+    }
+    if (opts.online) return fstrim_online(&opts);
+
+    // Map image file into memory
+    size_t size;
+    void *image = map_file(opts.paths[0], A1FS_BLOCK_SIZE, &size);
+    if (image == NULL) return 1;
+
+    int ret = 1;
+    fs_ctx fs = {0};
+    if (!fs_ctx_init(&fs, image, size)) {
+        fprintf(stderr, "%s: not an a1fs image\n", opts.paths[0]);
+        goto end;
+    }
+    if (fs_ctx_map_members(&fs, opts.paths + 1, opts.n_paths - 1, true, 0) &&
+        discard_open(&fs, opts.paths[0], opts.paths + 1, opts.n_paths - 1))
+    {
+        ret = fstrim_offline(&fs, &opts);
+    }
+    fs_ctx_destroy(&fs);
+end:
+    munmap(image, size);
+    return ret;
+}
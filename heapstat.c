@@ -0,0 +1,75 @@
+/**
+ * CSC369 Assignment 1 - Heap allocation counting implementation.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+
+#include "heapstat.h"
+
+// glibc's own allocator, which the wrappers below forward to
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+
+/** Nesting depth of the counting scopes of this thread. */
+static __thread unsigned int depth;
+
+static uint64_t count;
+
+void heap_scope_begin(void)
+{
+    depth++;
+}
+
+void heap_scope_end(void)
+{
+    depth--;
+}
+
+uint64_t heap_allocs(void)
+{
+    return __atomic_load_n(&count, __ATOMIC_RELAXED);
+}
+
+static void counted(void)
+{
+    if (depth != 0) __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+}
+
+
+void *malloc(size_t size)
+{
+    counted();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    counted();
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    counted();
+    return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    counted();
+    return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size)
+{
+    if (align < sizeof(void*) || (align & (align - 1)) != 0) return EINVAL;
+    counted();
+    void *p = __libc_memalign(align, size);
+    if (p == NULL) return ENOMEM;
+    *ptr = p;
+    return 0;
+}
@@ -0,0 +1,23 @@
+/**
+ * CSC369 Assignment 1 - Heap allocation counting header file.
+ *
+ * Counts the heap allocations made while the file system callbacks run, to
+ * check that the operations do not go through malloc(). The a1fs binary wraps
+ * the malloc() family; a call is counted if the calling thread is inside a
+ * heap_scope_begin()/heap_scope_end() pair. The count is in the
+ * A1FS_IOC_STATS result.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+
+/** Start counting the allocations of the calling thread; scopes nest. */
+void heap_scope_begin(void);
+
+/** Stop counting the allocations of the calling thread. */
+void heap_scope_end(void);
+
+/** Get the number of allocations counted since the process started. */
+uint64_t heap_allocs(void);
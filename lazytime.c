@@ -0,0 +1,128 @@
+/**
+ * CSC369 Assignment 1 - Deferred inode timestamp updates implementation.
+ */
+
+#include <stdlib.h>
+
+#include "alloc.h"
+#include "lazytime.h"
+
+
+/** In-memory timestamps, indexed by inode number. */
+struct lazytime {
+    struct timespec *mtime;
+    /** Which entries of mtime are newer than the inode. */
+    bool *dirty;
+    unsigned int n_inodes;
+    unsigned int n_dirty;
+    /** When the oldest deferred update was made (coarse clock). */
+    time_t since;
+};
+
+
+bool lazytime_init(fs_ctx *fs)
+{
+    struct lazytime *lt = calloc(1, sizeof(*lt));
+    if (lt == NULL) return false;
+    lt->n_inodes = alloc_inode_limit(fs);
+    lt->mtime = calloc(lt->n_inodes, sizeof(*lt->mtime));
+    lt->dirty = calloc(lt->n_inodes, sizeof(*lt->dirty));
+    if (lt->mtime == NULL || lt->dirty == NULL) {
+        free(lt->mtime);
+        free(lt->dirty);
+        free(lt);
+        return false;
+    }
+    fs->lazytime = lt;
+    return true;
+}
+
+void lazytime_destroy(fs_ctx *fs)
+{
+    struct lazytime *lt = fs->lazytime;
+    if (lt == NULL) return;
+    lazytime_flush(fs);
+    free(lt->mtime);
+    free(lt->dirty);
+    free(lt);
+    fs->lazytime = NULL;
+}
+
+void lazytime_flush(fs_ctx *fs)
+{
+    struct lazytime *lt = fs->lazytime;
+    if (lt == NULL || lt->n_dirty == 0) return;
+    for (unsigned int ino = 0; ino < lt->n_inodes; ino++) {
+        if (!lt->dirty[ino]) continue;
+        fs->itable[ino].mtime = lt->mtime[ino];
+        lt->dirty[ino] = false;
+    }
+    lt->n_dirty = 0;
+}
+
+void lazytime_touch(fs_ctx *fs, a1fs_inode *in)
+{
+    struct lazytime *lt = fs->lazytime;
+    if (lt == NULL) {
+        clock_gettime(CLOCK_REALTIME, &in->mtime);
+        return;
+    }
+
+    // the coarse clock is a plain memory read; its resolution (a few ms) is
+    // plenty for mtime
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    if (lt->n_dirty > 0 && now.tv_sec - lt->since >= LAZYTIME_EXPIRE) lazytime_flush(fs);
+
+    if (!lt->dirty[in->num]) {
+        if (lt->n_dirty == 0) {
+            // the reclaimer sleeps until the new deadline (see reclaim.c)
+            lt->since = now.tv_sec;
+            pthread_cond_signal(&fs->reclaim_wake);
+        }
+        lt->dirty[in->num] = true;
+        lt->n_dirty++;
+    }
+    lt->mtime[in->num] = now;
+}
+
+bool lazytime_deadline(fs_ctx *fs, struct timespec *deadline)
+{
+    struct lazytime *lt = fs->lazytime;
+    if (lt == NULL || lt->n_dirty == 0) return false;
+    deadline->tv_sec = lt->since + LAZYTIME_EXPIRE;
+    deadline->tv_nsec = 0;
+    return true;
+}
+
+void lazytime_expire(fs_ctx *fs)
+{
+    struct lazytime *lt = fs->lazytime;
+    if (lt == NULL || lt->n_dirty == 0) return;
+
+    // not the coarse clock, which can lag behind the deadline
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec - lt->since >= LAZYTIME_EXPIRE) lazytime_flush(fs);
+}
+
+void lazytime_set(fs_ctx *fs, a1fs_inode *in, const struct timespec *t)
+{
+    lazytime_forget(fs, in->num);
+    in->mtime = *t;
+}
+
+struct timespec lazytime_get(fs_ctx *fs, const a1fs_inode *in)
+{
+    struct lazytime *lt = fs->lazytime;
+    if (lt != NULL && lt->dirty[in->num]) return lt->mtime[in->num];
+    return in->mtime;
+}
+
+void lazytime_forget(fs_ctx *fs, a1fs_ino_t ino)
+{
+    struct lazytime *lt = fs->lazytime;
+    if (lt == NULL || !lt->dirty[ino]) return;
+    lt->dirty[ino] = false;
+    lt->n_dirty--;
+}
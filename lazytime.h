@@ -0,0 +1,61 @@
+/**
+ * CSC369 Assignment 1 - Deferred inode timestamp updates header file.
+ *
+ * With the "lazytime" mount option, modification times are kept in memory
+ * (read from there by getattr) instead of being stored in the inode table on
+ * every write. They are written back on fsync(), on unmount, and when the
+ * oldest deferred update is LAZYTIME_EXPIRE seconds old; the background thread
+ * of reclaim.h wakes up for that even if the file system is idle. Without the
+ * option, every update goes straight to the inode.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Seconds after which deferred timestamps are written back. */
+#define LAZYTIME_EXPIRE 30
+
+
+/**
+ * Enable deferred timestamp updates for a file system context.
+ *
+ * @return  true on success; false if out of memory.
+ */
+bool lazytime_init(fs_ctx *fs);
+
+/** Write back the deferred timestamps and disable deferred updates. */
+void lazytime_destroy(fs_ctx *fs);
+
+/** Set the modification time of an inode to the current time. */
+void lazytime_touch(fs_ctx *fs, a1fs_inode *in);
+
+/** Set the modification time of an inode; stored in the inode right away. */
+void lazytime_set(fs_ctx *fs, a1fs_inode *in, const struct timespec *t);
+
+/** Get the current modification time of an inode. */
+struct timespec lazytime_get(fs_ctx *fs, const a1fs_inode *in);
+
+/** Drop the deferred timestamp of an inode that is being freed. */
+void lazytime_forget(fs_ctx *fs, a1fs_ino_t ino);
+
+/** Write all deferred timestamps back to the inode table. */
+void lazytime_flush(fs_ctx *fs);
+
+/**
+ * Get the time at which the deferred timestamps are due to be written back.
+ *
+ * @param fs        file system context.
+ * @param deadline  set to the time (CLOCK_REALTIME) the oldest deferred update
+ *                  expires at.
+ * @return          true if there are deferred timestamps; false otherwise.
+ */
+bool lazytime_deadline(fs_ctx *fs, struct timespec *deadline);
+
+/** Write the deferred timestamps back if the oldest one has expired. */
+void lazytime_expire(fs_ctx *fs);
@@ -0,0 +1,166 @@
+/**
+ * CSC369 Assignment 1 - LZ4 block format compression implementation.
+ *
+ * A block is a series of sequences. Each sequence is a token byte (literal
+ * length in the high 4 bits, match length - 4 in the low 4 bits), extra
+ * literal length bytes, the literals, a 2-byte little endian match offset and
+ * extra match length bytes. A length of 15 in the token continues in the extra
+ * bytes, each adding up to 255. The last sequence only has literals.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+
+/** Minimum match length. */
+#define MIN_MATCH 4
+/** The last 5 bytes are always literals... */
+#define LAST_LITERALS 5
+/** ...and the last match starts at least 12 bytes before the end. */
+#define MF_LIMIT 12
+/** Largest match offset. */
+#define MAX_OFFSET 65535
+
+#define HASH_BITS 12
+
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/** Write a length that did not fit into the token; returns NULL if out of space. */
+static uint8_t *write_length(uint8_t *op, const uint8_t *oend, size_t len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/** Write a sequence; match_len is 0 for the last one. Returns NULL if out of space. */
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *lit,
+                               size_t lit_len, size_t offset, size_t match_len)
+{
+    if (op >= oend) return NULL;
+    uint8_t *token = op++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15 && !(op = write_length(op, oend, lit_len - 15))) return NULL;
+
+    if ((size_t)(oend - op) < lit_len) return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0) return op;
+
+    if (oend - op < 2) return NULL;
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    size_t ml = match_len - MIN_MATCH;
+    *token |= ml < 15 ? ml : 15;
+    if (ml >= 15 && !(op = write_length(op, oend, ml - 15))) return NULL;
+    return op;
+}
+
+size_t lz4_compress(const void *src, size_t src_len, void *dst, size_t dst_cap)
+{
+    const uint8_t *in = src;
+    uint8_t *op = dst;
+    const uint8_t *oend = op + dst_cap;
+
+    // positions of the last occurrence of each hashed 4-byte sequence; a stale
+    // or zero entry is caught by comparing the bytes
+    uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t anchor = 0;
+    if (src_len > MF_LIMIT) {
+        size_t limit = src_len - MF_LIMIT;
+        for (size_t i = 1; i <= limit; ) {
+            uint32_t seq = read32(in + i);
+            uint32_t h = hash4(seq);
+            size_t ref = table[h];
+            table[h] = i;
+            if (i - ref > MAX_OFFSET || read32(in + ref) != seq) {
+                i++;
+                continue;
+            }
+
+            size_t len = MIN_MATCH;
+            while (i + len < src_len - LAST_LITERALS && in[ref + len] == in[i + len]) len++;
+
+            op = write_sequence(op, oend, in + anchor, i - anchor, i - ref, len);
+            if (op == NULL) return 0;
+            i += len;
+            anchor = i;
+        }
+    }
+
+    op = write_sequence(op, oend, in + anchor, src_len - anchor, 0, 0);
+    if (op == NULL) return 0;
+    return op - (uint8_t*)dst;
+}
+
+/** Read a length that did not fit into the token; returns false if truncated. */
+static bool read_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t b;
+    do {
+        if (*ip >= iend) return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+long lz4_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + src_len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + dst_cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !read_length(&ip, iend, &lit_len)) return -1;
+        if ((size_t)(iend - ip) < lit_len || (size_t)(oend - op) < lit_len) return -1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == iend) break;// last sequence
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t*)dst)) return -1;
+
+        size_t len = token & 15;
+        if (len == 15 && !read_length(&ip, iend, &len)) return -1;
+        len += MIN_MATCH;
+        if ((size_t)(oend - op) < len) return -1;
+
+        // the match can overlap the bytes it produces (e.g. runs)
+        const uint8_t *match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+        } else {
+            for (size_t k = 0; k < len; k++) op[k] = match[k];
+        }
+        op += len;
+    }
+    return op - (uint8_t*)dst;
+}
@@ -0,0 +1,34 @@
+/**
+ * CSC369 Assignment 1 - LZ4 block format compression header file.
+ *
+ * Produces and consumes raw LZ4 blocks (no frame header), as described in the
+ * LZ4 block format specification.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+
+/**
+ * Compress a buffer.
+ *
+ * @param src      data to compress.
+ * @param src_len  length of the data in bytes.
+ * @param dst      buffer that receives the compressed data.
+ * @param dst_cap  size of dst in bytes.
+ * @return         compressed length; 0 if it does not fit into dst_cap bytes.
+ */
+size_t lz4_compress(const void *src, size_t src_len, void *dst, size_t dst_cap);
+
+/**
+ * Decompress a buffer.
+ *
+ * @param src      compressed data.
+ * @param src_len  length of the compressed data in bytes.
+ * @param dst      buffer that receives the data.
+ * @param dst_cap  size of dst in bytes.
+ * @return         decompressed length; -1 if the data is corrupt or does not
+ *                 fit into dst_cap bytes.
+ */
+long lz4_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap);
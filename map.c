@@ -3,19 +3,26 @@
  */
 
 #include <fcntl.h>
+#include <linux/perf_event.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "map.h"
 #include "util.h"
 
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
 
-void *map_file(const char *path, size_t block_size, size_t *size)
+
+static void *map(const char *path, size_t block_size, size_t *size, bool writable, int flags)
 {
-	// Open the file for reading and writing
-	int fd = open(path, O_RDWR);
+	// Open the file for reading (and writing)
+	int fd = open(path, writable ? O_RDWR : O_RDONLY);
 	if (fd < 0) {
 		perror(path);
 		return NULL;
@@ -40,7 +47,8 @@ void *map_file(const char *path, size_t block_size, size_t *size)
 	}
 
 	// Map file contents into memory
-	addr = mmap(NULL, s.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+	addr = mmap(NULL, s.st_size, prot, MAP_SHARED | flags, fd, 0);
 	if (addr == MAP_FAILED) {
 		perror("mmap");
 		addr = NULL;
@@ -55,3 +63,87 @@ end:
 	close(fd);
 	return addr;
 }
+
+void *map_file(const char *path, size_t block_size, size_t *size)
+{
+	return map(path, block_size, size, true, 0);
+}
+
+void *map_file_flags(const char *path, size_t block_size, size_t *size, int flags)
+{
+	return map(path, block_size, size, true, flags);
+}
+
+void *map_file_readonly(const char *path, size_t block_size, size_t *size)
+{
+	return map(path, block_size, size, false, 0);
+}
+
+
+void map_populate(void *addr, size_t size)
+{
+	// read faults, as MAP_POPULATE does for shared mappings; write faults
+	// would mark the whole image dirty
+	if (madvise(addr, size, MADV_POPULATE_READ) == 0) return;
+
+	// kernels before 5.14: touch every page
+	long page = sysconf(_SC_PAGESIZE);
+	for (size_t off = 0; off < size; off += page) {
+		(void)*(volatile const char *)(addr + off);
+	}
+}
+
+bool map_residency(const void *addr, uint64_t *huge, uint64_t *locked)
+{
+	FILE *f = fopen("/proc/self/smaps", "r");
+	if (f == NULL) return false;
+
+	// each mapping starts with an "address-range perms ..." line followed by
+	// "Key: value kB" lines
+	char line[512];
+	bool found = false;
+	*huge = *locked = 0;
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long start, end, kb;
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			if (found) break;// past our mapping
+			found = start == (unsigned long)addr;
+			continue;
+		}
+		if (!found) continue;
+		if (sscanf(line, "FilePmdMapped: %lu kB", &kb) == 1 ||
+		    sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+		    sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1)
+		{
+			*huge += (uint64_t)kb << 10;
+		} else if (sscanf(line, "Locked: %lu kB", &kb) == 1) {
+			*locked = (uint64_t)kb << 10;
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+
+int tlb_counter_open(void)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.inherit = 1;// include the threads started later
+
+	// this process, any CPU
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+uint64_t tlb_counter_read(int fd)
+{
+	uint64_t count;
+	if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) return 0;
+	return count;
+}
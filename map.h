@@ -1,6 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 
 /**
@@ -15,3 +17,46 @@
  *                    NULL on failure.
  */
 void *map_file(const char *path, size_t block_size, size_t *size);
+
+/**
+ * Map the whole file into memory like map_file(), with extra mmap() flags
+ * (e.g. MAP_POPULATE).
+ */
+void *map_file_flags(const char *path, size_t block_size, size_t *size, int flags);
+
+/**
+ * Fault in all pages of a mapping, like MAP_POPULATE. Page tables are not
+ * inherited across fork(), so a mapping made before the process daemonizes has
+ * to be populated again after.
+ *
+ * @param addr  start of the mapping.
+ * @param size  size of the mapping in bytes.
+ */
+void map_populate(void *addr, size_t size);
+
+/**
+ * Map the whole file into memory read-only. Works while the image is mounted:
+ * the mapping shares the page cache with the file system driver.
+ */
+void *map_file_readonly(const char *path, size_t block_size, size_t *size);
+
+/**
+ * Get how much of a mapping is backed by huge pages and locked in memory, as
+ * reported by /proc/self/smaps.
+ *
+ * @param addr    start of the mapping.
+ * @param huge    receives the number of bytes mapped with huge pages.
+ * @param locked  receives the number of locked bytes.
+ * @return        true on success; false if the mapping was not found.
+ */
+bool map_residency(const void *addr, uint64_t *huge, uint64_t *locked);
+
+/**
+ * Start counting the data TLB misses of the calling process.
+ *
+ * @return  counter file descriptor; -1 if the counter is not available.
+ */
+int tlb_counter_open(void);
+
+/** Read a counter opened with tlb_counter_open(). */
+uint64_t tlb_counter_read(int fd);
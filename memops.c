@@ -0,0 +1,209 @@
+/**
+ * CSC369 Assignment 1 - Bulk zeroing and copying implementation.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MEMOPS_X86
+#endif
+
+#include "memops.h"
+
+/** Non-temporal stores are done on whole cache lines. */
+#define LINE 64
+
+
+/** A set of streaming kernels; dst is LINE-aligned and len a multiple of LINE. */
+typedef struct memops_kernel {
+    const char *name;
+    /** Whether the CPU supports the kernel. */
+    bool (*supported)(void);
+    void (*zero)(void *dst, size_t len);
+    void (*copy)(void *dst, const void *src, size_t len);
+} memops_kernel_t;
+
+
+static bool always(void)
+{
+    return true;
+}
+
+static void libc_zero(void *dst, size_t len)
+{
+    memset(dst, 0, len);
+}
+
+static void libc_copy(void *dst, const void *src, size_t len)
+{
+    memcpy(dst, src, len);
+}
+
+#ifdef MEMOPS_X86
+
+static bool has_sse2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2")))
+static void sse2_zero(void *dst, size_t len)
+{
+    __m128i z = _mm_setzero_si128();
+    for (__m128i *d = dst, *end = dst + len; d < end; d += 4) {
+        _mm_stream_si128(d, z);
+        _mm_stream_si128(d + 1, z);
+        _mm_stream_si128(d + 2, z);
+        _mm_stream_si128(d + 3, z);
+    }
+    _mm_sfence();
+}
+
+__attribute__((target("sse2")))
+static void sse2_copy(void *dst, const void *src, size_t len)
+{
+    const __m128i *s = src;
+    for (__m128i *d = dst, *end = dst + len; d < end; d += 4, s += 4) {
+        __m128i a = _mm_loadu_si128(s), b = _mm_loadu_si128(s + 1);
+        __m128i c = _mm_loadu_si128(s + 2), e = _mm_loadu_si128(s + 3);
+        _mm_stream_si128(d, a);
+        _mm_stream_si128(d + 1, b);
+        _mm_stream_si128(d + 2, c);
+        _mm_stream_si128(d + 3, e);
+    }
+    _mm_sfence();
+}
+
+static bool has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static void avx2_zero(void *dst, size_t len)
+{
+    __m256i z = _mm256_setzero_si256();
+    for (__m256i *d = dst, *end = dst + len; d < end; d += 2) {
+        _mm256_stream_si256(d, z);
+        _mm256_stream_si256(d + 1, z);
+    }
+    _mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void avx2_copy(void *dst, const void *src, size_t len)
+{
+    const __m256i *s = src;
+    for (__m256i *d = dst, *end = dst + len; d < end; d += 2, s += 2) {
+        __m256i a = _mm256_loadu_si256(s), b = _mm256_loadu_si256(s + 1);
+        _mm256_stream_si256(d, a);
+        _mm256_stream_si256(d + 1, b);
+    }
+    _mm_sfence();
+}
+
+static bool has_avx512(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+}
+
+__attribute__((target("avx512f")))
+static void avx512_zero(void *dst, size_t len)
+{
+    __m512i z = _mm512_setzero_si512();
+    for (__m512i *d = dst, *end = dst + len; d < end; d++) {
+        _mm512_stream_si512(d, z);
+    }
+    _mm_sfence();
+}
+
+__attribute__((target("avx512f")))
+static void avx512_copy(void *dst, const void *src, size_t len)
+{
+    const __m512i *s = src;
+    for (__m512i *d = dst, *end = dst + len; d < end; d++, s++) {
+        _mm512_stream_si512(d, _mm512_loadu_si512(s));
+    }
+    _mm_sfence();
+}
+
+#endif // MEMOPS_X86
+
+/** All kernels, best first; the last one works everywhere. */
+static const memops_kernel_t kernels[] = {
+#ifdef MEMOPS_X86
+    { "avx512", has_avx512, avx512_zero, avx512_copy },
+    { "avx2",   has_avx2,   avx2_zero,   avx2_copy   },
+    { "sse2",   has_sse2,   sse2_zero,   sse2_copy   },
+#endif
+    { "libc",   always,     libc_zero,   libc_copy   },
+};
+#define N_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+/** Kernel in use; picked on first use. Picking it twice at once does no harm. */
+static const memops_kernel_t *current;
+
+static const memops_kernel_t *kernel(void)
+{
+    const memops_kernel_t *k = __atomic_load_n(&current, __ATOMIC_RELAXED);
+    if (k != NULL) return k;
+    for (k = kernels; !k->supported(); k++) {}
+    __atomic_store_n(&current, k, __ATOMIC_RELAXED);
+    return k;
+}
+
+const char *memops_kernel(void)
+{
+    return kernel()->name;
+}
+
+bool memops_use(const char *name)
+{
+    for (size_t i = 0; i < N_KERNELS; i++) {
+        if (strcmp(kernels[i].name, name) == 0) {
+            if (!kernels[i].supported()) return false;
+            __atomic_store_n(&current, &kernels[i], __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/** Get the number of bytes from dst up to the next cache line boundary. */
+static size_t head_len(const void *dst)
+{
+    return -(uintptr_t)dst & (LINE - 1);
+}
+
+void mem_zero(void *dst, size_t len)
+{
+    if (len < MEMOPS_STREAM_MIN) {
+        memset(dst, 0, len);
+        return;
+    }
+    // the partial cache lines at both ends go through the cache
+    size_t head = head_len(dst);
+    size_t body = (len - head) & ~(size_t)(LINE - 1);
+    memset(dst, 0, head);
+    kernel()->zero(dst + head, body);
+    memset(dst + head + body, 0, len - head - body);
+}
+
+void mem_copy(void *dst, const void *src, size_t len)
+{
+    if (len < MEMOPS_STREAM_MIN) {
+        memcpy(dst, src, len);
+        return;
+    }
+    size_t head = head_len(dst);
+    size_t body = (len - head) & ~(size_t)(LINE - 1);
+    memcpy(dst, src, head);
+    kernel()->copy(dst + head, src + head, body);
+    memcpy(dst + head + body, src + head + body, len - head - body);
+}
@@ -0,0 +1,37 @@
+/**
+ * CSC369 Assignment 1 - Bulk zeroing and copying header file.
+ *
+ * Large writes into the image go around the CPU caches with non-temporal
+ * stores, so that a big write or truncate does not evict the metadata that
+ * the other callbacks keep using. The kernel is picked on first use from the
+ * instruction sets that the CPU supports (AVX-512, AVX2 or SSE2). Runs shorter
+ * than MEMOPS_STREAM_MIN are written with plain memset() and memcpy(), as they
+ * are likely to be read again soon and fit in the cache anyway.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/** Shortest run that is written with non-temporal stores. */
+#define MEMOPS_STREAM_MIN (64 * 1024)
+
+/** Zero len bytes at dst. */
+void mem_zero(void *dst, size_t len);
+
+/** Copy len bytes from src to dst; the ranges must not overlap. */
+void mem_copy(void *dst, const void *src, size_t len);
+
+/** Get the name of the kernel in use: "avx512", "avx2", "sse2" or "libc". */
+const char *memops_kernel(void);
+
+/**
+ * Use the kernel with the given name instead of the best one (e.g. to compare
+ * them).
+ *
+ * @return  true on success; false if there is no such kernel or the CPU does
+ *          not support it.
+ */
+bool memops_use(const char *name);
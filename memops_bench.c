@@ -0,0 +1,260 @@
+/**
+ * CSC369 Assignment 1 - Bulk zeroing and copying benchmark.
+ *
+ * Measures the bandwidth of each mem_zero()/mem_copy() kernel while another
+ * thread runs a metadata-like workload (dependent loads and stores over a
+ * small working set, like inode and directory lookups), and how much the bulk
+ * writes slow that workload down and make it miss the cache.
+ */
+
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memops.h"
+
+
+/** Command line options. */
+typedef struct bench_opts {
+    /** Size of the bulk buffers in MiB. */
+    unsigned long size_mb;
+    /** Size of each bulk zero or copy in KiB. */
+    unsigned long chunk_kb;
+    /** Metadata working set in KiB. */
+    unsigned long meta_kb;
+    /** Time to run each test for, in seconds. */
+    unsigned long seconds;
+
+    /** Print help and exit. */
+    bool help;
+
+} bench_opts;
+
+static const char *help_str = "\
+Usage: %s [-s size] [-c chunk] [-m meta] [-t seconds]\n\
+\n\
+Zero and copy a buffer in chunks with every bulk kernel the CPU supports,\n\
+while another thread runs a metadata workload, and report the bulk bandwidth\n\
+and the metadata operations per second and cache misses per operation. The\n\
+\"idle\" line is the metadata workload on its own; \"libc\" is memset() and\n\
+memcpy(), which go through the cache.\n\
+\n\
+Options:\n\
+    -s size     bulk buffer size in MiB (default 64)\n\
+    -c chunk    bytes zeroed or copied at a time, in KiB (default 128)\n\
+    -m meta     metadata working set in KiB (default 1024)\n\
+    -t seconds  duration of each test (default 2)\n\
+    -h          print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+    fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], bench_opts *opts)
+{
+    int o;
+    while ((o = getopt(argc, argv, "s:c:m:t:h")) != -1) {
+        switch (o) {
+            case 's': opts->size_mb  = strtoul(optarg, NULL, 10); break;
+            case 'c': opts->chunk_kb = strtoul(optarg, NULL, 10); break;
+            case 'm': opts->meta_kb  = strtoul(optarg, NULL, 10); break;
+            case 't': opts->seconds  = strtoul(optarg, NULL, 10); break;
+
+            case 'h': opts->help = true; return true;// skip other arguments
+
+            case '?': return false;
+            default : return false;
+        }
+    }
+    if (opts->size_mb == 0 || opts->chunk_kb == 0 || opts->meta_kb == 0 || opts->seconds == 0 ||
+        opts->chunk_kb > opts->size_mb * 1024)
+    {
+        fprintf(stderr, "Sizes and duration must be positive, and the chunk no larger than the buffer\n");
+        return false;
+    }
+    return true;
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** One cache line of the metadata working set; next links them into a random cycle. */
+typedef struct meta_line {
+    uint32_t next;
+    uint32_t count;
+    char pad[56];
+} meta_line;
+
+/** Metadata workload shared with its thread. */
+typedef struct meta_state {
+    meta_line *lines;
+    bool stop;
+    uint64_t ops;
+    /** Cache misses counted; UINT64_MAX if the counter is not available. */
+    uint64_t misses;
+} meta_state;
+
+/** Start counting the cache misses of the calling thread; -1 if not available. */
+static int miss_counter_open(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void *meta_thread(void *arg)
+{
+    meta_state *st = arg;
+    int fd = miss_counter_open();
+    uint64_t start = 0;
+    if (fd >= 0 && read(fd, &start, sizeof(start)) != sizeof(start)) {
+        close(fd);
+        fd = -1;
+    }
+
+    // every step depends on the previous one, like walking a directory
+    uint32_t i = 0;
+    uint64_t ops = 0;
+    while (!__atomic_load_n(&st->stop, __ATOMIC_RELAXED)) {
+        for (int k = 0; k < 1024; k++) {
+            meta_line *l = &st->lines[i];
+            l->count++;
+            i = l->next;
+        }
+        ops += 1024;
+    }
+
+    st->ops = ops;
+    st->misses = UINT64_MAX;
+    uint64_t end;
+    if (fd >= 0 && read(fd, &end, sizeof(end)) == sizeof(end)) st->misses = end - start;
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+/** Bulk workload: what to do with each chunk of the buffer. */
+enum bulk_op { BULK_NONE, BULK_ZERO, BULK_COPY };
+
+static void run(const bench_opts *opts, const char *name, enum bulk_op op,
+                void *dst, const void *src, meta_line *lines)
+{
+    meta_state st = { .lines = lines };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, meta_thread, &st) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    size_t size = opts->size_mb << 20, chunk = opts->chunk_kb << 10;
+    uint64_t bytes = 0;
+    double start = now(), elapsed;
+    do {
+        for (size_t off = 0; op != BULK_NONE && off + chunk <= size; off += chunk) {
+            if (op == BULK_ZERO) {
+                mem_zero(dst + off, chunk);
+            } else {
+                mem_copy(dst + off, src + off, chunk);
+            }
+            bytes += chunk;
+        }
+        if (op == BULK_NONE) usleep(10000);
+        elapsed = now() - start;
+    } while (elapsed < opts->seconds);
+    __atomic_store_n(&st.stop, true, __ATOMIC_RELAXED);
+    pthread_join(thread, NULL);
+
+    printf("%-8s %-5s ", name, op == BULK_ZERO ? "zero" : op == BULK_COPY ? "copy" : "-");
+    if (op == BULK_NONE) {
+        printf("%9s ", "-");
+    } else {
+        printf("%9.2f ", bytes / elapsed / 1e9);
+    }
+    printf("%12.2f ", st.ops / elapsed / 1e6);
+    if (st.misses == UINT64_MAX) {
+        printf("%14s\n", "n/a");
+    } else {
+        printf("%14.4f\n", (double)st.misses / st.ops);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    bench_opts opts = { .size_mb = 64, .chunk_kb = 128, .meta_kb = 1024, .seconds = 2 };
+    if (!parse_args(argc, argv, &opts)) {
+        // Invalid arguments, print help to stderr
+        print_help(stderr, argv[0]);
+        return 1;
+    }
+    if (opts.help) {
+        // Help requested, print it to stdout
+        print_help(stdout, argv[0]);
+        return 0;
+    }
+
+    size_t size = opts.size_mb << 20;
+    void *src = aligned_alloc(4096, size), *dst = aligned_alloc(4096, size);
+    size_t n_lines = (opts.meta_kb << 10) / sizeof(meta_line);
+    meta_line *lines = aligned_alloc(sizeof(meta_line), n_lines * sizeof(meta_line));
+    if (src == NULL || dst == NULL || lines == NULL || n_lines == 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    memset(src, 0xa1, size);
+    memset(dst, 0, size);
+
+    // a random cycle through all lines, so that the hardware prefetcher cannot
+    // guess the next one
+    uint32_t *order = malloc(n_lines * sizeof(*order));
+    if (order == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < n_lines; i++) order[i] = i;
+    srand(369);
+    for (size_t i = n_lines - 1; i > 0; i--) {
+        size_t j = rand() % (i + 1);
+        uint32_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    memset(lines, 0, n_lines * sizeof(meta_line));
+    for (size_t i = 0; i < n_lines; i++) lines[order[i]].next = order[(i + 1) % n_lines];
+    free(order);
+
+    printf("%lu MiB buffer, %lu KiB chunks, %lu KiB metadata, best kernel %s\n",
+           opts.size_mb, opts.chunk_kb, opts.meta_kb, memops_kernel());
+    printf("%-8s %-5s %9s %12s %14s\n", "kernel", "bulk", "GB/s", "meta Mops/s", "misses/op");
+    run(&opts, "idle", BULK_NONE, dst, src, lines);
+    static const char *names[] = { "libc", "sse2", "avx2", "avx512" };
+    for (size_t k = 0; k < sizeof(names) / sizeof(names[0]); k++) {
+        if (!memops_use(names[k])) continue;
+        run(&opts, names[k], BULK_ZERO, dst, src, lines);
+        run(&opts, names[k], BULK_COPY, dst, src, lines);
+    }
+
+    free(lines);
+    free(dst);
+    free(src);
+    return 0;
+}
@@ -1,3 +1,6 @@
+#define _GNU_SOURCE //for fallocate()
+
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,10 +17,15 @@
 
 /** Command line options. */
 typedef struct mkfs_opts {
-    /** File system image file path. */
-    const char *img_path;
+    /** File system image file paths; the data region is striped if there are several. */
+    char **img_paths;
+    unsigned int n_images;
     /** Number of inodes. */
     size_t n_inodes;
+    /** Block size in bytes. */
+    size_t block_size;
+    /** Stripe chunk size in bytes; 0 picks one. */
+    size_t chunk_size;
 
     /** Print help and exit. */
     bool help;
@@ -25,38 +33,58 @@ typedef struct mkfs_opts {
     bool force;
     /** Zero out image contents. */
     bool zero;
+    /** Initialize the whole inode table now rather than after mount. */
+    bool eager_itable;
 
 } mkfs_opts;
 
 static const char *help_str = "\
-Usage: %s options image\n\
+Usage: %s options image [image...]\n\
 \n\
 Format the image file into a1fs file system. The file must exist and\n\
-its size must be a multiple of a1fs block size - %zu bytes.\n\
+its size must be a multiple of the a1fs block size. With several images,\n\
+the data region is striped over all of them and the metadata is kept in\n\
+the first one.\n\
 \n\
 Options:\n\
-    -i num  number of inodes; required argument\n\
-    -h      print help and exit\n\
-    -f      force format - overwrite existing a1fs file system\n\
-    -z      zero out image contents\n\
+    -i num   number of inodes; required argument\n\
+    -b size  block size in bytes: 4096 (default), 16384 or 65536\n\
+    -c size  stripe chunk size in bytes, a power of 2 multiple of the block\n\
+             size; by default 16 blocks, or more if needed to fit a snapshot\n\
+    -h       print help and exit\n\
+    -f       force format - overwrite existing a1fs file system\n\
+    -z       zero out image contents\n\
+    -E       initialize the whole inode table now rather than after mount\n\
 ";
 
 static void print_help(FILE *f, const char *progname)
 {
-    fprintf(f, help_str, progname, A1FS_BLOCK_SIZE);
+    fprintf(f, help_str, progname);
 }
 
 
+/** Get the superblock log_block_size for a block size; -1 if it is not supported. */
+static int log_block_size(size_t block_size)
+{
+    for (int log = 0; log <= A1FS_LOG_BLOCK_SIZE_MAX; log += 2) {
+        if (block_size == (size_t)A1FS_BLOCK_SIZE << log) return log;
+    }
+    return -1;
+}
+
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
     char o;
-    while ((o = getopt(argc, argv, "i:hfvz")) != -1) {
+    while ((o = getopt(argc, argv, "i:b:c:hfvzE")) != -1) {
         switch (o) {
             case 'i': opts->n_inodes = strtoul(optarg, NULL, 10); break;
+            case 'b': opts->block_size = strtoul(optarg, NULL, 10); break;
+            case 'c': opts->chunk_size = strtoul(optarg, NULL, 10); break;
 
             case 'h': opts->help  = true; return true;// skip other arguments
             case 'f': opts->force = true; break;
             case 'z': opts->zero  = true; break;
+            case 'E': opts->eager_itable = true; break;
 
             case '?': return false;
             default : assert(false);
@@ -67,12 +95,28 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
         fprintf(stderr, "Missing image path\n");
         return false;
     }
-    opts->img_path = argv[optind];
+    opts->img_paths = argv + optind;
+    opts->n_images = argc - optind;
+    if (opts->n_images > A1FS_STRIPE_MAX) {
+        fprintf(stderr, "At most %d images can be striped\n", A1FS_STRIPE_MAX);
+        return false;
+    }
 
     if (opts->n_inodes == 0) {
         fprintf(stderr, "Missing or invalid number of inodes\n");
         return false;
     }
+    if (opts->block_size == 0) opts->block_size = A1FS_BLOCK_SIZE;
+    if (log_block_size(opts->block_size) < 0) {
+        fprintf(stderr, "Unsupported block size %zu\n", opts->block_size);
+        return false;
+    }
+    if (opts->chunk_size != 0 && (opts->chunk_size < opts->block_size ||
+        (opts->chunk_size & (opts->chunk_size - 1)) != 0 || opts->chunk_size / opts->block_size > 1u << 16))
+    {
+        fprintf(stderr, "Invalid stripe chunk size %zu\n", opts->chunk_size);
+        return false;
+    }
     return true;
 }
 
@@ -86,53 +130,176 @@ static bool a1fs_is_present(void *image)
     return true;
 }
 
+/** Determine if the image is already part of a striped a1fs. */
+static bool a1fs_member_is_present(void *image)
+{
+    return ((const a1fs_stripe_hdr *)image)->magic == A1FS_STRIPE_MAGIC;
+}
+
+
+/**
+ * Zero out the image file without touching its pages.
+ *
+ * Asks the host file system to zero the range (or to deallocate it, which also
+ * reads back as zeros) so that formatting a large image takes constant time.
+ *
+ * @param path  image file path.
+ * @param size  image size in bytes.
+ * @return      true on success; false if the host file system supports
+ *              neither operation and the caller has to zero the image itself.
+ */
+static bool zero_image(const char *path, size_t size)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return false;
+
+    bool ret = fallocate(fd, FALLOC_FL_ZERO_RANGE, 0, size) == 0 ||
+               fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, size) == 0;
+    close(fd);
+    return ret;
+}
+
 
 /**
  * Format the image into a1fs.
  *
  * NOTE: Must update mtime of the root directory.
  *
- * @param image  pointer to the start of the image.
- * @param size   image size in bytes.
- * @param opts   command line options.
- * @return       true on success;
- *               false on error, e.g. options are invalid for given image size.
+ * @param images  pointers to the start of the images (opts->n_images of them).
+ * @param sizes   image sizes in bytes.
+ * @param opts    command line options.
+ * @return        true on success;
+ *                false on error, e.g. options are invalid for given image size.
  */
-static bool mkfs(void *image, size_t size, mkfs_opts *opts)
+static bool mkfs(void *images[], size_t sizes[], mkfs_opts *opts)
 {
+    void *image = images[0];
+    size_t size = sizes[0];
+
     //NOTE: the mode of the root directory inode should be set to S_IFDIR | 0777
 
-    //Superblock initialized
+    //Superblock initialized; block numbers below are in units of block_size
+    size_t bs = opts->block_size;
+    //The inode bitmap is a single block with a byte per inode too
+    if (opts->n_inodes > bs) {
+        fprintf(stderr, "Warning: the inode bitmap tracks %zu inodes; using that many\n", bs);
+        opts->n_inodes = bs;
+    }
+    size_t itable_blocks = (opts->n_inodes * sizeof(a1fs_inode) + bs - 1) / bs;   //rounds up inode blocks
+
+    //Changed-block generations for at most as many data blocks as the block
+    //bitmap tracks; the data region is not known yet, so count all blocks
+    size_t total = 0;
+    for (unsigned int m = 0; m < opts->n_images; m++) total += sizes[m] / bs;
+    size_t cbt_blocks = ((total < bs ? total : bs) * sizeof(uint32_t) + bs - 1) / bs;
+    size_t meta_blocks = 4 + cbt_blocks + itable_blocks;
+    if (size % bs != 0 || meta_blocks >= size / bs) {
+        return false;   //partial last block, or no room for the root directory's block
+    }
+
+    //A snapshot's copy of the inode table has to fit in a stripe chunk
+    size_t stripe_chunk = opts->chunk_size / bs;
+    if (stripe_chunk == 0) {
+        stripe_chunk = 16;
+        while (stripe_chunk < itable_blocks + 2) stripe_chunk *= 2;
+    }
+    size_t stripe_rows = (size / bs - meta_blocks) / stripe_chunk;
+    for (unsigned int m = 1; m < opts->n_images; m++) {
+        if (sizes[m] % bs != 0 || sizes[m] / bs < 2) return false;
+        if ((sizes[m] / bs - 1) / stripe_chunk < stripe_rows) stripe_rows = (sizes[m] / bs - 1) / stripe_chunk;
+    }
+    //The block bitmap is a single block with a byte per data block; only that
+    //many rows of chunks are used, whatever the size of the images
+    bool clamped = false;
+    if (opts->n_images > 1 && stripe_rows > bs / (stripe_chunk * opts->n_images)) {
+        stripe_rows = bs / (stripe_chunk * opts->n_images);
+        clamped = true;
+    }
+    if (opts->n_images > 1 && stripe_rows == 0) return false;
     struct a1fs_superblock *sb = (struct a1fs_superblock *)(image + A1FS_BLOCK_SIZE);
+    memset(sb, 0, A1FS_BLOCK_SIZE);
     sb->magic = A1FS_MAGIC;
     sb->size = size;
+    sb->log_block_size = log_block_size(bs);
     sb->inode_count = opts->n_inodes;
-    sb->block_count = size/A1FS_BLOCK_SIZE - (3 + opts->n_inodes);  //total blocks - (sb, 2 bitmaps and total inodes)
     sb->used_block_count = 1;
     sb->used_inode_count = 1;
     sb->inode_bitmap = 2;
     sb->block_bitmap = 3;
-    sb->inode_table = 4;
-    sb->block_table = 4 + (opts->n_inodes * sizeof(a1fs_inode) + A1FS_BLOCK_SIZE-1)/A1FS_BLOCK_SIZE;    //rounds up inode blocks
+    sb->features = A1FS_FEATURE_CBT;
+    sb->cbt_table = 4;
+    sb->cbt_gen = 1;
+    sb->inode_table = 4 + cbt_blocks;
+    sb->block_table = meta_blocks;
+    sb->block_count = size/bs - sb->block_table;    //blocks in the data region
+    if (opts->n_images == 1 && sb->block_count > bs) {
+        sb->block_count = bs;   //as many as the block bitmap tracks
+        clamped = true;
+    }
+
+    //Striped: whole rows of chunks, one chunk in each image after its header
+    //block (after the metadata in the first one)
+    if (opts->n_images > 1) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        sb->features |= A1FS_FEATURE_STRIPE;
+        sb->stripe_count = opts->n_images;
+        sb->stripe_log_chunk = __builtin_ctzl(stripe_chunk);
+        sb->stripe_id = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        sb->block_count = stripe_rows * stripe_chunk * opts->n_images;
+        for (unsigned int m = 1; m < opts->n_images; m++) {
+            a1fs_stripe_hdr *hdr = images[m];
+            memset(hdr, 0, bs);
+            hdr->magic = A1FS_STRIPE_MAGIC;
+            hdr->id = sb->stripe_id;
+            hdr->index = m;
+            hdr->count = opts->n_images;
+        }
+    }
+
+    if (clamped) {
+        fprintf(stderr, "Warning: the block bitmap tracks %u data blocks; the rest of the image is not used\n",
+                sb->block_count);
+    }
+
+    //Only the inode table block with the root inode is zeroed now; the rest is
+    //zeroed by the driver after mount unless the whole image is already zero
+    if (opts->zero || opts->eager_itable || itable_blocks == 1) {
+        if (!opts->zero) memset(image + bs * sb->inode_table, 0, bs * itable_blocks);
+        sb->itable_init = itable_blocks;
+    } else {
+        memset(image + bs * sb->inode_table, 0, bs);
+        sb->features |= A1FS_FEATURE_LAZY_ITABLE;
+        sb->itable_init = 1;
+    }
 
     //initialize root inode
-    struct a1fs_inode *inode = (struct a1fs_inode *)(image + A1FS_BLOCK_SIZE * 4);
+    struct a1fs_inode *inode = (struct a1fs_inode *)(image + bs * sb->inode_table);
     inode->mode = S_IFDIR | 0777;
     inode->links = 2;
-    inode->size = 0;
+    inode->size = bs;
     clock_gettime(CLOCK_REALTIME, &inode->mtime);
-    inode->extent[0].start = 0;
-    inode->extent[0].count = 1;
-    inode->indirect = 0;
+    inode->ext_hdr.magic = A1FS_EXT_MAGIC;  //extent tree with a single leaf entry in the root
+    inode->ext_hdr.entries = 1;
+    inode->ext_hdr.max = A1FS_EXT_ROOT_MAX;
+    inode->ext_hdr.depth = 0;
+    inode->ext_root[0].leaf.lblk = 0;
+    inode->ext_root[0].leaf.ext.start = 0;
+    inode->ext_root[0].leaf.ext.count = 1;
+    inode->ext_last_leaf = 0;
     inode->block_count = 1; //block 0 is root
     inode->num = 0;
     inode->parent_num = 0;
     inode->extent_count = 1;
+    memset(image + bs * sb->block_table, 0, bs); //no entries in root yet
 
-    struct a1fs_ibitmap *imap = (struct a1fs_ibitmap *)(image + A1FS_BLOCK_SIZE * sb->inode_bitmap);
-    struct a1fs_bbitmap *bmap = (struct a1fs_bbitmap *)(image + A1FS_BLOCK_SIZE * sb->block_bitmap);
-    memset(image + A1FS_BLOCK_SIZE * sb->inode_bitmap, 0, A1FS_BLOCK_SIZE); //initialize bitmaps to 0
-    memset(image + A1FS_BLOCK_SIZE * sb->block_bitmap, 0, A1FS_BLOCK_SIZE);
+    struct a1fs_ibitmap *imap = (struct a1fs_ibitmap *)(image + bs * sb->inode_bitmap);
+    struct a1fs_bbitmap *bmap = (struct a1fs_bbitmap *)(image + bs * sb->block_bitmap);
+    memset(imap, 0, bs); //initialize bitmaps to 0
+    memset(bmap, 0, bs);
+    uint32_t *cbt = (uint32_t *)(image + bs * sb->cbt_table);
+    memset(cbt, 0, bs * cbt_blocks);
+    cbt[0] = sb->cbt_gen; //root directory block
     imap->map[0] = 1;   //allocate root inode and block
     bmap->map[0] = 1;
     return true;
@@ -153,26 +320,34 @@ int main(int argc, char *argv[])
         return 0;
     }
 
-    // Map image file into memory
-    size_t size;
-    void *image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &size);
-    if (image == NULL) return 1;
+    // Map image files into memory
+    void *images[A1FS_STRIPE_MAX];
+    size_t sizes[A1FS_STRIPE_MAX];
+    unsigned int mapped;
+    int ret = 1;
+    for (mapped = 0; mapped < opts.n_images; mapped++) {
+        images[mapped] = map_file(opts.img_paths[mapped], A1FS_BLOCK_SIZE, &sizes[mapped]);
+        if (images[mapped] == NULL) goto end;
+    }
 
     // Check if overwriting existing file system
-    int ret = 1;
-    if (!opts.force && a1fs_is_present(image)) {
-        fprintf(stderr, "Image already contains a1fs; use -f to overwrite\n");
-        goto end;
+    for (unsigned int i = 0; i < opts.n_images; i++) {
+        if (!opts.force && (a1fs_is_present(images[i]) || a1fs_member_is_present(images[i]))) {
+            fprintf(stderr, "%s already contains a1fs; use -f to overwrite\n", opts.img_paths[i]);
+            goto end;
+        }
     }
 
-    if (opts.zero) memset(image, 0, size);
-    if (!mkfs(image, size, &opts)) {
+    for (unsigned int i = 0; i < opts.n_images; i++) {
+        if (opts.zero && !zero_image(opts.img_paths[i], sizes[i])) memset(images[i], 0, sizes[i]);
+    }
+    if (!mkfs(images, sizes, &opts)) {
         fprintf(stderr, "Failed to format the image\n");
         goto end;
     }
 
     ret = 0;
 end:
-    munmap(image, size);
+    for (unsigned int i = 0; i < mapped; i++) munmap(images[i], sizes[i]);
     return ret;
 }
@@ -10,9 +10,24 @@
 
 #define A1FS_OPT(t, p) { t, offsetof(a1fs_opts, p), 1 }
 
+/** Default and largest size of reads and writes; FUSE requests are at most 1 MiB. */
+#define A1FS_IO_DEFAULT 4096
+#define A1FS_IO_MAX (1024 * 1024)
+
 static const struct fuse_opt opt_spec[] = {
 	A1FS_OPT("-h"    , help),
 	A1FS_OPT("--help", help),
+	A1FS_OPT("snapshot=%s", snapshot),
+	A1FS_OPT("stripe=%s"  , stripe),
+	A1FS_OPT("lazytime"   , lazytime),
+	A1FS_OPT("hugepage"   , hugepage),
+	A1FS_OPT("populate"   , populate),
+	A1FS_OPT("mlock"      , mlock),
+	A1FS_OPT("discard"    , discard),
+	A1FS_OPT("writeback_cache", writeback_cache),
+	A1FS_OPT("readdirplus"    , readdirplus),
+	A1FS_OPT("copy_file_range", copy_file_range),
+	A1FS_OPT("max_io=%u"      , max_io),
 	FUSE_OPT_END
 };
 
@@ -26,6 +41,25 @@ general options:\n\
     -o opt,[opt...]        mount options\n\
     -h   --help            print help\n\
 \n\
+a1fs options:\n\
+    -o snapshot=NAME       mount snapshot NAME read-only\n\
+    -o stripe=IMG[:IMG...] the other image files of a striped file system,\n\
+                           in order\n\
+    -o lazytime            keep modification times in memory and write them\n\
+                           back on fsync, unmount or after a while\n\
+    -o hugepage            map the image with transparent huge pages\n\
+    -o populate            fault the whole image in at mount\n\
+    -o mlock               lock the superblock, bitmaps and inode table\n\
+                           in memory\n\
+    -o discard             punch holes in the image files where blocks\n\
+                           are freed\n\
+    -o writeback_cache     let the kernel cache writes and merge small ones\n\
+    -o readdirplus         return the attributes of the entries with readdir\n\
+    -o copy_file_range     implement copy_file_range(); whole file copies\n\
+                           share the data blocks\n\
+    -o max_io=BYTES        largest read or write request, a multiple of 4096\n\
+                           up to 1 MiB (default 4096)\n\
+\n\
 ";
 
 // Callback for fuse_opt_parse()
@@ -49,20 +83,34 @@ bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 	//NOTE: printing to stderr to keep it consistent with FUSE
 	if (opts->help) {
 		fprintf(stderr, help_str, args->argv[0]);
-		fuse_opt_add_arg(args, "-ho");
+		// FUSE prints its own options; the usage line has been printed above
+		fuse_opt_add_arg(args, "--help");
+		args->argv[0][0] = '\0';
 	}
 	if (!opts->help && !opts->img_path) {
 		fprintf(stderr, "Missing image path\n");
 		return false;
 	}
 
+	// Snapshots are never modified
+	if (opts->snapshot) {
+		fuse_opt_add_arg(args, "-o");
+		fuse_opt_add_arg(args, "ro");
+	}
 	// Only single-threaded mount is supported
 	fuse_opt_add_arg(args, "-s");
-	// Limit the size of reads and writes to 4K
-	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_read=4096");
+	// Limit the size of reads and writes; 4K unless asked otherwise. The
+	// largest write is set when the connection is set up (see a1fs_start()),
+	// but the largest read also has to be a mount option.
+	if (opts->max_io == 0) opts->max_io = A1FS_IO_DEFAULT;
+	if (opts->max_io % 4096 != 0 || opts->max_io > A1FS_IO_MAX) {
+		fprintf(stderr, "max_io must be a multiple of 4096 up to %u\n", A1FS_IO_MAX);
+		return false;
+	}
+	char max_read[32];
+	snprintf(max_read, sizeof(max_read), "max_read=%u", opts->max_io);
 	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_write=4096");
+	fuse_opt_add_arg(args, max_read);
 
 	return true;
 }
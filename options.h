@@ -9,6 +9,27 @@
 typedef struct a1fs_opts {
 	/** a1fs image file path. */
 	const char *img_path;
+	/** Name of the snapshot to mount read-only instead of the live file system. */
+	const char *snapshot;
+	/** The other image files of a striped file system, separated by ':'. */
+	char *stripe;
+	/** Defer modification time updates (see lazytime.h). */
+	int lazytime;
+	/** Image mapping options: transparent huge pages, prefaulting, and locking
+	 *  the metadata blocks in memory. */
+	int hugepage;
+	int populate;
+	int mlock;
+	/** Discard blocks as they are freed (see discard.h). */
+	int discard;
+	/** FUSE connection options: let the kernel cache and merge writes, pass
+	 *  the attributes of the entries along with readdir(), and implement
+	 *  copy_file_range() (see a1fs_start() and a1fs_copy_file_range()). */
+	int writeback_cache;
+	int readdirplus;
+	int copy_file_range;
+	/** Largest read or write request in bytes. */
+	unsigned int max_io;
 	/** Print help and exit. FUSE option. */
 	int help;
 
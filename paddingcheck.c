@@ -5,8 +5,8 @@
 int main()
 {
 	printf("inode: %ld\r\n", sizeof(struct a1fs_inode));
-	printf("indirect size: %ld\r\n", sizeof(struct a1fs_indirect_ext));
-	printf("pointer to indirect size: %ld\r\n", sizeof(struct a1fs_indirect_ext *));
+	printf("extent tree entry: %ld\r\n", sizeof(union a1fs_ext_entry));
+	printf("extent tree node entries: %ld\r\n", A1FS_EXT_NODE_MAX(A1FS_BLOCK_SIZE));
 	// printf("entry size: %ld\n", sizeof(a1fs_dentry));
 	// printf("inode bitmap: %ld\n", sizeof(a1fs_ibitmap));
 	// printf("%block bitmap: ld\n", sizeof(a1fs_bbitmap));
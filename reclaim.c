@@ -0,0 +1,167 @@
+/**
+ * CSC369 Assignment 1 - Background block reclamation implementation.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "alloc.h"
+#include "compress.h"
+#include "discard.h"
+#include "extent.h"
+#include "lazytime.h"
+#include "reclaim.h"
+
+
+/** Put an inode at the head of the orphan list and wake up the reclaimer. */
+static void orphan_push(fs_ctx *fs, a1fs_inode *in)
+{
+    in->flags |= A1FS_INODE_ORPHAN;
+    in->links = 0;
+    in->orphan_next = fs->sb->orphan_head;
+    fs->sb->orphan_head = in->num;
+    pthread_cond_signal(&fs->reclaim_wake);
+}
+
+/** Free an inode and all of its blocks right away. */
+static void release(fs_ctx *fs, a1fs_inode *in)
+{
+    free_inode(fs, in->num);
+    ext_truncate(fs, in, 0);
+    memset(in, 0, sizeof(a1fs_inode));
+}
+
+void reclaim_inode(fs_ctx *fs, a1fs_inode *in)
+{
+    compress_forget(fs, in->num);
+    lazytime_forget(fs, in->num);
+    if (in->block_count <= RECLAIM_INLINE) {
+        release(fs, in);
+    } else {
+        orphan_push(fs, in);
+    }
+}
+
+/**
+ * Insert the extents of in from logical block nblocks onwards (n is the end)
+ * into tail. An uncompressed extent that nblocks falls into is split; a
+ * compressed one stays with in, as with ext_truncate().
+ */
+static int move_tail(fs_ctx *fs, a1fs_inode *tail, const a1fs_inode *in,
+                     a1fs_blk_t nblocks, a1fs_blk_t n)
+{
+    for (a1fs_blk_t l = nblocks; l < n; ) {
+        a1fs_ext_leaf leaf;
+        if (!ext_find(fs, in, l, &leaf)) return -EIO;// files have no holes
+        l = leaf.lblk + leaf.ext.count;
+        if (leaf.lblk < nblocks) {
+            if (leaf.zinfo != 0) continue;
+            a1fs_blk_t skip = nblocks - leaf.lblk;
+            leaf.lblk = nblocks;
+            leaf.ext.start += skip;
+            leaf.ext.count -= skip;
+        }
+        int ret = ext_insert(fs, tail, &leaf);
+        if (ret < 0) return ret;
+    }
+    return 0;
+}
+
+void reclaim_truncate(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t nblocks)
+{
+    a1fs_blk_t n = ext_nblocks(fs, in);
+    long ino = n > nblocks + RECLAIM_INLINE ? alloc_inode(fs) : -1;
+    if (ino < 0) {
+        ext_truncate(fs, in, nblocks);
+        return;
+    }
+
+    a1fs_inode *tail = &fs->itable[ino];
+    memset(tail, 0, sizeof(a1fs_inode));
+    tail->mode = S_IFREG;
+    tail->num = ino;
+    tail->parent_num = in->num;
+    clock_gettime(CLOCK_REALTIME, &tail->mtime);
+    ext_init(tail);
+    if (move_tail(fs, tail, in, nblocks, n) < 0) {
+        //out of blocks for the tail's extent tree; free the tail in place
+        ext_detach(fs, tail, 0);
+        free_inode(fs, ino);
+        memset(tail, 0, sizeof(a1fs_inode));
+        ext_truncate(fs, in, nblocks);
+        return;
+    }
+    ext_detach(fs, in, nblocks);
+    orphan_push(fs, tail);
+}
+
+bool reclaim_step(fs_ctx *fs)
+{
+    a1fs_ino_t ino = fs->sb->orphan_head;
+    if (ino == 0) return false;
+
+    // free from the end so that the extent tree shrinks leaf by leaf
+    a1fs_inode *in = &fs->itable[ino];
+    a1fs_blk_t n = ext_nblocks(fs, in);
+    if (n > 0) {
+        ext_truncate(fs, in, n > RECLAIM_BATCH ? n - RECLAIM_BATCH : 0);
+    } else {
+        fs->sb->orphan_head = in->orphan_next;
+        release(fs, in);
+    }
+    discard_flush(fs);
+    return true;
+}
+
+
+/* Waits for a new orphan or for reclaim_stop(). With deferred timestamps
+ * (see lazytime.h), also wakes up to write them back when they expire.
+ */
+static void idle_wait(fs_ctx *fs)
+{
+    struct timespec deadline;
+    if (!lazytime_deadline(fs, &deadline)) {
+        pthread_cond_wait(&fs->reclaim_wake, &fs->lock);
+    } else if (pthread_cond_timedwait(&fs->reclaim_wake, &fs->lock, &deadline) == ETIMEDOUT) {
+        lazytime_expire(fs);
+    }
+}
+
+static void *reclaim_thread(void *arg)
+{
+    fs_ctx *fs = (fs_ctx*)arg;
+    pthread_mutex_lock(&fs->lock);
+    while (!fs->reclaim_quit) {
+        if (!reclaim_step(fs)) {
+            idle_wait(fs);
+            continue;
+        }
+        //let the file system callbacks in between batches
+        pthread_mutex_unlock(&fs->lock);
+        sched_yield();
+        pthread_mutex_lock(&fs->lock);
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return NULL;
+}
+
+bool reclaim_start(fs_ctx *fs)
+{
+    fs->reclaim_quit = false;
+    if (pthread_create(&fs->reclaim_thread, NULL, reclaim_thread, fs) != 0) return false;
+    fs->reclaim_running = true;
+    return true;
+}
+
+void reclaim_stop(fs_ctx *fs)
+{
+    if (!fs->reclaim_running) return;
+    pthread_mutex_lock(&fs->lock);
+    fs->reclaim_quit = true;
+    pthread_cond_signal(&fs->reclaim_wake);
+    pthread_mutex_unlock(&fs->lock);
+    pthread_join(fs->reclaim_thread, NULL);
+    fs->reclaim_running = false;
+}
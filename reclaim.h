@@ -0,0 +1,67 @@
+/**
+ * CSC369 Assignment 1 - Background block reclamation header file.
+ *
+ * Freeing the blocks of a large file takes time proportional to its size, so
+ * unlink and truncate do not wait for it. The inode (or, for a truncate, a new
+ * inode that takes over the cut-off extents) is put on the orphan list in the
+ * superblock instead, and a background thread frees its blocks in batches of
+ * RECLAIM_BATCH, then the inode itself. The list survives unmounts and crashes;
+ * the reclaimer picks it up again at the next mount.
+ *
+ * The reclaimer runs with fs->lock held; every callback that modifies the file
+ * system must hold it too. While idle, the thread also writes back the deferred
+ * timestamps of the lazytime option when they expire (see lazytime.h).
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Files with at most this many blocks (or tails that short) are freed right away. */
+#define RECLAIM_INLINE 64
+/** Number of blocks the reclaimer frees before it lets go of fs->lock. */
+#define RECLAIM_BATCH 256
+
+
+/**
+ * Start the background reclaimer.
+ *
+ * @param fs  file system context.
+ * @return    true on success; false if the thread could not be created.
+ */
+bool reclaim_start(fs_ctx *fs);
+
+/** Stop the background reclaimer; the orphans left are kept for the next mount. */
+void reclaim_stop(fs_ctx *fs);
+
+/**
+ * Free an inode that no directory entry refers to any more, together with its
+ * data and extent tree blocks. Large files are put on the orphan list.
+ *
+ * @param fs  file system context.
+ * @param in  inode.
+ */
+void reclaim_inode(fs_ctx *fs, a1fs_inode *in);
+
+/**
+ * Free the blocks of an uncompressed file from logical block nblocks onwards,
+ * like ext_truncate(). A long tail is handed over to a new orphan inode.
+ *
+ * @param fs       file system context.
+ * @param in       inode.
+ * @param nblocks  number of logical blocks to keep.
+ */
+void reclaim_truncate(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t nblocks);
+
+/**
+ * Free one batch of blocks of the first orphan; the orphan is freed once it
+ * has no blocks left. Must be called with fs->lock held.
+ *
+ * @param fs  file system context.
+ * @return    true if a batch was freed; false if the orphan list is empty.
+ */
+bool reclaim_step(fs_ctx *fs);
@@ -0,0 +1,97 @@
+/**
+ * CSC369 Assignment 1 - Shared (reflinked) file data implementation.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "compress.h"
+#include "extent.h"
+#include "reflink.h"
+
+
+/** Check that every data block of a file can take one more reference. */
+static bool can_share(fs_ctx *fs, const a1fs_inode *src)
+{
+    a1fs_ext_leaf leaf;
+    for (a1fs_blk_t l = 0; ext_find(fs, src, l, &leaf); l = leaf.lblk + leaf.ext.count) {
+        a1fs_blk_t n = ext_pcount(fs, &leaf);
+        for (a1fs_blk_t b = leaf.ext.start; b < leaf.ext.start + n; b++) {
+            if (block_refs(fs, b) == A1FS_BLOCK_REFS_MAX) return false;
+        }
+    }
+    return true;
+}
+
+/** Share the extents of src with dst, whose tree must be empty. */
+static int share(fs_ctx *fs, a1fs_inode *dst, const a1fs_inode *src)
+{
+    a1fs_ext_leaf leaf;
+    for (a1fs_blk_t l = 0; ext_find(fs, src, l, &leaf); l = leaf.lblk + leaf.ext.count) {
+        // the extent is counted in dst's block_count like one of its own
+        ref_blocks(fs, leaf.ext.start, ext_pcount(fs, &leaf));
+        if (ext_insert(fs, dst, &leaf) < 0) {
+            free_blocks(fs, leaf.ext.start, ext_pcount(fs, &leaf));
+            ext_truncate(fs, dst, 0);
+            return -ENOSPC;
+        }
+    }
+    return 0;
+}
+
+int reflink_share(fs_ctx *fs, a1fs_inode *dst, const a1fs_inode *src)
+{
+    if (!can_share(fs, src)) return -EMLINK;
+    return share(fs, dst, src);
+}
+
+int reflink_clone(fs_ctx *fs, a1fs_inode *dst, const a1fs_inode *src)
+{
+    // check every extent first so that -EMLINK leaves dst as it was
+    if (!can_share(fs, src)) return -EMLINK;
+
+    ext_truncate(fs, dst, 0);
+    compress_forget(fs, dst->num);
+    dst->size = 0;
+    int ret = share(fs, dst, src);
+    if (ret < 0) return ret;
+
+    dst->size = src->size;
+    dst->flags = (dst->flags & ~A1FS_INODE_COMPRESS) | (src->flags & A1FS_INODE_COMPRESS);
+    return 0;
+}
+
+int reflink_map_write(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t lblk, a1fs_blk_t count,
+                      a1fs_blk_t *pblk, a1fs_blk_t *run)
+{
+    a1fs_blk_t b, n;
+    if (!ext_map(fs, in, lblk, &b, &n)) return -EIO;
+    if (n > count) n = count;
+
+    // the longest prefix that is either all private or all shared
+    bool shared = block_refs(fs, b) > 1;
+    a1fs_blk_t k = 1;
+    while (k < n && (block_refs(fs, b + k) > 1) == shared) k++;
+    if (!shared) {
+        *pblk = b;
+        *run = k;
+        return 0;
+    }
+
+    a1fs_ext_leaf last;
+    a1fs_blk_t goal = ext_last(fs, in, &last) ? last.ext.start + last.ext.count : 0;
+    a1fs_blk_t got;
+    long copy = alloc_blocks(fs, goal, k, &got);
+    if (copy < 0) return -ENOSPC;
+    fs_data_copy(fs, copy, b, got);
+    if (ext_remap(fs, in, lblk, got, copy) < 0) {
+        free_blocks(fs, copy, got);
+        return -ENOSPC;
+    }
+    free_blocks(fs, b, got);
+
+    *pblk = copy;
+    *run = got;
+    return 0;
+}
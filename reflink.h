@@ -0,0 +1,57 @@
+/**
+ * CSC369 Assignment 1 - Shared (reflinked) file data header file.
+ *
+ * A cloned file shares the data blocks of its source instead of copying them;
+ * only the extent tree is copied. The reference count of each data block is
+ * kept in the block bitmap (see a1fs.h). A shared block is copied before it
+ * is written to, so every file only sees its own writes.
+ */
+
+#pragma once
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/**
+ * Make a file share all data of another one.
+ *
+ * The old data of dst is dropped, and dst gets the size and the compression
+ * flag of src. Takes time proportional to the number of extents of src, not
+ * to its size, and uses no data blocks.
+ *
+ * @param fs   file system context.
+ * @param dst  inode of the destination file.
+ * @param src  inode of the source file.
+ * @return     0 on success; -EMLINK if a block of src is shared too many
+ *             times already; -ENOSPC if there are no blocks for the new
+ *             extent tree nodes (dst is left empty then).
+ */
+int reflink_clone(fs_ctx *fs, a1fs_inode *dst, const a1fs_inode *src);
+
+/**
+ * Make an inode with an empty extent tree share all data blocks of a file.
+ *
+ * Only the extent tree is built; the other fields of dst are left alone.
+ *
+ * @return  0 on success; -EMLINK if a block of src is shared too many times
+ *          already; -ENOSPC if there are no blocks for the new extent tree
+ *          nodes (the tree of dst is empty again then).
+ */
+int reflink_share(fs_ctx *fs, a1fs_inode *dst, const a1fs_inode *src);
+
+/**
+ * Map the logical blocks of an uncompressed file that are about to be
+ * written, copying the shared ones first.
+ *
+ * @param fs     file system context.
+ * @param in     inode of the file.
+ * @param lblk   first logical block to write; must be mapped.
+ * @param count  number of blocks to write.
+ * @param pblk   receives the data block that lblk maps to.
+ * @param run    receives the number of contiguous blocks from pblk onwards
+ *               (at most count) that can be written.
+ * @return       0 on success; -ENOSPC if a shared block cannot be copied.
+ */
+int reflink_map_write(fs_ctx *fs, a1fs_inode *in, a1fs_blk_t lblk, a1fs_blk_t count,
+                      a1fs_blk_t *pblk, a1fs_blk_t *run);
@@ -0,0 +1,317 @@
+/**
+ * CSC369 Assignment 1 - a1fs image restore.
+ *
+ * Rebuilds the image files of a file system from a dump written by
+ * dump.a1fs. The images are created as sparse files, so only the blocks in
+ * the dump take up space. An incremental dump is applied to existing images
+ * instead.
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "dump.h"
+#include "fs_ctx.h"
+#include "map.h"
+
+/** Size of the input buffer; the runs are read with I/O this large. */
+#define RESTORE_BUF_SIZE (1 << 20)
+
+
+/** Command line options. */
+typedef struct restore_opts {
+    /** Image file paths to create, more than one if striped. */
+    char **paths;
+    unsigned int n_paths;
+    /** Input file path; NULL for stdin. */
+    const char *in_path;
+
+    /** Print help and exit. */
+    bool help;
+    /** Overwrite image files that already exist. */
+    bool force;
+
+} restore_opts;
+
+static const char *help_str = "\
+Usage: %s [-f] [-i file] image [image...]\n\
+\n\
+Create the image files of an a1fs file system from a dump written by\n\
+dump.a1fs. The images are sparse files of their original size. A file system\n\
+that was striped over several image files needs as many paths, in order.\n\
+\n\
+An incremental dump (dump.a1fs -s) is applied to the existing images, which\n\
+must have been restored up to the checkpoint the dump starts from.\n\
+\n\
+Options:\n\
+    -i file  read the dump from file instead of stdin\n\
+    -f       overwrite image files that already exist\n\
+    -h       print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+    fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], restore_opts *opts)
+{
+    int o;
+    while ((o = getopt(argc, argv, "i:fh")) != -1) {
+        switch (o) {
+            case 'i': opts->in_path = optarg; break;
+
+            case 'h': opts->help  = true; return true;// skip other arguments
+            case 'f': opts->force = true; break;
+
+            case '?': return false;
+            default : assert(false);
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Missing image path\n");
+        return false;
+    }
+    opts->paths = argv + optind;
+    opts->n_paths = argc - optind;
+    if (opts->n_paths > A1FS_STRIPE_MAX) {
+        fprintf(stderr, "Too many image paths\n");
+        return false;
+    }
+    return true;
+}
+
+
+/** Restore in progress. */
+typedef struct restore_state {
+    const restore_opts *opts;
+    FILE *in;
+    a1fs_dump_hdr hdr;
+    /** Image files, created empty at their final size. */
+    int fds[A1FS_STRIPE_MAX];
+    /** Mapping of the first image. */
+    void *image;
+    size_t image_size;
+    /** Set up on the first data record, once the metadata is in place. */
+    fs_ctx fs;
+    bool fs_ready;
+    /** Number of blocks restored so far. */
+    uint64_t blocks;
+} restore_state;
+
+static bool get(restore_state *st, void *buf, size_t len)
+{
+    if (fread(buf, 1, len, st->in) == len) return true;
+    fprintf(stderr, "%s: %s\n", st->opts->in_path ? st->opts->in_path : "stdin",
+            ferror(st->in) ? "read error" : "truncated dump");
+    return false;
+}
+
+/** Open the images that an incremental dump is applied to, and check that it fits them. */
+static bool open_images(restore_state *st)
+{
+    const restore_opts *opts = st->opts;
+    for (unsigned int m = 0; m < opts->n_paths; m++) {
+        struct stat s;
+        st->fds[m] = open(opts->paths[m], O_RDWR);
+        if (st->fds[m] < 0 || fstat(st->fds[m], &s) < 0) {
+            perror(opts->paths[m]);
+            return false;
+        }
+        if ((uint64_t)s.st_size != st->hdr.image_size[m]) {
+            fprintf(stderr, "%s: image is %lu bytes, the dump is of %lu\n", opts->paths[m],
+                    (unsigned long)s.st_size, (unsigned long)st->hdr.image_size[m]);
+            return false;
+        }
+    }
+
+    st->image = map_file(opts->paths[0], st->hdr.block_size, &st->image_size);
+    if (st->image == NULL) return false;
+    const a1fs_superblock *sb = st->image + A1FS_BLOCK_SIZE;
+    if (sb->magic != A1FS_MAGIC || !(sb->features & A1FS_FEATURE_CBT) || sb->cbt_gen != st->hdr.since) {
+        fprintf(stderr, "%s: the dump holds the changes since checkpoint %u, the image is not at it\n",
+                opts->paths[0], st->hdr.since);
+        return false;
+    }
+    return true;
+}
+
+static bool create_images(restore_state *st)
+{
+    const restore_opts *opts = st->opts;
+    int flags = O_RDWR | O_CREAT | (opts->force ? O_TRUNC : O_EXCL);
+    for (unsigned int m = 0; m < opts->n_paths; m++) {
+        st->fds[m] = open(opts->paths[m], flags, 0644);
+        // the file is extended without writing, so it stays sparse
+        if (st->fds[m] < 0 || ftruncate(st->fds[m], st->hdr.image_size[m]) < 0) {
+            perror(opts->paths[m]);
+            return false;
+        }
+    }
+
+    st->image = map_file(opts->paths[0], st->hdr.block_size, &st->image_size);
+    return st->image != NULL;
+}
+
+static bool read_header(restore_state *st)
+{
+    a1fs_dump_hdr *hdr = &st->hdr;
+    if (!get(st, hdr, sizeof(*hdr))) return false;
+    if (hdr->magic != A1FS_DUMP_MAGIC) {
+        fprintf(stderr, "Not an a1fs dump\n");
+        return false;
+    }
+    if (hdr->version != A1FS_DUMP_VERSION) {
+        fprintf(stderr, "Unsupported dump version %u\n", hdr->version);
+        return false;
+    }
+    if (hdr->block_size < A1FS_BLOCK_SIZE || (hdr->block_size & (hdr->block_size - 1)) != 0) {
+        fprintf(stderr, "Invalid block size %u in the dump\n", hdr->block_size);
+        return false;
+    }
+    if (hdr->n_images != st->opts->n_paths) {
+        fprintf(stderr, "The dump has %u images, %u given\n", hdr->n_images, st->opts->n_paths);
+        return false;
+    }
+    return true;
+}
+
+static bool restore_meta(restore_state *st, const a1fs_dump_rec *rec, void *buf)
+{
+    size_t bs = st->hdr.block_size;
+    if (st->fs_ready || rec->image >= st->hdr.n_images ||
+        rec->start + rec->count > st->hdr.image_size[rec->image] / bs)
+    {
+        fprintf(stderr, "Invalid metadata record in the dump\n");
+        return false;
+    }
+    if (rec->image == 0) return get(st, st->image + rec->start * bs, rec->count * bs);
+
+    if (!get(st, buf, rec->count * bs)) return false;
+    if (pwrite(st->fds[rec->image], buf, rec->count * bs, rec->start * bs) != (ssize_t)(rec->count * bs)) {
+        perror(st->opts->paths[rec->image]);
+        return false;
+    }
+    return true;
+}
+
+static bool restore_data(restore_state *st, const a1fs_dump_rec *rec)
+{
+    fs_ctx *fs = &st->fs;
+    if (!st->fs_ready) {
+        // the metadata is complete, so the other images can be checked and mapped
+        if (!fs_ctx_init(fs, st->image, st->image_size) || fs->block_size != st->hdr.block_size) {
+            fprintf(stderr, "The dump does not hold an a1fs image\n");
+            return false;
+        }
+        st->fs_ready = true;
+        if (!fs_ctx_map_members(fs, st->opts->paths + 1, st->opts->n_paths - 1, true, 0)) return false;
+    }
+    if (rec->start + rec->count > fs_ctx_data_capacity(fs)) {
+        fprintf(stderr, "Invalid data record in the dump\n");
+        return false;
+    }
+
+    for (a1fs_blk_t b = rec->start, end = rec->start + rec->count; b < end; ) {
+        a1fs_blk_t n = fs_data_run(fs, b, end - b);
+        if (!get(st, fs_data_block(fs, b), (size_t)n << fs->block_shift)) return false;
+        b += n;
+    }
+    return true;
+}
+
+static bool restore(restore_state *st)
+{
+    if (!read_header(st)) return false;
+    if (!(st->hdr.since != 0 ? open_images(st) : create_images(st))) return false;
+
+    void *buf = NULL;
+    for (;;) {
+        a1fs_dump_rec rec;
+        if (!get(st, &rec, sizeof(rec))) break;
+        if (rec.type == A1FS_DUMP_END) {
+            free(buf);
+            if (rec.count != st->blocks) {
+                fprintf(stderr, "The dump has %lu blocks, %lu expected\n",
+                        (unsigned long)st->blocks, (unsigned long)rec.count);
+                return false;
+            }
+            if (!st->fs_ready && !fs_ctx_init(&st->fs, st->image, st->image_size)) {
+                fprintf(stderr, "The dump does not hold an a1fs image\n");
+                return false;
+            }
+            st->fs_ready = true;
+            return true;
+        }
+        if (rec.count == 0 || rec.count > A1FS_DUMP_RUN_MAX) {
+            fprintf(stderr, "Invalid record in the dump\n");
+            break;
+        }
+
+        bool ok;
+        switch (rec.type) {
+            case A1FS_DUMP_META:
+                if (buf == NULL) buf = malloc((size_t)A1FS_DUMP_RUN_MAX * st->hdr.block_size);
+                ok = buf != NULL && restore_meta(st, &rec, buf);
+                break;
+            case A1FS_DUMP_DATA:
+                ok = restore_data(st, &rec);
+                break;
+            default:
+                fprintf(stderr, "Unknown record type %u in the dump\n", rec.type);
+                ok = false;
+        }
+        if (!ok) break;
+        st->blocks += rec.count;
+    }
+    free(buf);
+    return false;
+}
+
+
+int main(int argc, char *argv[])
+{
+    restore_opts opts = {0};// defaults are all 0
+    if (!parse_args(argc, argv, &opts)) {
+        // Invalid arguments, print help to stderr
+        print_help(stderr, argv[0]);
+        return 1;
+    }
+    if (opts.help) {
+        // Help requested, print it to stdout
+        print_help(stdout, argv[0]);
+        return 0;
+    }
+
+    restore_state st = { .opts = &opts, .in = stdin };
+    for (unsigned int m = 0; m < A1FS_STRIPE_MAX; m++) st.fds[m] = -1;
+    if (opts.in_path != NULL && (st.in = fopen(opts.in_path, "r")) == NULL) {
+        perror(opts.in_path);
+        return 1;
+    }
+    setvbuf(st.in, NULL, _IOFBF, RESTORE_BUF_SIZE);
+
+    int ret = restore(&st) ? 0 : 1;
+    if (st.fs_ready) fs_ctx_destroy(&st.fs);
+    if (st.image != NULL) {
+        if (msync(st.image, st.image_size, MS_SYNC) < 0) {
+            perror(opts.paths[0]);
+            ret = 1;
+        }
+        munmap(st.image, st.image_size);
+    }
+    for (unsigned int m = 0; m < opts.n_paths; m++) {
+        if (st.fds[m] >= 0) close(st.fds[m]);
+    }
+    if (st.in != stdin) fclose(st.in);
+    return ret;
+}
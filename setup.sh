@@ -1,4 +1,4 @@
-fusermount -u /tmp/test
+fusermount3 -u /tmp/test
 rm -f _img_
 make
 truncate -s 10M _img_
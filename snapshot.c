@@ -0,0 +1,191 @@
+/**
+ * CSC369 Assignment 1 - File system snapshots implementation.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "extent.h"
+#include "reflink.h"
+#include "snapshot.h"
+
+
+/** Number of blocks in the inode table. */
+static a1fs_blk_t itable_blocks(fs_ctx *fs)
+{
+    return fs->sb->block_table - fs->sb->inode_table;
+}
+
+// A snapshot's run of blocks: header, inode bitmap copy, inode table copy
+
+static a1fs_snapshot *snap_hdr(fs_ctx *fs, a1fs_blk_t blk)
+{
+    return fs_data_block(fs, blk);
+}
+
+static a1fs_ibitmap *snap_ibitmap(fs_ctx *fs, a1fs_blk_t blk)
+{
+    return fs_data_block(fs, blk + 1);
+}
+
+static a1fs_inode *snap_itable(fs_ctx *fs, a1fs_blk_t blk)
+{
+    return fs_data_block(fs, blk + 2);
+}
+
+/**
+ * Find a snapshot by name.
+ *
+ * @param prev  receives the block of the next newer snapshot (0 if there is
+ *              none); can be NULL.
+ * @return      block of the snapshot header; 0 if there is no such snapshot.
+ */
+static a1fs_blk_t find(fs_ctx *fs, const char *name, a1fs_blk_t *prev)
+{
+    a1fs_blk_t newer = 0;
+    a1fs_blk_t blk = fs->sb->snap_head;
+    // the walk is bounded in case the list is corrupt
+    for (unsigned int i = 0; blk != 0 && blk < alloc_block_limit(fs) && i < A1FS_SNAP_MAX; i++) {
+        a1fs_snapshot *hdr = snap_hdr(fs, blk);
+        if (hdr->magic != A1FS_SNAP_MAGIC) break;
+        if (strncmp(hdr->name, name, A1FS_SNAP_NAME_MAX) == 0) {
+            if (prev != NULL) *prev = newer;
+            return blk;
+        }
+        newer = blk;
+        blk = hdr->next;
+    }
+    return 0;
+}
+
+/** Give the snapshot copy of a directory copies of the directory blocks. */
+static int copy_dir(fs_ctx *fs, a1fs_inode *copy, const a1fs_inode *dir)
+{
+    a1fs_ext_leaf leaf;
+    for (a1fs_blk_t l = 0; ext_find(fs, dir, l, &leaf); l = leaf.lblk + leaf.ext.count) {
+        for (a1fs_blk_t done = 0; done < leaf.ext.count; ) {
+            a1fs_blk_t got;
+            long b = alloc_blocks(fs, leaf.ext.start, leaf.ext.count - done, &got);
+            if (b < 0 || ext_append(fs, copy, b, got) < 0) {
+                if (b >= 0) free_blocks(fs, b, got);
+                ext_truncate(fs, copy, 0);
+                return -ENOSPC;
+            }
+            fs_data_copy(fs, b, leaf.ext.start + done, got);
+            done += got;
+        }
+    }
+    return 0;
+}
+
+/** Free the inodes of a snapshot below upto, then the snapshot's own blocks. */
+static void release(fs_ctx *fs, a1fs_blk_t blk, unsigned int upto)
+{
+    a1fs_ibitmap *ibitmap = snap_ibitmap(fs, blk);
+    a1fs_inode *itable = snap_itable(fs, blk);
+    for (unsigned int ino = 0; ino < upto; ino++) {
+        if (ibitmap->map[ino]) ext_truncate(fs, &itable[ino], 0);
+    }
+    free_blocks(fs, blk, snap_hdr(fs, blk)->blocks);
+}
+
+int snapshot_create(fs_ctx *fs, const char *name)
+{
+    size_t len = strnlen(name, A1FS_SNAP_NAME_MAX);
+    if (len == 0 || len == A1FS_SNAP_NAME_MAX) return -EINVAL;
+    if (find(fs, name, NULL) != 0) return -EEXIST;
+    if (fs->sb->snap_count >= A1FS_SNAP_MAX) return -EMLINK;
+
+    a1fs_blk_t n = 2 + itable_blocks(fs);
+    // the inode table copy is used as an array when the snapshot is mounted
+    long blk = alloc_flat_run(fs, 1, n);
+    if (blk < 0) return -ENOSPC;
+
+    a1fs_snapshot *hdr = snap_hdr(fs, blk);
+    memset(hdr, 0, fs->block_size);
+    hdr->magic = A1FS_SNAP_MAGIC;
+    strcpy(hdr->name, name);
+    clock_gettime(CLOCK_REALTIME, &hdr->ctime);
+    hdr->blocks = n;
+    hdr->used_inode_count = fs->sb->used_inode_count;
+
+    a1fs_ibitmap *ibitmap = snap_ibitmap(fs, blk);
+    memcpy(ibitmap, fs->ibitmap, fs->block_size);
+    a1fs_inode *itable = snap_itable(fs, blk);
+    memset(itable, 0, (size_t)itable_blocks(fs) << fs->block_shift);
+
+    // every inode gets an extent tree of its own; the blocks in it are copied
+    // for directories and shared for files
+    unsigned int limit = alloc_inode_limit(fs);
+    unsigned int ino;
+    int ret = 0;
+    for (ino = 0; ino < limit && ret == 0; ino++) {
+        if (!fs->ibitmap->map[ino]) continue;
+        const a1fs_inode *live = &fs->itable[ino];
+        if (live->flags & A1FS_INODE_ORPHAN) {
+            //being freed; not part of the snapshot
+            ibitmap->map[ino] = 0;
+            hdr->used_inode_count -= 1;
+            continue;
+        }
+        a1fs_inode *copy = &itable[ino];
+        *copy = *live;
+        ext_init(copy);
+        copy->block_count = 0;
+        ret = S_ISDIR(live->mode) ? copy_dir(fs, copy, live) : reflink_share(fs, copy, live);
+    }
+    if (ret < 0) {
+        release(fs, blk, ino);
+        return ret;
+    }
+
+    hdr->next = fs->sb->snap_head;
+    fs->sb->snap_head = blk;
+    fs->sb->snap_count += 1;
+    return 0;
+}
+
+int snapshot_delete(fs_ctx *fs, const char *name)
+{
+    a1fs_blk_t prev;
+    a1fs_blk_t blk = find(fs, name, &prev);
+    if (blk == 0) return -ENOENT;
+
+    if (prev == 0) {
+        fs->sb->snap_head = snap_hdr(fs, blk)->next;
+    } else {
+        snap_hdr(fs, prev)->next = snap_hdr(fs, blk)->next;
+        fs_data_changed(fs, prev, 1);
+    }
+    fs->sb->snap_count -= 1;
+    release(fs, blk, alloc_inode_limit(fs));
+    return 0;
+}
+
+void snapshot_list(fs_ctx *fs, struct a1fs_snap_list *list)
+{
+    memset(list, 0, sizeof(*list));
+    a1fs_blk_t blk = fs->sb->snap_head;
+    while (blk != 0 && blk < alloc_block_limit(fs) && list->count < A1FS_SNAP_MAX) {
+        a1fs_snapshot *hdr = snap_hdr(fs, blk);
+        if (hdr->magic != A1FS_SNAP_MAGIC) break;
+        memcpy(list->snaps[list->count].name, hdr->name, A1FS_SNAP_NAME_MAX);
+        list->snaps[list->count].ctime = hdr->ctime.tv_sec;
+        list->snaps[list->count].inodes = hdr->used_inode_count;
+        list->count++;
+        blk = hdr->next;
+    }
+}
+
+bool snapshot_mount(fs_ctx *fs, const char *name)
+{
+    a1fs_blk_t blk = find(fs, name, NULL);
+    if (blk == 0) return false;
+
+    fs->ibitmap = snap_ibitmap(fs, blk);
+    fs->itable = snap_itable(fs, blk);
+    fs->read_only = true;
+    return true;
+}
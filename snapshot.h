@@ -0,0 +1,47 @@
+/**
+ * CSC369 Assignment 1 - File system snapshots header file.
+ *
+ * A snapshot freezes the inode bitmap and the inode table of the file system
+ * (see a1fs_snapshot in a1fs.h). Files in the snapshot share their data blocks
+ * with the live files through the block reference counts, so taking one only
+ * costs metadata: a live write copies a shared block first (see reflink.h).
+ * Directories are small, so the snapshot gets its own copy of their blocks.
+ * A snapshot can be mounted read-only next to the live file system.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/**
+ * Take a snapshot of the live file system.
+ *
+ * @param fs    file system context.
+ * @param name  snapshot name.
+ * @return      0 on success; -EINVAL if the name is empty or too long;
+ *              -EEXIST if a snapshot with the name exists; -EMLINK if there
+ *              are A1FS_SNAP_MAX snapshots already or a block is shared too
+ *              many times; -ENOSPC if there is not enough free space.
+ */
+int snapshot_create(fs_ctx *fs, const char *name);
+
+/**
+ * Delete a snapshot. Blocks that only the snapshot used are freed.
+ *
+ * @return  0 on success; -ENOENT if there is no snapshot with the name.
+ */
+int snapshot_delete(fs_ctx *fs, const char *name);
+
+/** List the snapshots, newest first. */
+void snapshot_list(fs_ctx *fs, struct a1fs_snap_list *list);
+
+/**
+ * Switch a file system context over to a read-only view of a snapshot.
+ *
+ * @return  true on success; false if there is no snapshot with the name.
+ */
+bool snapshot_mount(fs_ctx *fs, const char *name);
@@ -0,0 +1,132 @@
+/**
+ * CSC369 Assignment 1 - a1fs snapshot manager.
+ *
+ * Creates, deletes and lists the snapshots of a mounted a1fs via the
+ * A1FS_IOC_SNAP_* ioctls. A snapshot is mounted with "a1fs -o snapshot=NAME".
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+
+
+/** Command line options. */
+typedef struct snapshot_opts {
+    /** A path on the mounted file system. */
+    const char *path;
+    /** Name of the snapshot to create. */
+    const char *create;
+    /** Name of the snapshot to delete. */
+    const char *delete;
+
+    /** Print help and exit. */
+    bool help;
+
+} snapshot_opts;
+
+static const char *help_str = "\
+Usage: %s options path\n\
+\n\
+Manage the snapshots of the a1fs mounted at (or containing) path. Lists the\n\
+snapshots if neither -c nor -d is given.\n\
+\n\
+Options:\n\
+    -c name  take a snapshot called name\n\
+    -d name  delete the snapshot called name\n\
+    -h       print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+    fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], snapshot_opts *opts)
+{
+    int o;
+    while ((o = getopt(argc, argv, "c:d:h")) != -1) {
+        switch (o) {
+            case 'c': opts->create = optarg; break;
+            case 'd': opts->delete = optarg; break;
+
+            case 'h': opts->help = true; return true;// skip other arguments
+
+            case '?': return false;
+            default : assert(false);
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Missing path\n");
+        return false;
+    }
+    opts->path = argv[optind];
+
+    if (opts->create && opts->delete) {
+        fprintf(stderr, "Only one of -c and -d can be given\n");
+        return false;
+    }
+    const char *name = opts->create ? opts->create : opts->delete;
+    if (name && (name[0] == '\0' || strlen(name) >= A1FS_SNAP_NAME_MAX)) {
+        fprintf(stderr, "Snapshot name must have 1 to %d characters\n", A1FS_SNAP_NAME_MAX - 1);
+        return false;
+    }
+    return true;
+}
+
+
+static bool list_snapshots(int fd)
+{
+    struct a1fs_snap_list list;
+    if (ioctl(fd, A1FS_IOC_SNAP_LIST, &list) < 0) return false;
+
+    for (uint32_t i = 0; i < list.count; i++) {
+        char date[64];
+        time_t t = list.snaps[i].ctime;
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        printf("%-*s  %s  %u inodes\n", 20, list.snaps[i].name, date, list.snaps[i].inodes);
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    snapshot_opts opts = {0};// defaults are all 0
+    if (!parse_args(argc, argv, &opts)) {
+        // Invalid arguments, print help to stderr
+        print_help(stderr, argv[0]);
+        return 1;
+    }
+    if (opts.help) {
+        // Help requested, print it to stdout
+        print_help(stdout, argv[0]);
+        return 0;
+    }
+
+    int fd = open(opts.path, O_RDONLY);
+    if (fd < 0) {
+        perror(opts.path);
+        return 1;
+    }
+
+    bool ok;
+    if (opts.create || opts.delete) {
+        struct a1fs_snap_name name = {0};
+        strcpy(name.name, opts.create ? opts.create : opts.delete);
+        ok = ioctl(fd, opts.create ? A1FS_IOC_SNAP_CREATE : A1FS_IOC_SNAP_DELETE, &name) == 0;
+    } else {
+        ok = list_snapshots(fd);
+    }
+    if (!ok) fprintf(stderr, "%s: %s\n", opts.path, strerror(errno));
+    close(fd);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,367 @@
+/**
+ * CSC369 Assignment 1 - a1fs space layout statistics.
+ *
+ * Reports how fragmented the free space and the files of an image are, how
+ * full the directories are, and whether the superblock counters match the
+ * bitmaps. The image is mapped read-only, so it can also be inspected while it
+ * is mounted (the report is then only as consistent as the moment it is taken).
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "alloc.h"
+#include "extent.h"
+#include "fs_ctx.h"
+#include "map.h"
+
+
+/** Command line options. */
+typedef struct stat_opts {
+    /** Image file path. */
+    const char *img_path;
+    /** The other image files of a striped file system. */
+    char *const *members;
+    unsigned int n_members;
+
+    /** Print help and exit. */
+    bool help;
+    /** Print JSON instead of text. */
+    bool json;
+    /** Report every file and directory, not just the worst ones. */
+    bool verbose;
+
+} stat_opts;
+
+static const char *help_str = "\
+Usage: %s options image [image...]\n\
+\n\
+Report the free space fragmentation, the extents and fragmentation score of\n\
+each file, the size and fill factor of each directory, and the inode and\n\
+block usage against the superblock counters. The image can be mounted.\n\
+A file system striped over several image files needs all of them, in order.\n\
+\n\
+Options:\n\
+    -j      print JSON\n\
+    -v      report every file and directory (always done with -j)\n\
+    -h      print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+    fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], stat_opts *opts)
+{
+    int o;
+    while ((o = getopt(argc, argv, "jvh")) != -1) {
+        switch (o) {
+            case 'j': opts->json    = true; break;
+            case 'v': opts->verbose = true; break;
+
+            case 'h': opts->help = true; return true;// skip other arguments
+
+            case '?': return false;
+            default : assert(false);
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Missing image path\n");
+        return false;
+    }
+    opts->img_path = argv[optind];
+    opts->members = argv + optind + 1;
+    opts->n_members = argc - optind - 1;
+    return true;
+}
+
+
+/** Number of files listed in the text report without -v. */
+#define WORST_FILES 10
+
+/** Layout of one file or directory. */
+typedef struct node_stats {
+    char *path;
+    a1fs_ino_t ino;
+    bool dir;
+    uint64_t size;
+    /** Data blocks, extents, and extent tree depth. */
+    unsigned int blocks;
+    unsigned int extents;
+    unsigned int depth;
+    /** Places where the next extent does not start right after the previous one. */
+    unsigned int breaks;
+    /** Directories: entries in use and entry slots. */
+    unsigned int entries;
+    unsigned int slots;
+} node_stats;
+
+/** Everything collected from the image. */
+typedef struct image_stats {
+    fs_ctx *fs;
+    node_stats *nodes;
+    unsigned int n_nodes;
+    /** Inodes already visited, to stop at directory cycles. */
+    bool *seen;
+
+    unsigned int used_blocks;
+    unsigned int used_inodes;
+    unsigned int free_blocks;
+    unsigned int largest_free;
+    a1fs_summary summary;
+} image_stats;
+
+/**
+ * Fragmentation score of a file: the percentage of block boundaries inside the
+ * file where the data is not contiguous. 0 for a single extent (or for
+ * clusters laid out back to back), 100 if no two blocks are adjacent.
+ */
+static double frag_score(const node_stats *n)
+{
+    return n->blocks > 1 ? 100.0 * n->breaks / (n->blocks - 1) : 0.0;
+}
+
+/** Collect the layout of an inode and, for a directory, of everything below it. */
+static void walk(image_stats *st, a1fs_ino_t ino, const char *path)
+{
+    fs_ctx *fs = st->fs;
+    if (ino >= alloc_inode_limit(fs) || st->seen[ino]) return;
+    st->seen[ino] = true;
+
+    a1fs_inode *in = &fs->itable[ino];
+    node_stats *n = &st->nodes[st->n_nodes];
+    n->path = strdup(path);
+    if (n->path == NULL) return;
+    st->n_nodes++;
+    n->ino = ino;
+    n->dir = S_ISDIR(in->mode);
+    n->size = in->size;
+    n->depth = in->ext_hdr.depth;
+
+    a1fs_ext_leaf leaf;
+    a1fs_blk_t next = 0;
+    for (a1fs_blk_t l = 0; ext_find(fs, in, l, &leaf); l = leaf.lblk + leaf.ext.count) {
+        a1fs_blk_t pcount = ext_pcount(fs, &leaf);
+        if (n->extents > 0 && leaf.ext.start != next) n->breaks++;
+        next = leaf.ext.start + pcount;
+        n->blocks += pcount;
+        n->extents++;
+    }
+    if (!n->dir) return;
+
+    unsigned int per_block = fs->block_size / sizeof(a1fs_dentry);
+    a1fs_blk_t nblocks = ext_nblocks(fs, in);
+    for (a1fs_blk_t l = 0; l < nblocks; l++) {
+        a1fs_blk_t b;
+        if (!ext_map(fs, in, l, &b, NULL)) break;
+        a1fs_dentry *entry = fs_data_block(fs, b);
+        n->slots += per_block;
+        for (unsigned int i = 0; i < per_block; i++) {
+            if (entry[i].name[0] == '\0') continue;
+            n->entries++;
+
+            char child[A1FS_PATH_MAX];
+            snprintf(child, sizeof(child), "%s/%.*s", ino == 0 ? "" : path,
+                     A1FS_NAME_MAX - 1, entry[i].name);
+            walk(st, entry[i].ino, child);
+        }
+    }
+}
+
+static void collect(image_stats *st)
+{
+    fs_ctx *fs = st->fs;
+    unsigned int block_limit = alloc_block_limit(fs);
+
+    fs_ctx_summary_build(fs, &st->summary);
+    st->used_blocks = st->summary.used_blocks;
+    st->used_inodes = st->summary.used_inodes;
+    st->free_blocks = block_limit - st->used_blocks;
+
+    unsigned int run = 0;
+    for (unsigned int b = 0; b < block_limit; b++) {
+        run = fs->bbitmap->map[b] ? 0 : run + 1;
+        if (run > st->largest_free) st->largest_free = run;
+    }
+
+    walk(st, 0, "/");
+}
+
+
+/** Print a string as a JSON string literal. */
+static void json_string(const char *s)
+{
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') printf("\\%c", c);
+        else if (c < 0x20) printf("\\u%04x", c);
+        else putchar(c);
+    }
+    putchar('"');
+}
+
+static void print_json(const image_stats *st)
+{
+    a1fs_superblock *sb = st->fs->sb;
+    printf("{\n  \"block_size\": %u,\n", st->fs->block_size);
+    printf("  \"inodes\": {\"total\": %u, \"used\": %u, \"sb_used\": %u},\n",
+           alloc_inode_limit(st->fs), st->used_inodes, sb->used_inode_count);
+    printf("  \"blocks\": {\"total\": %u, \"used\": %u, \"sb_used\": %u, \"free\": %u},\n",
+           alloc_block_limit(st->fs), st->used_blocks, sb->used_block_count, st->free_blocks);
+    printf("  \"largest_free_run\": %u,\n  \"free_runs\": [", st->largest_free);
+    for (unsigned int i = 0; i < A1FS_SUMMARY_RUN_CLASSES; i++) {
+        printf("%s%u", i > 0 ? ", " : "", st->summary.runs[i]);
+    }
+    printf("],\n  \"files\": [");
+
+    bool first = true;
+    for (unsigned int i = 0; i < st->n_nodes; i++) {
+        const node_stats *n = &st->nodes[i];
+        if (n->dir) continue;
+        printf("%s\n    {\"path\": ", first ? "" : ",");
+        json_string(n->path);
+        printf(", \"ino\": %u, \"size\": %lu, \"blocks\": %u, \"extents\": %u, \"depth\": %u, "
+               "\"frag\": %.1f}", n->ino, (unsigned long)n->size, n->blocks, n->extents,
+               n->depth, frag_score(n));
+        first = false;
+    }
+    printf("\n  ],\n  \"dirs\": [");
+
+    first = true;
+    for (unsigned int i = 0; i < st->n_nodes; i++) {
+        const node_stats *n = &st->nodes[i];
+        if (!n->dir) continue;
+        printf("%s\n    {\"path\": ", first ? "" : ",");
+        json_string(n->path);
+        printf(", \"ino\": %u, \"blocks\": %u, \"entries\": %u, \"slots\": %u, \"fill\": %.3f}",
+               n->ino, n->blocks, n->entries, n->slots,
+               n->slots > 0 ? (double)n->entries / n->slots : 0.0);
+        first = false;
+    }
+    printf("\n  ]\n}\n");
+}
+
+/** Order files by decreasing fragmentation, then by extent count. */
+static int by_frag(const void *a, const void *b)
+{
+    const node_stats *x = a, *y = b;
+    double fx = x->dir ? -1.0 : frag_score(x), fy = y->dir ? -1.0 : frag_score(y);
+    if (fx != fy) return fx < fy ? 1 : -1;
+    return (int)y->extents - (int)x->extents;
+}
+
+static void print_text(image_stats *st, bool verbose)
+{
+    a1fs_superblock *sb = st->fs->sb;
+    printf("Inodes: %u/%u used", st->used_inodes, alloc_inode_limit(st->fs));
+    if (sb->used_inode_count != st->used_inodes) printf(" (superblock says %u)", sb->used_inode_count);
+    printf("\nBlocks: %u/%u used", st->used_blocks, alloc_block_limit(st->fs));
+    if (sb->used_block_count != st->used_blocks) printf(" (superblock says %u)", sb->used_block_count);
+    printf("\nFree space: %u blocks, largest free run %u blocks\n", st->free_blocks, st->largest_free);
+    printf("Free runs by length:\n");
+    for (unsigned int i = 0; i < A1FS_SUMMARY_RUN_CLASSES; i++) {
+        if (st->summary.runs[i] == 0) continue;
+        printf("  %6u-%-6u %u\n", 1u << i, (2u << i) - 1, st->summary.runs[i]);
+    }
+
+    unsigned int files = 0, extents = 0, fragmented = 0;
+    unsigned int dirs = 0, entries = 0, slots = 0;
+    for (unsigned int i = 0; i < st->n_nodes; i++) {
+        const node_stats *n = &st->nodes[i];
+        if (n->dir) {
+            dirs++;
+            entries += n->entries;
+            slots += n->slots;
+        } else {
+            files++;
+            extents += n->extents;
+            if (n->breaks > 0) fragmented++;
+        }
+    }
+    printf("Files: %u, %u extents (%.2f per file), %u fragmented\n", files, extents,
+           files > 0 ? (double)extents / files : 0.0, fragmented);
+    printf("Directories: %u, %u/%u entries in use (fill %.1f%%)\n", dirs, entries, slots,
+           slots > 0 ? 100.0 * entries / slots : 0.0);
+
+    qsort(st->nodes, st->n_nodes, sizeof(*st->nodes), by_frag);
+    printf("%s:\n", verbose ? "Files" : "Most fragmented files");
+    for (unsigned int i = 0, shown = 0; i < st->n_nodes && (verbose || shown < WORST_FILES); i++) {
+        const node_stats *n = &st->nodes[i];
+        if (n->dir || (!verbose && n->breaks == 0)) continue;
+        printf("  %5.1f%%  %6u extents  depth %u/%u  %8u blocks  %s\n", frag_score(n),
+               n->extents, n->depth, A1FS_EXT_MAX_DEPTH, n->blocks, n->path);
+        shown++;
+    }
+    if (!verbose) return;
+
+    printf("Directories:\n");
+    for (unsigned int i = 0; i < st->n_nodes; i++) {
+        const node_stats *n = &st->nodes[i];
+        if (!n->dir) continue;
+        printf("  %6u entries  %6u slots  %5.1f%%  %s\n", n->entries, n->slots,
+               n->slots > 0 ? 100.0 * n->entries / n->slots : 0.0, n->path);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    stat_opts opts = {0};// defaults are all 0
+    if (!parse_args(argc, argv, &opts)) {
+        // Invalid arguments, print help to stderr
+        print_help(stderr, argv[0]);
+        return 1;
+    }
+    if (opts.help) {
+        // Help requested, print it to stdout
+        print_help(stdout, argv[0]);
+        return 0;
+    }
+
+    size_t size;
+    void *image = map_file_readonly(opts.img_path, A1FS_BLOCK_SIZE, &size);
+    if (image == NULL) return 1;
+
+    int ret = 1;
+    fs_ctx fs = {0};
+    if (!fs_ctx_init(&fs, image, size)) {
+        fprintf(stderr, "%s: not an a1fs image\n", opts.img_path);
+        goto end;
+    }
+    if (!fs_ctx_map_members(&fs, opts.members, opts.n_members, false, 0)) {
+        fs_ctx_destroy(&fs);
+        goto end;
+    }
+
+    image_stats st = { .fs = &fs };
+    st.nodes = calloc(alloc_inode_limit(&fs), sizeof(*st.nodes));
+    st.seen = calloc(alloc_inode_limit(&fs), sizeof(*st.seen));
+    if (st.nodes == NULL || st.seen == NULL) {
+        fprintf(stderr, "Out of memory\n");
+    } else {
+        collect(&st);
+        if (opts.json) {
+            print_json(&st);
+        } else {
+            print_text(&st, opts.verbose);
+        }
+        ret = 0;
+    }
+    for (unsigned int i = 0; i < st.n_nodes; i++) free(st.nodes[i].path);
+    free(st.nodes);
+    free(st.seen);
+    fs_ctx_destroy(&fs);
+
+end:
+    munmap(image, size);
+    return ret;
+}